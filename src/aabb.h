@@ -70,25 +70,29 @@ class aabb
 
         // Optimized version
         for (int a = 0; a < 3; a++)
-        {
-            auto invD = 1 / r.direction()[a];
-            auto orig = r.origin()[a];
+            if (!clip_slab(axis(a).min, axis(a).max, r.origin()[a], r.direction()[a], ray_t))
+                return false;
+        return true;
+    }
 
-            auto t0 = (axis(a).min - orig) * invD;
-            auto t1 = (axis(a).max - orig) * invD;
+    static bool clip_slab(double min, double max, double orig, double direction, interval &ray_t)
+    {
+        // Narrows ray_t to where the ray is between the planes at min and max on one axis, and
+        // returns false once nothing is left. Scene caches test their flat nodes with it too.
+        auto invD = 1 / direction;
 
-            if (invD < 0)
-                std::swap(t0, t1);
+        auto t0 = (min - orig) * invD;
+        auto t1 = (max - orig) * invD;
 
-            if (t0 > ray_t.min)
-                ray_t.min = t0;
-            if (t1 < ray_t.max)
-                ray_t.max = t1;
+        if (invD < 0)
+            std::swap(t0, t1);
 
-            if (ray_t.max <= ray_t.min)
-                return false;
-        }
-        return true;
+        if (t0 > ray_t.min)
+            ray_t.min = t0;
+        if (t1 < ray_t.max)
+            ray_t.max = t1;
+
+        return !(ray_t.max <= ray_t.min); // Not max > min: a NaN bound (0 * inf) must not miss
     }
 };
 
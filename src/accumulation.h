@@ -0,0 +1,182 @@
+#ifndef ACCUMULATION_H
+#define ACCUMULATION_H
+
+#include "rtweekend.h"
+
+#include "color.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Accumulation file (.acc) layout, all fields little-endian:
+//
+//   acc_header                       magic "RTA1", image size, sampler, seed and sample range
+//   float sums[height][width][3]     per-pixel sums of linear radiance samples, rows top to bottom
+//   uint32 counts[height][width]     number of samples in each sum
+//
+// Sums are kept unnormalized and linear, so any number of partial renders of the same frame merge
+// by adding sums and counts; the spp division and gamma happen only when an image is written.
+
+struct acc_header
+{
+    char magic[4];
+    uint32_t width;
+    uint32_t height;
+    uint32_t sampler;      // sampler_kind the samples were drawn with
+    uint32_t seed;         // camera::sampler_seed
+    uint32_t sample_begin; // Sample indices [sample_begin, sample_end) were traced in every pixel
+    uint32_t sample_end;
+};
+
+class accumulation
+{
+  public:
+    acc_header header = {{'R', 'T', 'A', '1'}, 0, 0, 0, 0, 0, 0};
+    std::vector<float> sums;      // 3 per pixel
+    std::vector<uint32_t> counts; // 1 per pixel
+
+    accumulation()
+    {
+    }
+
+    accumulation(const std::vector<color> &framebuffer, int width, int height, sampler_kind sampler, unsigned seed,
+                 int sample_begin, int sample_end)
+        : accumulation(framebuffer, std::vector<uint32_t>(framebuffer.size(), sample_end - sample_begin), width,
+                       height, sampler, seed, sample_begin, sample_end)
+    {
+        // From a framebuffer of per-pixel sums over samples [sample_begin, sample_end).
+    }
+
+    accumulation(const std::vector<color> &framebuffer, const std::vector<uint32_t> &sample_counts, int width,
+                 int height, sampler_kind sampler, unsigned seed, int sample_begin, int sample_end)
+        : sums(3 * framebuffer.size()), counts(sample_counts)
+    {
+        // From a render in progress: pixel i holds the sum of samples [sample_begin,
+        // sample_begin + sample_counts[i]).
+        header.width = width;
+        header.height = height;
+        header.sampler = static_cast<uint32_t>(sampler);
+        header.seed = seed;
+        header.sample_begin = sample_begin;
+        header.sample_end = sample_end;
+        for (size_t i = 0; i < framebuffer.size(); i++)
+            for (int c = 0; c < 3; c++)
+                sums[3 * i + c] = static_cast<float>(framebuffer[i][c]);
+    }
+
+    size_t pixel_count() const
+    {
+        return static_cast<size_t>(header.width) * header.height;
+    }
+
+    bool read(const std::string &path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        return read(file, path);
+    }
+
+    bool read(std::istream &in, const std::string &name)
+    {
+        // Reads the layout above from the current position of in; name is only used in errors.
+        if (!in.read(reinterpret_cast<char *>(&header), sizeof(header)) || std::memcmp(header.magic, "RTA1", 4) != 0)
+        {
+            std::cerr << "ERROR: '" << name << "' is not an accumulation file.\n";
+            return false;
+        }
+
+        // Check the size against what is left of the stream before allocating for it.
+        auto here = in.tellg();
+        in.seekg(0, std::ios::end);
+        auto end = in.tellg();
+        in.seekg(here);
+        if (here < 0 || end < here || pixel_count() > static_cast<uint64_t>(end - here) / (4 * sizeof(float)))
+        {
+            std::cerr << "ERROR: '" << name << "' is truncated.\n";
+            return false;
+        }
+
+        sums.resize(3 * pixel_count());
+        counts.resize(pixel_count());
+        if (!in.read(reinterpret_cast<char *>(sums.data()), sums.size() * sizeof(float)) ||
+            !in.read(reinterpret_cast<char *>(counts.data()), counts.size() * sizeof(uint32_t)))
+        {
+            std::cerr << "ERROR: '" << name << "' is truncated.\n";
+            return false;
+        }
+        return true;
+    }
+
+    bool write(const std::string &path) const
+    {
+        std::ofstream file(path, std::ios::binary);
+        write(file);
+        if (!file)
+        {
+            std::cerr << "ERROR: Could not write '" << path << "'.\n";
+            return false;
+        }
+        return true;
+    }
+
+    void write(std::ostream &out) const
+    {
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(sums.data()), sums.size() * sizeof(float));
+        out.write(reinterpret_cast<const char *>(counts.data()), counts.size() * sizeof(uint32_t));
+    }
+
+    bool add(const accumulation &other)
+    {
+        // Adds another part of the same render: the same frame, sampler and seed, with a sample
+        // range that overlaps or touches this one, so the span of both still describes the
+        // samples. Add parts in order of their ranges.
+        if (other.header.width != header.width || other.header.height != header.height)
+        {
+            std::cerr << "ERROR: Can't merge a " << other.header.width << 'x' << other.header.height << " image into a "
+                      << header.width << 'x' << header.height << " one.\n";
+            return false;
+        }
+        if (other.header.sampler != header.sampler || other.header.seed != header.seed)
+        {
+            std::cerr << "ERROR: Can't merge samples of seed " << other.header.seed << " into samples of seed "
+                      << header.seed << " or of another sampler.\n";
+            return false;
+        }
+        if (other.header.sample_begin > header.sample_end || header.sample_begin > other.header.sample_end)
+        {
+            std::cerr << "ERROR: Can't merge samples [" << other.header.sample_begin << ", " << other.header.sample_end
+                      << ") into [" << header.sample_begin << ", " << header.sample_end
+                      << "): the samples between them are missing.\n";
+            return false;
+        }
+
+        for (size_t i = 0; i < sums.size(); i++)
+            sums[i] += other.sums[i];
+        for (size_t i = 0; i < counts.size(); i++)
+            counts[i] += other.counts[i];
+        header.sample_begin = std::min(header.sample_begin, other.header.sample_begin);
+        header.sample_end = std::max(header.sample_end, other.header.sample_end);
+        return true;
+    }
+
+    color mean(size_t pixel) const
+    {
+        if (counts[pixel] == 0)
+            return color(0, 0, 0);
+        return color(sums[3 * pixel], sums[3 * pixel + 1], sums[3 * pixel + 2]) / counts[pixel];
+    }
+
+    void write_ppm(std::ostream &out) const
+    {
+        out << "P3\n" << header.width << ' ' << header.height << "\n255\n";
+        for (size_t i = 0; i < pixel_count(); i++)
+            write_color(out, mean(i), 1);
+    }
+};
+
+#endif
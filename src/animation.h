@@ -0,0 +1,200 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "example.h"
+#include "external/log.h"
+#include "external/params.h"
+#include "scene_cache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+// Animation file: one key=value per line like parameters.txt, except that keys repeat.
+//
+//   frames=<count>
+//   camera=<frame>,<lookfrom x,y,z>,<lookat x,y,z>,<vfov>
+//   object=<index>,<frame>,<offset x,y,z>,<degrees around y>
+//
+// Keys are interpolated linearly between frames and held before the first and after the last
+// one. Objects are the scene's top-level objects, numbered in the order the scene function adds
+// them; an object is turned around its own vertical axis, then moved by offset (see movable).
+// Without camera keys the scene's own camera stays put.
+
+struct camera_key
+{
+    double frame;
+    point3 lookfrom;
+    point3 lookat;
+    double vfov;
+};
+
+struct object_key
+{
+    double frame;
+    vec3 offset;
+    double angle;
+};
+
+inline camera_key blend(const camera_key &a, const camera_key &b, double t)
+{
+    return {a.frame + t * (b.frame - a.frame), a.lookfrom + t * (b.lookfrom - a.lookfrom),
+            a.lookat + t * (b.lookat - a.lookat), a.vfov + t * (b.vfov - a.vfov)};
+}
+
+inline object_key blend(const object_key &a, const object_key &b, double t)
+{
+    return {a.frame + t * (b.frame - a.frame), a.offset + t * (b.offset - a.offset), a.angle + t * (b.angle - a.angle)};
+}
+
+template <typename Key> Key key_at(const std::vector<Key> &keys, double frame)
+{
+    // keys must be sorted by frame and not empty.
+    if (frame <= keys.front().frame)
+        return keys.front();
+    if (frame >= keys.back().frame)
+        return keys.back();
+    auto next = std::upper_bound(keys.begin(), keys.end(), frame,
+                                 [](double f, const Key &key) { return f < key.frame; });
+    auto prev = next - 1;
+    return blend(*prev, *next, (frame - prev->frame) / (next->frame - prev->frame));
+}
+
+class animation
+{
+  public:
+    int frames = 1;
+    std::vector<camera_key> camera_keys;
+    std::map<int, std::vector<object_key>> object_keys; // By top-level object index
+
+    bool read(const std::string &path)
+    {
+        std::ifstream file(path);
+        if (!file.is_open())
+        {
+            std::cerr << "Error: Failed to open file " << path << std::endl;
+            return false;
+        }
+
+        std::string line;
+        for (int number = 1; std::getline(file, line); number++)
+        {
+            auto equals = line.find('=');
+            if (line.empty() || line[0] == '#' || equals == std::string::npos)
+                continue;
+            auto key = line.substr(0, equals);
+            std::vector<double> v;
+            for (const auto &token : splitComma(line.substr(equals + 1)))
+                v.push_back(std::stod(token));
+
+            if (key == "frames" && v.size() == 1)
+                frames = std::max(1, static_cast<int>(v[0]));
+            else if (key == "camera" && v.size() == 8)
+                camera_keys.push_back({v[0], point3(v[1], v[2], v[3]), point3(v[4], v[5], v[6]), v[7]});
+            else if (key == "object" && v.size() == 6)
+                object_keys[static_cast<int>(v[0])].push_back({v[1], vec3(v[2], v[3], v[4]), v[5]});
+            else
+            {
+                std::cerr << "Error: " << path << ':' << number << ": expected frames=, camera= or object=\n";
+                return false;
+            }
+        }
+
+        auto by_frame = [](const auto &a, const auto &b) { return a.frame < b.frame; };
+        std::stable_sort(camera_keys.begin(), camera_keys.end(), by_frame);
+        for (auto &track : object_keys)
+            std::stable_sort(track.second.begin(), track.second.end(), by_frame);
+        return true;
+    }
+};
+
+bool render_animation(int choice, const RenderParameters &params, const animation &anim, const std::string &base)
+{
+    // Renders the frames of anim to <base>.frame<NNNN>.ppm. The scene is built once: textures,
+    // noise tables and BVHs persist across frames, and the animated objects only move, so a
+    // top-level BVH built for the first placement is refit per frame instead of rebuilt.
+    auto seconds_since = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    auto build_start = std::chrono::steady_clock::now();
+    scene s;
+    if (!load_scene(choice, params, s))
+        return false;
+
+    std::vector<std::pair<shared_ptr<movable>, const std::vector<object_key> *>> movers;
+    for (const auto &track : anim.object_keys)
+    {
+        if (track.first < 0 || track.first >= static_cast<int>(s.world.objects.size()))
+        {
+            std::cerr << "Error: The scene has no object " << track.first << " (it has "
+                      << s.world.objects.size() << ")\n";
+            return false;
+        }
+        auto mover = make_shared<movable>(s.world.objects[track.first]);
+        s.world.objects[track.first] = mover;
+        movers.push_back({mover, &track.second});
+    }
+    for (const auto &mover : movers)
+    {
+        auto key = key_at(*mover.second, 0);
+        mover.first->place(key.offset, key.angle);
+    }
+    auto root = make_shared<bvh_node>(s.world);
+    LOG(INFO) << "ANIMATION: " << anim.frames << " FRAMES, " << movers.size() << " MOVING OBJECTS, SCENE BUILT IN "
+              << seconds_since(build_start) << "s";
+
+    double total_setup = 0, total_trace = 0;
+    for (int frame = 0; frame < anim.frames; frame++)
+    {
+        auto setup_start = std::chrono::steady_clock::now();
+        for (const auto &mover : movers)
+        {
+            auto key = key_at(*mover.second, frame);
+            mover.first->place(key.offset, key.angle);
+        }
+        if (!movers.empty())
+            root->refit();
+        hittable_list world(root);
+
+        if (!anim.camera_keys.empty())
+        {
+            auto key = key_at(anim.camera_keys, frame);
+            s.cam.lookfrom = key.lookfrom;
+            s.cam.lookat = key.lookat;
+            s.cam.vfov = key.vfov;
+        }
+
+        char number[24];
+        std::snprintf(number, sizeof(number), ".frame%04d", frame);
+        auto name = base + number;
+        if (params.write_aovs)
+            s.cam.aov_prefix = name;
+        auto setup = seconds_since(setup_start);
+
+        auto trace_start = std::chrono::steady_clock::now();
+        std::ofstream file(name + ".ppm");
+        s.cam.image_out = &file;
+        s.cam.render(world, s.lights);
+        auto trace = seconds_since(trace_start);
+
+        total_setup += setup;
+        total_trace += trace;
+        LOG(INFO) << "FRAME " << frame << ": SETUP " << setup << "s, TRACE " << trace << "s";
+        std::cout << name << ".ppm: setup " << setup << "s, trace " << trace << "s" << std::endl;
+    }
+
+    LOG(INFO) << "ANIMATION DONE: SETUP " << total_setup << "s, TRACE " << total_trace << "s";
+    std::cout << anim.frames << " frames: setup " << total_setup << "s, trace " << total_trace << "s" << std::endl;
+    return true;
+}
+
+#endif
@@ -0,0 +1,186 @@
+#ifndef AOV_H
+#define AOV_H
+
+#include "rtweekend.h"
+
+#include "color.h"
+#include "denoise.h"
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct first_hit
+{
+    // What a camera sample saw at its first intersection, for the auxiliary outputs.
+    bool valid = false;   // False if the camera ray escaped
+    color albedo;         // Surface reflectance (or clamped emission / background)
+    vec3 normal;          // Shading normal, facing the camera
+    double depth = 0;     // Distance from the camera along the ray
+    int prim_id = -1;     // hittable::id of the primitive
+    int material_id = -1; // material::id of its material
+};
+
+inline bool write_pfm(const std::string &path, int width, int height, int channels, const std::vector<float> &data)
+{
+    // Writes a little-endian PFM image ("PF" for RGB, "Pf" for grayscale). data holds rows from
+    // top to bottom; PFM stores them bottom to top.
+    std::ofstream file(path, std::ios::binary);
+    if (!file)
+    {
+        std::cerr << "ERROR: Could not write '" << path << "'.\n";
+        return false;
+    }
+
+    file << (channels == 3 ? "PF" : "Pf") << '\n' << width << ' ' << height << "\n-1.0\n";
+    for (int y = height - 1; y >= 0; y--)
+        file.write(reinterpret_cast<const char *>(data.data() + static_cast<size_t>(y) * width * channels),
+                   sizeof(float) * width * channels);
+    return static_cast<bool>(file);
+}
+
+class aov_buffers
+{
+    // Float accumulation buffers for the beauty image and the auxiliary output variables. Every
+    // sample of a pixel is added with add_sample(); write() turns the sums into per-pixel values.
+  public:
+    void resize(int _width, int _height)
+    {
+        width = _width;
+        height = _height;
+        auto n = static_cast<size_t>(width) * height;
+        beauty.assign(n, color(0, 0, 0));
+        albedo.assign(n, color(0, 0, 0));
+        normal.assign(n, vec3(0, 0, 0));
+        depth.assign(n, 0.0);
+        hits.assign(n, 0);
+        prim_id.assign(n, -1);
+        material_id.assign(n, -1);
+        luminance.assign(n, 0.0);
+        luminance_sq.assign(n, 0.0);
+        samples.assign(n, 0);
+    }
+
+    void add_sample(int pixel, const color &radiance, const first_hit &hit)
+    {
+        // NaNs are dropped here as in write_color(), so they don't poison the statistics.
+        auto r = radiance.x() == radiance.x() ? radiance.x() : 0.0;
+        auto g = radiance.y() == radiance.y() ? radiance.y() : 0.0;
+        auto b = radiance.z() == radiance.z() ? radiance.z() : 0.0;
+        auto y = 0.2126 * r + 0.7152 * g + 0.0722 * b;
+
+        beauty[pixel] += color(r, g, b);
+        luminance[pixel] += y;
+        luminance_sq[pixel] += y * y;
+        samples[pixel]++;
+
+        albedo[pixel] += hit.albedo;
+        if (!hit.valid)
+            return;
+
+        normal[pixel] += hit.normal;
+        depth[pixel] += hit.depth;
+        if (hits[pixel]++ == 0)
+        {
+            // Ids can't be averaged; keep the first sample's.
+            prim_id[pixel] = hit.prim_id;
+            material_id[pixel] = hit.material_id;
+        }
+    }
+
+    denoise_input denoiser_input() const
+    {
+        // The per-pixel means the denoiser is guided by.
+        denoise_input in;
+        in.width = width;
+        in.height = height;
+        auto n = static_cast<size_t>(width) * height;
+        for (int c = 0; c < 3; c++)
+        {
+            in.radiance[c].resize(n);
+            in.albedo[c].resize(n);
+            in.normal[c].resize(n);
+        }
+        in.variance.resize(n);
+
+        for (size_t i = 0; i < n; i++)
+        {
+            auto per_sample = samples[i] > 0 ? 1.0 / samples[i] : 0.0;
+            auto unit_normal = normal[i].length_squared() > 0 ? unit_vector(normal[i]) : vec3(0, 0, 0);
+            for (int c = 0; c < 3; c++)
+            {
+                in.radiance[c][i] = static_cast<float>(beauty[i][c] * per_sample);
+                in.albedo[c][i] = static_cast<float>(albedo[i][c] * per_sample);
+                in.normal[c][i] = static_cast<float>(unit_normal[c]);
+            }
+            in.variance[i] = static_cast<float>(mean_variance(i));
+        }
+        return in;
+    }
+
+    bool write(const std::string &prefix) const
+    {
+        // Writes <prefix>.<name>.pfm for the linear beauty image and each auxiliary output:
+        //   color, albedo    mean over samples
+        //   normal           mean over samples that hit, renormalized
+        //   depth            mean over samples that hit (infinity if none did)
+        //   prim_id, mat_id  ids from the first sample that hit (-1 if none did)
+        //   variance         variance of the pixel's mean luminance, s^2 / n
+        //   samples          sample count
+        auto n = static_cast<size_t>(width) * height;
+        std::vector<float> rgb(3 * n), gray(n);
+        bool ok = true;
+
+        auto write_rgb = [&](const char *name, auto value) {
+            for (size_t i = 0; i < n; i++)
+            {
+                auto c = value(i);
+                rgb[3 * i] = static_cast<float>(c.x());
+                rgb[3 * i + 1] = static_cast<float>(c.y());
+                rgb[3 * i + 2] = static_cast<float>(c.z());
+            }
+            ok = write_pfm(prefix + "." + name + ".pfm", width, height, 3, rgb) && ok;
+        };
+        auto write_gray = [&](const char *name, auto value) {
+            for (size_t i = 0; i < n; i++)
+                gray[i] = static_cast<float>(value(i));
+            ok = write_pfm(prefix + "." + name + ".pfm", width, height, 1, gray) && ok;
+        };
+        auto per_sample = [&](size_t i) { return samples[i] > 0 ? 1.0 / samples[i] : 0.0; };
+
+        write_rgb("color", [&](size_t i) { return beauty[i] * per_sample(i); });
+        write_rgb("albedo", [&](size_t i) { return albedo[i] * per_sample(i); });
+        write_rgb("normal", [&](size_t i) {
+            return normal[i].length_squared() > 0 ? unit_vector(normal[i]) : vec3(0, 0, 0);
+        });
+        write_gray("depth", [&](size_t i) { return hits[i] > 0 ? depth[i] / hits[i] : infinity; });
+        write_gray("prim_id", [&](size_t i) { return prim_id[i]; });
+        write_gray("mat_id", [&](size_t i) { return material_id[i]; });
+        write_gray("variance", [&](size_t i) { return mean_variance(i); });
+        write_gray("samples", [&](size_t i) { return samples[i]; });
+
+        return ok;
+    }
+
+  private:
+    int width = 0, height = 0;
+    std::vector<color> beauty, albedo;
+    std::vector<vec3> normal;
+    std::vector<double> depth;
+    std::vector<int> hits;
+    std::vector<int> prim_id, material_id;
+    std::vector<double> luminance, luminance_sq;
+    std::vector<int> samples;
+
+    double mean_variance(size_t i) const
+    {
+        if (samples[i] < 2)
+            return 0.0;
+        auto mean = luminance[i] / samples[i];
+        auto sample_variance = (luminance_sq[i] - samples[i] * mean * mean) / (samples[i] - 1);
+        return fmax(0.0, sample_variance) / samples[i];
+    }
+};
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "external/log.h"
+#include "external/params.h"
+#include "parallel.h"
+#include "scene_cache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Batch file: one render job per line, blank lines and lines starting with '#' are skipped.
+//
+//   <scene> <parameters file> <output image>
+//
+// <scene> is a number from 1 to 10 or a scene file like scenes/cornell_box.json (see
+// scene_file.h). Every job reads its own parameters file; AOVs, if it asks for them, are
+// written next to the output image as <output without .ppm>.<aov>.pfm.
+
+struct batch_job
+{
+    int scene = 0;
+    RenderParameters params;
+    std::string output;
+
+    bool ok = false;
+    double build_secs = 0;  // Building the scene and estimating its cost
+    double estimate = 0;    // Estimated seconds to render it on one thread
+    double render_secs = 0;
+    double finished = 0;    // Seconds from the start of the batch to the end of the render
+};
+
+inline bool read_batch(const std::string &path, std::vector<batch_job> &jobs)
+{
+    std::ifstream file(path);
+    if (!file.is_open())
+    {
+        std::cerr << "ERROR: Could not open '" << path << "'.\n";
+        return false;
+    }
+
+    std::string line;
+    for (int number = 1; std::getline(file, line); number++)
+    {
+        std::istringstream fields(line);
+        std::string scene, parameters;
+        batch_job job;
+        if (!(fields >> scene) || scene[0] == '#')
+            continue;
+        if (!(fields >> parameters >> job.output))
+        {
+            std::cerr << "ERROR: " << path << ':' << number << ": expected <scene> <parameters file> <output image>\n";
+            return false;
+        }
+
+        if (scene.size() > 5 && scene.compare(scene.size() - 5, 5, ".json") == 0)
+        {
+            job.params.scene_file = scene;
+            job.scene = 1;
+        }
+        else
+            job.scene = std::atoi(scene.c_str());
+        if (job.scene < 1 || job.scene > 10)
+        {
+            std::cerr << "ERROR: " << path << ':' << number << ": no scene '" << scene << "'\n";
+            return false;
+        }
+
+        std::ifstream config(parameters);
+        std::string text(std::istreambuf_iterator<char>(config), {});
+        if (!config.is_open() || !job.params.setFromConfigText(text))
+        {
+            std::cerr << "ERROR: " << path << ':' << number << ": could not read parameters from '" << parameters
+                      << "'\n";
+            return false;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+inline double estimate_render_secs(camera &cam, const hittable &world, const hittable &lights)
+{
+    // Times one sample in each pixel of a 16 x 16 grid spread over the image and scales that
+    // to all of its samples. Only the ratios between jobs matter for scheduling, and those
+    // are dominated by resolution and sample count, so a few hundred paths are enough.
+    const int grid = 16;
+    auto width = cam.image_width, height = cam.output_height();
+    std::vector<color> sums;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int y = 0; y < grid; y++)
+        for (int x = 0; x < grid; x++)
+        {
+            image_tile tile;
+            tile.x0 = (2 * x + 1) * width / (2 * grid);
+            tile.y0 = (2 * y + 1) * height / (2 * grid);
+            tile.x1 = tile.x0 + 1;
+            tile.y1 = tile.y0 + 1;
+            tile.sample_begin = cam.first_sample;
+            tile.sample_end = cam.first_sample + 1;
+            cam.render_tile(world, lights, tile, sums);
+        }
+    auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return secs / (grid * grid) * width * height * cam.samples_per_pixel;
+}
+
+inline bool run_batch(std::vector<batch_job> &jobs)
+{
+    // Renders every job on one pool of worker_count() threads, each render (and its denoising)
+    // on a single thread into its own output file. Scenes are built first, since the estimate needs the
+    // camera they set up; renders then go out longest estimate first, which keeps a long job
+    // from starting last and stretching the batch while the other threads sit idle.
+    auto seconds_since = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    auto count = static_cast<int>(jobs.size());
+    auto threads = std::min(worker_count(), count);
+    auto batch_start = std::chrono::steady_clock::now();
+
+    std::vector<scene> scenes(jobs.size());
+    parallel_for(0, count, [&](int k) {
+        auto &job = jobs[k];
+        auto build_start = std::chrono::steady_clock::now();
+        if (job.params.write_aovs)
+            job.params.aov_prefix = job.output.substr(0, job.output.rfind(".ppm"));
+        job.params.show_progress = false; // Concurrent progress bars would overwrite each other
+
+        // Every scene sees the same random numbers however the jobs are spread over threads,
+        // so it comes out as it does when rendered on its own.
+        random_generator().seed(std::mt19937::default_seed);
+        job.ok = load_scene(job.scene, job.params, scenes[k]);
+        if (job.ok)
+            job.estimate = estimate_render_secs(scenes[k].cam, scenes[k].world, scenes[k].lights);
+        job.build_secs = seconds_since(build_start);
+    });
+
+    std::vector<int> order(jobs.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return jobs[a].estimate > jobs[b].estimate; });
+
+    parallel_for(0, count, [&](int k) {
+        auto &job = jobs[order[k]];
+        auto &s = scenes[order[k]];
+        if (!job.ok)
+            return;
+        std::ofstream file(job.output);
+        if (!file.is_open())
+        {
+            std::cerr << "ERROR: Could not write '" << job.output << "'.\n";
+            job.ok = false;
+            return;
+        }
+
+        auto render_start = std::chrono::steady_clock::now();
+        s.cam.image_out = &file;
+        s.cam.render(s.world, s.lights);
+        job.render_secs = seconds_since(render_start);
+        job.finished = seconds_since(batch_start);
+        s = scene(); // Free the scene while the other jobs still render
+    });
+    auto makespan = seconds_since(batch_start);
+
+    double busy = 0;
+    int failed = 0;
+    for (int k : order)
+    {
+        const auto &job = jobs[k];
+        if (!job.ok)
+        {
+            failed++;
+            LOG(ERROR) << "BATCH: " << job.output << " FAILED";
+            std::cout << job.output << ": failed" << std::endl;
+            continue;
+        }
+        busy += job.build_secs + job.render_secs;
+        LOG(INFO) << "BATCH: " << job.output << ": BUILD " << job.build_secs << "s, ESTIMATE " << job.estimate
+                  << "s, RENDER " << job.render_secs << "s, DONE AT " << job.finished << "s";
+        std::cout << job.output << ": build " << job.build_secs << "s, estimate " << job.estimate << "s, render "
+                  << job.render_secs << "s, done at " << job.finished << "s" << std::endl;
+    }
+
+    LOG(INFO) << "BATCH DONE: " << count << " JOBS ON " << threads << " THREADS, MAKESPAN " << makespan << "s, "
+              << busy << "s OF WORK";
+    std::cout << count << " jobs on " << threads << " threads: makespan " << makespan << "s, " << busy
+              << "s of work" << (failed > 0 ? ", " + std::to_string(failed) + " failed" : "") << std::endl;
+    return failed == 0;
+}
+
+#endif
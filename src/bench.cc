@@ -0,0 +1,320 @@
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "camera.h"
+#include "color.h"
+#include "constant_medium.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "pdf.h"
+#include "perlin.h"
+#include "quad.h"
+#include "sphere.h"
+#include "texture.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Times the kernels a render spends its time in, each on the same fixed-seed random inputs every
+// run, and reports nanoseconds and millions of operations (rays, for the intersection kernels)
+// per second.
+// Usage: bench [--json <file>] [--time <seconds>] [name...]
+//   --json    also write the results as JSON, to compare between builds
+//   --time    seconds each measurement runs for at least, 0.1 by default; the median of five
+//             measurements is reported
+//   name      only run the benchmarks whose names contain one of these
+// image_texture::value reads img/earthmap.jpg, as final_scene() does.
+
+struct benchmark
+{
+    std::string name;
+    const char *unit;              // What one operation is: "ray" or "op"
+    std::function<double()> pass;  // Runs the kernel over all inputs, returns a checksum
+};
+
+struct result
+{
+    std::string name;
+    const char *unit;
+    double ns_per_op;
+    double checksum;
+};
+
+static const int inputs = 4096; // Operations per pass
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static volatile double sink; // Keeps the compiler from dropping passes whose results go unused
+
+static result measure(const benchmark &b, double min_secs)
+{
+    // Doubles the passes per measurement until one takes min_secs, then takes the median of
+    // five measurements of that many passes. The checksum is the first pass's, which draws the
+    // same random numbers every run, so a kernel that starts computing something else shows.
+    random_generator().seed(std::mt19937::default_seed);
+    double checksum = b.pass();
+    int passes = 1;
+    for (;;)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (int p = 0; p < passes; p++)
+            sink = sink + b.pass();
+        if (seconds_since(start) >= min_secs)
+            break;
+        passes *= 2;
+    }
+
+    std::vector<double> times;
+    for (int m = 0; m < 5; m++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (int p = 0; p < passes; p++)
+            sink = sink + b.pass();
+        times.push_back(seconds_since(start));
+    }
+    std::sort(times.begin(), times.end());
+    return {b.name, b.unit, times[2] * 1e9 / (static_cast<double>(passes) * inputs), checksum};
+}
+
+static ray aimed_ray(const point3 &target, double spread, double distance, bool timed = false)
+{
+    // A ray from a random point distance away, towards a random point within spread of target.
+    auto origin = target + distance * random_unit_vector();
+    auto aim = target + spread * random_in_unit_sphere();
+    return ray(origin, aim - origin, timed ? random_double() : 0);
+}
+
+static std::vector<benchmark> make_benchmarks()
+{
+    std::vector<benchmark> all;
+    auto matte = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+
+    // Intersections: about half of the rays hit.
+    std::vector<ray> rays(inputs), timed_rays(inputs), wide_rays(inputs);
+    for (int i = 0; i < inputs; i++)
+    {
+        rays[i] = aimed_ray(point3(0, 0, 0), 2, 10);
+        timed_rays[i] = aimed_ray(point3(0, 0.5, 0), 2, 10, true);
+        wide_rays[i] = aimed_ray(point3(0, 0, 0), 10, 30);
+    }
+
+    auto box = aabb(point3(-1, -1, -1), point3(1, 1, 1));
+    all.push_back({"aabb::hit", "ray", [=] {
+                       double hits = 0;
+                       for (const auto &r : rays)
+                           hits += box.hit(r, interval(0.001, infinity));
+                       return hits;
+                   }});
+
+    auto ball = make_shared<sphere>(point3(0, 0, 0), 1, matte);
+    all.push_back({"sphere::hit", "ray", [=] {
+                       double sum = 0;
+                       hit_record rec;
+                       for (const auto &r : rays)
+                           if (ball->hit(r, interval(0.001, infinity), rec))
+                               sum += rec.t;
+                       return sum;
+                   }});
+
+    auto moving = make_shared<sphere>(point3(0, 0, 0), point3(0, 1, 0), 1, matte);
+    all.push_back({"sphere::hit moving", "ray", [=] {
+                       double sum = 0;
+                       hit_record rec;
+                       for (const auto &r : timed_rays)
+                           if (moving->hit(r, interval(0.001, infinity), rec))
+                               sum += rec.t;
+                       return sum;
+                   }});
+
+    auto square = make_shared<quad>(point3(-1, -1, 0), vec3(2, 0, 0), vec3(0, 2, 0), matte);
+    all.push_back({"quad::hit", "ray", [=] {
+                       double sum = 0;
+                       hit_record rec;
+                       for (const auto &r : rays)
+                           if (square->hit(r, interval(0.001, infinity), rec))
+                               sum += rec.t;
+                       return sum;
+                   }});
+
+    // A field of 1000 small spheres like random_spheres(), through a BVH.
+    hittable_list field;
+    for (int i = 0; i < 1000; i++)
+        field.add(make_shared<sphere>(point3::random(-10, 10), random_double(0.2, 0.6), matte));
+    auto tree = make_shared<bvh_node>(field);
+    all.push_back({"bvh_node::hit", "ray", [=] {
+                       double sum = 0;
+                       hit_record rec;
+                       for (const auto &r : wide_rays)
+                           if (tree->hit(r, interval(0.001, infinity), rec))
+                               sum += rec.t;
+                       return sum;
+                   }});
+
+    auto fog = make_shared<constant_medium>(ball, 0.5, color(1, 1, 1));
+    all.push_back({"constant_medium::hit", "ray", [=] {
+                       double sum = 0;
+                       hit_record rec;
+                       for (const auto &r : rays)
+                           if (fog->hit(r, interval(0.001, infinity), rec))
+                               sum += rec.t;
+                       return sum;
+                   }});
+
+    // Shading.
+    std::vector<point3> points(inputs);
+    std::vector<double> us(inputs), vs(inputs);
+    for (int i = 0; i < inputs; i++)
+    {
+        points[i] = point3::random(-10, 10);
+        us[i] = random_double();
+        vs[i] = random_double();
+    }
+
+    auto noise = make_shared<perlin>();
+    all.push_back({"perlin::turb", "op", [=] {
+                       double sum = 0;
+                       for (const auto &p : points)
+                           sum += noise->turb(p);
+                       return sum;
+                   }});
+
+    auto earth = make_shared<image_texture>("img/earthmap.jpg");
+    all.push_back({"image_texture::value", "op", [=] {
+                       double sum = 0;
+                       for (int i = 0; i < inputs; i++)
+                           sum += earth->value(us[i], vs[i], points[i]).x();
+                       return sum;
+                   }});
+
+    // Sampling directions.
+    std::vector<vec3> normals(inputs), directions(inputs);
+    for (int i = 0; i < inputs; i++)
+    {
+        normals[i] = random_unit_vector();
+        directions[i] = random_unit_vector();
+    }
+
+    auto add_pdf = [&](const std::string &name, std::function<shared_ptr<pdf>(int)> make) {
+        std::vector<shared_ptr<pdf>> pdfs;
+        for (int i = 0; i < 64; i++)
+            pdfs.push_back(make(i));
+        all.push_back({name + "::generate", "op", [=] {
+                           double sum = 0;
+                           for (int i = 0; i < inputs; i++)
+                               sum += pdfs[i % pdfs.size()]->generate().x();
+                           return sum;
+                       }});
+        all.push_back({name + "::value", "op", [=] {
+                           double sum = 0;
+                           for (int i = 0; i < inputs; i++)
+                               sum += pdfs[i % pdfs.size()]->value(directions[i]);
+                           return sum;
+                       }});
+    };
+    add_pdf("cosine_pdf", [&](int i) { return make_shared<cosine_pdf>(normals[i]); });
+    add_pdf("sphere_pdf", [&](int) { return make_shared<sphere_pdf>(); });
+    add_pdf("hittable_pdf sphere", [&](int i) { return make_shared<hittable_pdf>(*ball, points[i] * 2.0); });
+    add_pdf("hittable_pdf quad", [&](int i) { return make_shared<hittable_pdf>(*square, points[i] + vec3(0, 0, 11)); });
+    add_pdf("mixture_pdf", [&](int i) {
+        return make_shared<mixture_pdf>(make_shared<hittable_pdf>(*square, points[i] + vec3(0, 0, 11)),
+                                        make_shared<cosine_pdf>(normals[i]));
+    });
+
+    // Random numbers and output.
+    all.push_back({"random_double", "op", [] {
+                       double sum = 0;
+                       for (int i = 0; i < inputs; i++)
+                           sum += random_double();
+                       return sum;
+                   }});
+
+    std::vector<color> pixels(inputs);
+    for (auto &c : pixels)
+        c = color::random(0, 100);
+    all.push_back({"write_color", "op", [=] {
+                       std::ostringstream out;
+                       for (const auto &c : pixels)
+                           write_color(out, c, 100);
+                       return static_cast<double>(out.tellp());
+                   }});
+
+    return all;
+}
+
+static void write_json(std::ostream &out, const std::vector<result> &results, double min_secs)
+{
+    out.precision(6);
+    out << "{\n"
+        << "  \"inputs_per_pass\": " << inputs << ",\n"
+        << "  \"min_seconds\": " << min_secs << ",\n"
+#ifdef __VERSION__
+        << "  \"compiler\": \"" << __VERSION__ << "\",\n"
+#endif
+        << "  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const auto &r = results[i];
+        out << "    {\"name\": \"" << r.name << "\", \"unit\": \"" << r.unit << "\", \"ns_per_op\": " << r.ns_per_op
+            << ", \"mops_per_sec\": " << 1e3 / r.ns_per_op << ", \"checksum\": " << r.checksum << '}'
+            << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+int main(int argc, char *argv[])
+{
+    std::string json_path;
+    double min_secs = 0.1;
+    std::vector<std::string> filters;
+    for (int a = 1; a < argc; a++)
+    {
+        std::string arg = argv[a];
+        if (arg == "--json" && a + 1 < argc)
+            json_path = argv[++a];
+        else if (arg == "--time" && a + 1 < argc)
+            min_secs = std::max(1e-3, std::stod(argv[++a]));
+        else
+            filters.push_back(arg);
+    }
+
+    // Inputs, and the random numbers the kernels draw, are the same every run.
+    random_generator().seed(std::mt19937::default_seed);
+    auto benchmarks = make_benchmarks();
+
+    std::vector<result> results;
+    std::printf("%-28s %10s %14s\n", "benchmark", "ns/op", "throughput");
+    for (const auto &b : benchmarks)
+    {
+        bool wanted = filters.empty();
+        for (const auto &f : filters)
+            wanted = wanted || b.name.find(f) != std::string::npos;
+        if (!wanted)
+            continue;
+
+        results.push_back(measure(b, min_secs));
+        const auto &r = results.back();
+        std::printf("%-28s %10.2f %8.2f M%ss/s\n", r.name.c_str(), r.ns_per_op, 1e3 / r.ns_per_op, r.unit);
+    }
+
+    if (!json_path.empty())
+    {
+        std::ofstream file(json_path);
+        write_json(file, results, min_secs);
+        if (!file)
+        {
+            std::cerr << "ERROR: Could not write '" << json_path << "'.\n";
+            return 1;
+        }
+    }
+    return 0;
+}
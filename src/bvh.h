@@ -5,6 +5,8 @@
 
 #include "hittable.h"
 #include "hittable_list.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <algorithm>
 
@@ -17,13 +19,19 @@ class bvh_node : public hittable
 
     bvh_node(const std::vector<shared_ptr<hittable>> &src_objects, size_t start, size_t end)
     {
-        auto objects = src_objects; // Create a modifiable array of the source scene objects
+        // The root's zone spans the whole build; one per node would bury the timeline.
+        RTW_TRACE_ZONE_IF(start == 0 && end == src_objects.size(), "bvh_node build");
+
+        // Create a modifiable array of this node's objects. Copying only the range, not all of
+        // src_objects, keeps the build O(n log n) on large scenes.
+        std::vector<shared_ptr<hittable>> objects(src_objects.begin() + start, src_objects.begin() + end);
+        size_t object_span = end - start;
+        start = 0;
+        end = object_span;
 
         int axis = random_int(0, 2);
         auto comparator = (axis == 0) ? box_x_compare : (axis == 1) ? box_y_compare : box_z_compare;
 
-        size_t object_span = end - start;
-
         if (object_span == 1)
         {
             left = right = objects[start];
@@ -55,6 +63,7 @@ class bvh_node : public hittable
 
     bool hit(const ray &r, interval ray_t, hit_record &rec) const override
     {
+        RTW_COUNT(bvh_nodes);
         if (!bbox.hit(r, ray_t))
             return false;
 
@@ -69,6 +78,17 @@ class bvh_node : public hittable
         return bbox;
     }
 
+    void refit()
+    {
+        // Recomputes the boxes of this subtree bottom-up after objects in it moved (see movable).
+        // The tree keeps the topology it was built with: much cheaper than a rebuild, but looser
+        // the further objects move from where they were.
+        for (auto child : {left.get(), right.get()})
+            if (auto node = dynamic_cast<bvh_node *>(child))
+                node->refit();
+        bbox = aabb(left->bounding_box(), right->bounding_box());
+    }
+
   private:
     shared_ptr<hittable> left;
     shared_ptr<hittable> right;
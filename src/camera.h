@@ -3,22 +3,47 @@
 
 #include "rtweekend.h"
 
+#include "accumulation.h"
+#include "aov.h"
+#include "checkpoint.h"
 #include "color.h"
 #include "hittable.h"
 #include "material.h"
+#include "stats.h"
+#include "trace.h"
+#include "volume.h"
+#include "wavefront.h"
 
 #include "external\progressbar.h"
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
 #include <iostream>
+#include <string>
+#include <vector>
+
+struct image_tile
+{
+    // Pixels [x0, x1) x [y0, y1), traced with sample indices [sample_begin, sample_end).
+    int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+    int sample_begin = 0, sample_end = 0;
+
+    int pixel_count() const
+    {
+        return (x1 - x0) * (y1 - y0);
+    }
+};
 
 class camera
 {
   public:
-    double aspect_ratio = 1.0;  // Ratio of image width over height
-    int image_width = 100;      // Rendered image width in pixel count
-    int samples_per_pixel = 10; // Count of random samples for each pixel
-    int max_depth = 10;         // Maximum number of ray bounces into scene
-    color background;           // Scene background color
+    double aspect_ratio = 1.0;     // Ratio of image width over height
+    int image_width = 100;         // Rendered image width in pixel count
+    int samples_per_pixel = 10;    // Count of random samples for each pixel
+    int max_depth = 10;            // Maximum number of ray bounces into scene
+    color background;              // Scene background color
+    shared_ptr<atmosphere> medium; // Optional scene-wide participating medium
 
     double vfov = 90;                   // Vertical view angle (field of view)
     point3 lookfrom = point3(0, 0, -1); // Point camera is looking from
@@ -28,39 +53,214 @@ class camera
     double defocus_angle = 0; // Variation angle of rays through each pixel
     double focus_dist = 10;   // Distance from camera lookfrom point to plane of perfect focus
 
+    sampler_kind sampler = sampler_kind::sobol; // Sequence every sampling dimension is drawn from
+    unsigned sampler_seed = 0;                  // Scrambling seed; renders are a pure function of it
+    int first_sample = 0;                       // Pixels trace sample indices first_sample onwards
+
+    int wavefront_size = 0;      // Paths in flight per wavefront batch (0 traces each sample depth-first)
+    bool sort_secondary = false; // Wavefront only: sort bounced rays by direction and origin before tracing
+
+    std::string aov_prefix;        // If set, also write float images <aov_prefix>.<name>.pfm (see aov_buffers)
+    bool denoise = false;          // Filter the image with atrous_denoise() before writing it
+    std::string accumulation_path; // If set, also write the raw sums as a mergeable .acc file
+    std::string heatmap_prefix;    // If set, also write per-pixel cost images <heatmap_prefix>.<name>.pfm
+
+    std::string checkpoint_path;                // If set, save progress there every job.interval seconds
+    render_job job;                             // What a checkpoint needs to resume besides the samples
+    shared_ptr<const accumulation> resume_from; // Samples already traced, from a checkpoint
+
+    std::ostream *image_out = &std::cout; // Where the PPM image is written
+    bool show_progress = true;            // Draw a progress bar on std::cerr while rendering
+
+    // If set, called with the fraction of the image done after every row (wavefront batch);
+    // returning false stops the render there, without writing the image.
+    std::function<bool(double)> on_progress;
+
     void render(const hittable &world, const hittable &lights)
     {
+        if (wavefront_size > 0)
+        {
+            render_wavefront(world, lights);
+            return;
+        }
+
+        RTW_TRACE_ZONE("camera::render");
         initialize();
 
-        std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+        std::vector<color> framebuffer;
+        std::vector<uint32_t> counts;
+        start_accumulation(framebuffer, counts);
+        bool want_aovs = !aov_prefix.empty() || denoise;
+        aov_buffers aovs;
+        if (want_aovs)
+            aovs.resize(image_width, image_height);
+
+        bool want_heatmaps = !heatmap_prefix.empty();
+        std::vector<float> nodes_map, time_map;
+        if (want_heatmaps)
+        {
+            nodes_map.assign(image_width * image_height, 0.0f);
+            time_map.assign(image_width * image_height, 0.0f);
+        }
 
+        checkpoint_writer checkpoints(checkpoint_path, job);
         progressbar pb(image_height);
         pb.set_done_char("█");
         for (int j = 0; j < image_height; ++j)
         {
-            pb.update();
+            RTW_TRACE_ZONE("row");
+            if (show_progress)
+                pb.update();
             for (int i = 0; i < image_width; ++i)
             {
-                color pixel_color(0, 0, 0);
-                for (int s_j = 0; s_j < sqrt_spp; ++s_j)
+                auto pixel = j * image_width + i;
+                auto samples = samples_per_pixel - static_cast<int>(counts[pixel]);
+                auto nodes_before = want_heatmaps ? local_render_counters().bvh_nodes : 0;
+                auto start = want_heatmaps ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+                framebuffer[pixel] += trace_pixel(i, j, first_sample + counts[pixel], first_sample + samples_per_pixel,
+                                                  world, lights, want_aovs ? &aovs : nullptr);
+                counts[pixel] = samples_per_pixel;
+                if (want_heatmaps && samples > 0)
                 {
-                    for (int s_i = 0; s_i < sqrt_spp; ++s_i)
-                    {
-                        ray r = get_ray(i, j, s_i, s_j);
-                        pixel_color += ray_color(r, max_depth, world, lights);
-                    }
+                    auto elapsed = std::chrono::steady_clock::now() - start;
+                    time_map[pixel] = std::chrono::duration<float, std::micro>(elapsed).count();
+                    nodes_map[pixel] = static_cast<float>(local_render_counters().bvh_nodes - nodes_before) / samples;
                 }
-                write_color(std::cout, pixel_color, samples_per_pixel);
             }
+            if (checkpoints.due())
+                save_checkpoint(checkpoints, framebuffer, counts);
+            if (on_progress && !on_progress(static_cast<double>(j + 1) / image_height))
+                return;
+        }
+
+        write_image(framebuffer, aovs);
+        if (want_heatmaps)
+            write_heatmaps(nodes_map, time_map);
+        finish_checkpoints(checkpoints);
+
+        if (show_progress)
+            std::clog << "\rDone.                 \n";
+    }
+
+    void render_tile(const hittable &world, const hittable &lights, const image_tile &tile, std::vector<color> &sums)
+    {
+        // Traces one tile and stores the per-pixel sums of its samples row by row in sums. The
+        // sums are exactly the ones render() computes for those samples, so tiles traced in any
+        // process can be assembled into the same image.
+        RTW_TRACE_ZONE("camera::render_tile");
+        initialize();
+
+        sums.assign(tile.pixel_count(), color(0, 0, 0));
+        for (int j = tile.y0; j < tile.y1; ++j)
+            for (int i = tile.x0; i < tile.x1; ++i)
+                sums[(j - tile.y0) * (tile.x1 - tile.x0) + (i - tile.x0)] =
+                    trace_pixel(i, j, tile.sample_begin, tile.sample_end, world, lights, nullptr);
+    }
+
+    void write_sums(const std::vector<color> &framebuffer) const
+    {
+        // Writes an image assembled from render_tile() sums to image_out as PPM. Tiles carry no
+        // per-sample data, so there are no auxiliary outputs and no denoising.
+        *image_out << "P3\n" << image_width << ' ' << output_height() << "\n255\n";
+        for (const auto &pixel_color : framebuffer)
+            write_color(*image_out, pixel_color, samples_per_pixel);
+    }
+
+    int output_height() const
+    {
+        // Height of the rendered image in pixels.
+        auto height = static_cast<int>(image_width / aspect_ratio);
+        return (height < 1) ? 1 : height;
+    }
+
+    void render_wavefront(const hittable &world, const hittable &lights)
+    {
+        // Breadth-first version of render(). Camera rays for wavefront_size pixel samples are
+        // generated at once, then the whole batch is intersected, shaded and intersected again
+        // until every path has terminated. Produces the same image as render().
+        RTW_TRACE_ZONE("camera::render_wavefront");
+        initialize();
+        if (!heatmap_prefix.empty())
+            std::cerr << "WARNING: Heatmaps are only recorded by the depth-first renderer (wavefront size 0).\n";
+
+        std::vector<color> framebuffer;
+        std::vector<uint32_t> counts;
+        start_accumulation(framebuffer, counts);
+        bool want_aovs = !aov_prefix.empty() || denoise;
+        aov_buffers aovs;
+        if (want_aovs)
+            aovs.resize(image_width, image_height);
+
+        // A resumed render starts at the first pixel that still lacks samples.
+        auto spp = samples_per_pixel;
+        auto pixels = static_cast<long long>(image_width) * image_height;
+        long long resumed = 0;
+        while (resumed < pixels && counts[resumed] >= static_cast<uint32_t>(spp))
+            resumed++;
+        auto total = pixels * spp;
+        auto batch = static_cast<int>(std::max<long long>(1, std::min<long long>(wavefront_size, total)));
+        auto batches = static_cast<int>((total - resumed * spp + batch - 1) / batch);
+
+        path_queue paths;
+        paths.reserve(batch);
+        std::vector<int> order;
+        std::vector<std::pair<uint64_t, int>> keys;
+        auto bounds = world.bounding_box();
+
+        checkpoint_writer checkpoints(checkpoint_path, job);
+        progressbar pb(batches);
+        pb.set_done_char("█");
+        for (long long first = resumed * spp; first < total; first += batch)
+        {
+            RTW_TRACE_ZONE("wavefront batch");
+            if (show_progress)
+                pb.update();
+
+            // Generate: consecutive samples of consecutive pixels, so a batch covers a compact
+            // band of the image. Samples a checkpoint already holds are skipped.
+            auto last = std::min(total, first + batch);
+            for (auto s = first; s < last; s++)
+            {
+                auto pixel = static_cast<int>(s / spp);
+                if (static_cast<uint32_t>(s % spp) < counts[pixel])
+                    continue;
+                auto i = pixel % image_width, j = pixel / image_width;
+                sample_stream stream(sampler, i, j, static_cast<uint32_t>(first_sample + s % spp), sampler_seed);
+                sample_scope scope(stream);
+                auto r = get_ray(i, j);
+                RTW_COUNT(camera_rays);
+                paths.push(r, pixel, max_depth, stream);
+                counts[pixel]++;
+            }
+
+            // Camera rays are coherent already; only the bounced rays are worth reordering.
+            while (paths.size() > 0)
+            {
+                extend(paths, world);
+                sort_by_material(paths, order);
+                shade(paths, order, lights);
+                retire(paths, framebuffer, want_aovs ? &aovs : nullptr);
+                paths.compact();
+                if (sort_secondary)
+                    sort_by_ray_key(paths, bounds, keys, order);
+            }
+
+            // Between batches every generated path has been retired, so counts are exact.
+            if (checkpoints.due())
+                save_checkpoint(checkpoints, framebuffer, counts);
+            if (on_progress && !on_progress(static_cast<double>(last - resumed * spp) / (total - resumed * spp)))
+                return;
         }
 
-        std::clog << "\rDone.                 \n";
+        write_image(framebuffer, aovs);
+        finish_checkpoints(checkpoints);
+
+        if (show_progress)
+            std::clog << "\rDone.                 \n";
     }
 
   private:
     int image_height;      // Rendered image height
-    int sqrt_spp;          // Square root of number of samples per pixel
-    double recip_sqrt_spp; // 1 / sqrt_spp
     point3 center;         // Camera center
     point3 pixel00_loc;    // Location of pixel 0, 0
     vec3 pixel_delta_u;    // Offset to pixel to the right
@@ -68,11 +268,56 @@ class camera
     vec3 u, v, w;          // Camera frame basis vectors
     vec3 defocus_disk_u;   // Defocus disk horizontal radius
     vec3 defocus_disk_v;   // Defocus disk vertical radius
+    double pixel_spread;   // Angle subtended by one pixel, used as the ray cone spread
+
+    void start_accumulation(std::vector<color> &framebuffer, std::vector<uint32_t> &counts) const
+    {
+        // Per-pixel sums and sample counts to render into: empty, or the ones of resume_from if
+        // it is a checkpoint of this render.
+        auto pixels = static_cast<size_t>(image_width) * image_height;
+        framebuffer.assign(pixels, color(0, 0, 0));
+        counts.assign(pixels, 0);
+        if (!resume_from)
+            return;
+
+        const auto &h = resume_from->header;
+        if (h.width != static_cast<uint32_t>(image_width) || h.height != static_cast<uint32_t>(image_height) ||
+            h.sampler != static_cast<uint32_t>(sampler) || h.seed != sampler_seed ||
+            h.sample_begin != static_cast<uint32_t>(first_sample) ||
+            h.sample_end != static_cast<uint32_t>(first_sample + samples_per_pixel))
+        {
+            std::cerr << "WARNING: The checkpoint doesn't match this render; starting from scratch.\n";
+            return;
+        }
+
+        for (size_t i = 0; i < pixels; i++)
+        {
+            framebuffer[i] = color(resume_from->sums[3 * i], resume_from->sums[3 * i + 1], resume_from->sums[3 * i + 2]);
+            counts[i] = std::min<uint32_t>(resume_from->counts[i], samples_per_pixel);
+        }
+        if (!aov_prefix.empty() || denoise)
+            std::cerr << "WARNING: Auxiliary outputs only cover the samples traced after resuming.\n";
+    }
+
+    void save_checkpoint(checkpoint_writer &checkpoints, const std::vector<color> &framebuffer,
+                         const std::vector<uint32_t> &counts) const
+    {
+        checkpoints.submit(framebuffer, counts, image_width, image_height, sampler, sampler_seed, first_sample,
+                           first_sample + samples_per_pixel);
+    }
+
+    void finish_checkpoints(checkpoint_writer &checkpoints) const
+    {
+        // The image is written, so the checkpoint (ours or the one resumed from) has served its
+        // purpose.
+        checkpoints.finish();
+        if (!checkpoint_path.empty())
+            std::remove(checkpoint_path.c_str());
+    }
 
     void initialize()
     {
-        image_height = static_cast<int>(image_width / aspect_ratio);
-        image_height = (image_height < 1) ? 1 : image_height;
+        image_height = output_height();
 
         center = lookfrom;
 
@@ -82,9 +327,6 @@ class camera
         auto viewport_height = 2 * h * focus_dist;
         auto viewport_width = viewport_height * (static_cast<double>(image_width) / image_height);
 
-        sqrt_spp = static_cast<int>(sqrt(samples_per_pixel));
-        recip_sqrt_spp = 1.0 / sqrt_spp;
-
         // Calculate the u,v,w unit basis vectors for the camera coordinate frame.
         w = unit_vector(lookfrom - lookat);
         u = unit_vector(cross(vup, w));
@@ -97,6 +339,7 @@ class camera
         // Calculate the horizontal and vertical delta vectors to the next pixel.
         pixel_delta_u = viewport_u / image_width;
         pixel_delta_v = viewport_v / image_height;
+        pixel_spread = viewport_height / image_height / focus_dist;
 
         // Calculate the location of the upper left pixel.
         auto viewport_upper_left = center - (focus_dist * w) - viewport_u / 2 - viewport_v / 2;
@@ -108,13 +351,14 @@ class camera
         defocus_disk_v = v * defocus_radius;
     }
 
-    ray get_ray(int i, int j, int s_i, int s_j) const
+    ray get_ray(int i, int j) const
     {
         // Get a randomly-sampled camera ray for the pixel at location i,j, originating from
-        // the camera defocus disk, and randomly sampled around the pixel location.
+        // the camera defocus disk, and randomly sampled around the pixel location. The
+        // stratification across a pixel's samples comes from the active sample stream.
 
         auto pixel_center = pixel00_loc + (i * pixel_delta_u) + (j * pixel_delta_v);
-        auto pixel_sample = pixel_center + pixel_sample_square(s_i, s_j);
+        auto pixel_sample = pixel_center + pixel_sample_square();
 
         auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
         auto ray_direction = pixel_sample - ray_origin;
@@ -123,12 +367,11 @@ class camera
         return ray(ray_origin, ray_direction, ray_time);
     }
 
-    vec3 pixel_sample_square(int s_i, int s_j) const
+    vec3 pixel_sample_square() const
     {
-        // Returns a random point in the square surrounding a pixel at the origin, given
-        // the two subpixel indices.
-        auto px = -0.5 + recip_sqrt_spp * (s_i + random_double());
-        auto py = -0.5 + recip_sqrt_spp * (s_j + random_double());
+        // Returns a random point in the square surrounding a pixel at the origin.
+        auto px = -0.5 + random_double();
+        auto py = -0.5 + random_double();
         return (px * pixel_delta_u) + (py * pixel_delta_v);
     }
 
@@ -146,38 +389,264 @@ class camera
         return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
     }
 
-    color ray_color(const ray &r, int depth, const hittable &world, const hittable &lights) const
+    color trace_pixel(int i, int j, int sample_begin, int sample_end, const hittable &world, const hittable &lights,
+                      aov_buffers *aovs) const
+    {
+        // Sum of samples [sample_begin, sample_end) of pixel i,j, each drawn from its own
+        // sample stream. Samples are also added to aovs if given.
+        color pixel_color(0, 0, 0);
+        for (int sample = sample_begin; sample < sample_end; ++sample)
+        {
+            sample_stream stream(sampler, i, j, sample, sampler_seed);
+            sample_scope scope(stream);
+            ray r = get_ray(i, j);
+            RTW_COUNT(camera_rays);
+            first_hit hit;
+            auto sample_color = ray_color(r, max_depth, world, lights, 0, aovs ? &hit : nullptr);
+            pixel_color += sample_color;
+            if (aovs)
+                aovs->add_sample(j * image_width + i, sample_color, hit);
+        }
+        return pixel_color;
+    }
+
+    void extend(path_queue &paths, const hittable &world) const
     {
+        // Intersect every live path with the world (and the scene medium). Paths that escape
+        // pick up the background and terminate.
+        for (int i = 0; i < paths.size(); i++)
+        {
+            if (paths.depth[i] <= 0)
+            {
+                RTW_PATH_END(max_depth - paths.depth[i]);
+                paths.alive[i] = 0;
+                continue;
+            }
+
+            sample_scope scope(paths.stream[i]);
+            auto r = paths.path_ray(i);
+            auto &rec = paths.hit[i];
+            bool hit_surface = world.hit(r, interval(0.001, infinity), rec);
+            RTW_COUNT_TRACED();
+            if (medium && medium->sample(r, interval(0.001, hit_surface ? rec.t : infinity), rec))
+                hit_surface = true;
+
+            if (!hit_surface)
+            {
+                paths.radiance[i] += paths.throughput[i] * background;
+                if (paths.depth[i] == max_depth)
+                    paths.first[i].albedo = clamp_unit(background);
+                RTW_PATH_END(max_depth - paths.depth[i]);
+                paths.alive[i] = 0;
+                continue;
+            }
+            RTW_COUNT(hits);
+
+            paths.cone_width[i] += pixel_spread * rec.t * r.direction().length();
+            auto cos_incidence = fabs(dot(unit_vector(r.direction()), rec.normal));
+            rec.footprint = paths.cone_width[i] * rec.uv_scale / fmax(cos_incidence, 0.05);
+        }
+    }
+
+    void shade(path_queue &paths, const std::vector<int> &order, const hittable &lights) const
+    {
+        // Add emission and scatter each path that hit something, visiting paths grouped by
+        // material. Light sampling is part of the mixture pdf, so the next extend stage traces
+        // the light-sampled rays along with all the others.
+        for (auto i : order)
+        {
+            sample_scope scope(paths.stream[i]);
+            auto r = paths.path_ray(i);
+            const auto &rec = paths.hit[i];
+            auto &beta = paths.throughput[i];
+
+            auto emission = rec.mat->emitted(r, rec, rec.u, rec.v, rec.p);
+            paths.radiance[i] += beta * emission;
+
+            scatter_record srec;
+            bool scatters = rec.mat->scatter(r, rec, srec);
+            if (paths.depth[i] == max_depth)
+                record_first_hit(paths.first[i], r, rec, scatters ? srec.attenuation : emission);
+
+            if (!scatters)
+            {
+                RTW_PATH_END(max_depth - paths.depth[i]);
+                paths.alive[i] = 0;
+                continue;
+            }
+
+            paths.depth[i]--;
+            if (srec.skip_pdf)
+            {
+                RTW_COUNT(specular_rays);
+                beta = beta * srec.attenuation;
+                paths.set_ray(i, srec.skip_pdf_ray);
+                continue;
+            }
+
+            RTW_COUNT(scatter_rays);
+            hittable_pdf light_pdf(lights, rec.p);
+            auto direction = random_double() < 0.5 ? light_pdf.generate() : srec.lobe.generate();
+
+            ray scattered = ray(rec.p, direction, r.time());
+            auto pdf_val = 0.5 * light_pdf.value(scattered.direction()) + 0.5 * srec.lobe.value(scattered.direction());
+            auto scattering_pdf = rec.mat->scattering_pdf(r, rec, scattered);
+
+            beta = beta * srec.attenuation * scattering_pdf / pdf_val;
+            paths.set_ray(i, scattered);
+        }
+    }
+
+    void write_image(const std::vector<color> &framebuffer, const aov_buffers &aovs) const
+    {
+        // Writes the accumulated image to image_out as PPM, denoised if requested, followed by
+        // the auxiliary outputs and the raw sums.
+        RTW_TRACE_ZONE("write image");
+        *image_out << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+
+        if (!denoise)
+        {
+            for (const auto &pixel_color : framebuffer)
+                write_color(*image_out, pixel_color, samples_per_pixel);
+        }
+        else
+        {
+            // The denoised pixels are already means.
+            std::vector<color> filtered;
+            {
+                RTW_TRACE_ZONE("denoise");
+                filtered = atrous_denoise(aovs.denoiser_input());
+            }
+            for (const auto &pixel_color : filtered)
+                write_color(*image_out, pixel_color, 1);
+
+            if (!aov_prefix.empty())
+            {
+                std::vector<float> rgb;
+                for (const auto &pixel_color : filtered)
+                    for (int c = 0; c < 3; c++)
+                        rgb.push_back(static_cast<float>(pixel_color[c]));
+                write_pfm(aov_prefix + ".denoised.pfm", image_width, image_height, 3, rgb);
+            }
+        }
+
+        if (!aov_prefix.empty())
+            aovs.write(aov_prefix);
+
+        if (!accumulation_path.empty())
+            accumulation(framebuffer, image_width, image_height, sampler, sampler_seed, first_sample,
+                         first_sample + samples_per_pixel)
+                .write(accumulation_path);
+    }
+
+    void write_heatmaps(const std::vector<float> &nodes_map, const std::vector<float> &time_map) const
+    {
+        // Where the render spent its work: microseconds per pixel, and in RTW_STATS builds the
+        // BVH nodes visited per sample. Both are grayscale PFMs, for viewing with a false-color
+        // ramp next to the image.
+        RTW_TRACE_ZONE("write heatmaps");
+        write_pfm(heatmap_prefix + ".time.pfm", image_width, image_height, 1, time_map);
+        if (render_stats_enabled)
+            write_pfm(heatmap_prefix + ".nodes.pfm", image_width, image_height, 1, nodes_map);
+        else
+            std::cerr << "WARNING: Node heatmaps need a build with RTW_STATS; only the time heatmap was written.\n";
+    }
+
+    void retire(path_queue &paths, std::vector<color> &framebuffer, aov_buffers *aovs) const
+    {
+        // Add the radiance of every path that terminated in this pass to its pixel.
+        for (int i = 0; i < paths.size(); i++)
+        {
+            if (paths.alive[i])
+                continue;
+            framebuffer[paths.pixel[i]] += paths.radiance[i];
+            if (aovs)
+                aovs->add_sample(paths.pixel[i], paths.radiance[i], paths.first[i]);
+        }
+    }
+
+    static color clamp_unit(const color &c)
+    {
+        static const interval unit(0, 1);
+        return color(unit.clamp(c.x()), unit.clamp(c.y()), unit.clamp(c.z()));
+    }
+
+    static void record_first_hit(first_hit &first, const ray &r, const hit_record &rec, const color &albedo)
+    {
+        first.valid = true;
+        first.albedo = clamp_unit(albedo);
+        first.normal = rec.normal;
+        first.depth = rec.t * r.direction().length();
+        first.prim_id = rec.prim_id;
+        first.material_id = rec.mat->id;
+    }
+
+    color ray_color(const ray &r, int depth, const hittable &world, const hittable &lights,
+                    double cone_width = 0, first_hit *first = nullptr) const
+    {
+        // cone_width is the width of the ray footprint at the ray origin; it grows by
+        // pixel_spread per unit of distance travelled and drives texture filtering. If first is
+        // given, the first intersection is recorded there for the auxiliary outputs.
         hit_record rec;
 
         // If we've exceeded the ray bounce limit, no more light is gathered.
         if (depth <= 0)
+        {
+            RTW_PATH_END(max_depth - depth);
             return color(0, 0, 0);
+        }
+
+        bool hit_surface = world.hit(r, interval(0.001, infinity), rec);
+        RTW_COUNT_TRACED();
+
+        // A scene-wide medium may scatter the ray before it reaches the surface (or escapes).
+        if (medium && medium->sample(r, interval(0.001, hit_surface ? rec.t : infinity), rec))
+            hit_surface = true;
 
         // If the ray hits nothing, return the background color.
-        if (!world.hit(r, interval(0.001, infinity), rec))
+        if (!hit_surface)
+        {
+            if (first)
+                first->albedo = clamp_unit(background);
+            RTW_PATH_END(max_depth - depth);
             return background;
+        }
+        RTW_COUNT(hits);
+
+        cone_width += pixel_spread * rec.t * r.direction().length();
+        auto cos_incidence = fabs(dot(unit_vector(r.direction()), rec.normal));
+        rec.footprint = cone_width * rec.uv_scale / fmax(cos_incidence, 0.05);
 
         scatter_record srec;
         color color_from_emission = rec.mat->emitted(r, rec, rec.u, rec.v, rec.p);
+        bool scatters = rec.mat->scatter(r, rec, srec);
+
+        if (first)
+            record_first_hit(*first, r, rec, scatters ? srec.attenuation : color_from_emission);
 
-        if (!rec.mat->scatter(r, rec, srec))
+        if (!scatters)
+        {
+            RTW_PATH_END(max_depth - depth);
             return color_from_emission;
+        }
 
         if (srec.skip_pdf)
         {
-            return srec.attenuation * ray_color(srec.skip_pdf_ray, depth - 1, world, lights);
+            RTW_COUNT(specular_rays);
+            return srec.attenuation * ray_color(srec.skip_pdf_ray, depth - 1, world, lights, cone_width);
         }
 
-        auto light_ptr = make_shared<hittable_pdf>(lights, rec.p);
-        mixture_pdf p(light_ptr, srec.pdf_ptr);
+        // Equal mixture of light sampling and the material lobe, all on the stack.
+        RTW_COUNT(scatter_rays);
+        hittable_pdf light_pdf(lights, rec.p);
+        auto direction = random_double() < 0.5 ? light_pdf.generate() : srec.lobe.generate();
 
-        ray scattered = ray(rec.p, p.generate(), r.time());
-        auto pdf_val = p.value(scattered.direction());
+        ray scattered = ray(rec.p, direction, r.time());
+        auto pdf_val = 0.5 * light_pdf.value(scattered.direction()) + 0.5 * srec.lobe.value(scattered.direction());
 
         double scattering_pdf = rec.mat->scattering_pdf(r, rec, scattered);
 
-        color sample_color = ray_color(scattered, depth - 1, world, lights);
+        color sample_color = ray_color(scattered, depth - 1, world, lights, cone_width);
         color color_from_scatter = (srec.attenuation * scattering_pdf * sample_color) / pdf_val;
 
         return color_from_emission + color_from_scatter;
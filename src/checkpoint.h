@@ -0,0 +1,203 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "rtweekend.h"
+
+#include "accumulation.h"
+#include "color.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Checkpoint file (.ckpt) layout, all fields little-endian:
+//
+//   ckpt_header                      magic "RTC1", scene, part, interval and config size
+//   char config[config_size]         parameters.txt as the render read it
+//   accumulation                     sums and per-pixel sample counts so far (see accumulation.h)
+//
+// Every sample is a pure function of its pixel, sample index and seed, so the per-pixel counts
+// are the whole sampler position: a resumed render traces samples sample_begin + count onwards
+// in each pixel and adds them to the stored sums.
+
+struct ckpt_header
+{
+    char magic[4];
+    uint32_t scene;       // Example scene number (see build_scene)
+    uint32_t part;        // RenderParameters::part and parts
+    uint32_t parts;
+    uint32_t interval;    // Seconds between checkpoints
+    uint32_t config_size; // Bytes of parameter text that follow
+};
+
+struct render_job
+{
+    // Everything besides the samples that a resumed render needs to continue.
+    int scene = 0;
+    int part = 0, parts = 0;
+    int interval = 0;
+    std::string config_text;
+};
+
+inline bool write_checkpoint(const std::string &path, const render_job &job, const accumulation &samples)
+{
+    // Writes to a temporary file that then replaces path, so a crash mid-write leaves the
+    // previous checkpoint intact.
+    auto temporary = path + ".tmp";
+    {
+        ckpt_header header = {{'R', 'T', 'C', '1'},
+                              static_cast<uint32_t>(job.scene),
+                              static_cast<uint32_t>(job.part),
+                              static_cast<uint32_t>(job.parts),
+                              static_cast<uint32_t>(job.interval),
+                              static_cast<uint32_t>(job.config_text.size())};
+        std::ofstream file(temporary, std::ios::binary);
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(job.config_text.data(), job.config_text.size());
+        samples.write(file);
+        if (!file)
+        {
+            std::cerr << "ERROR: Could not write '" << temporary << "'.\n";
+            return false;
+        }
+    }
+
+#ifdef _WIN32
+    std::remove(path.c_str()); // rename() doesn't replace existing files here
+#endif
+    if (std::rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        std::cerr << "ERROR: Could not replace '" << path << "'.\n";
+        return false;
+    }
+    return true;
+}
+
+inline bool read_checkpoint(const std::string &path, render_job &job, accumulation &samples)
+{
+    std::ifstream file(path, std::ios::binary);
+    ckpt_header header;
+    if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) || std::memcmp(header.magic, "RTC1", 4) != 0)
+    {
+        std::cerr << "ERROR: '" << path << "' is not a checkpoint.\n";
+        return false;
+    }
+
+    job.scene = header.scene;
+    job.part = header.part;
+    job.parts = header.parts;
+    job.interval = header.interval;
+    job.config_text.resize(header.config_size);
+    if (!file.read(&job.config_text[0], job.config_text.size()))
+    {
+        std::cerr << "ERROR: '" << path << "' is truncated.\n";
+        return false;
+    }
+    return samples.read(file, path);
+}
+
+class checkpoint_writer
+{
+  public:
+    checkpoint_writer(const std::string &_path, const render_job &_job)
+        : path(_path), job(_job), last(std::chrono::steady_clock::now())
+    {
+        // Inactive, and due() never, if there is no path or interval.
+        if (!path.empty() && job.interval > 0)
+            thread = std::thread([this] { run(); });
+    }
+
+    ~checkpoint_writer()
+    {
+        finish();
+    }
+
+    bool due() const
+    {
+        // True when a checkpoint is wanted: the interval has passed and the previous one is
+        // written. Checkpoints that would have to wait for the writer are skipped instead.
+        if (!thread.joinable() || busy)
+            return false;
+        return std::chrono::steady_clock::now() - last >= std::chrono::seconds(job.interval);
+    }
+
+    void submit(const std::vector<color> &framebuffer, const std::vector<uint32_t> &counts, int width, int height,
+                sampler_kind sampler, unsigned seed, int sample_begin, int sample_end)
+    {
+        // Copies the render state and returns; conversion and file output happen on the
+        // writer thread while rendering continues.
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending_sums = framebuffer;
+            pending_counts = counts;
+            pending = {width, height, sampler, seed, sample_begin, sample_end};
+            busy = true;
+        }
+        last = std::chrono::steady_clock::now();
+        wake.notify_one();
+    }
+
+    void finish()
+    {
+        // Waits for the checkpoint being written, if any, and stops the writer thread.
+        if (!thread.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        thread.join();
+    }
+
+  private:
+    struct frame
+    {
+        int width, height;
+        sampler_kind sampler;
+        unsigned seed;
+        int sample_begin, sample_end;
+    };
+
+    std::string path;
+    render_job job;
+    std::chrono::steady_clock::time_point last; // When the last checkpoint was submitted
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<color> pending_sums;
+    std::vector<uint32_t> pending_counts;
+    frame pending = {};
+    std::atomic<bool> busy{false}; // A checkpoint is submitted and not yet written
+    bool stopping = false;
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            wake.wait(lock, [this] { return busy || stopping; });
+            if (!busy)
+                return;
+
+            // The render thread doesn't touch the pending state until busy is cleared.
+            lock.unlock();
+            accumulation samples(pending_sums, pending_counts, pending.width, pending.height, pending.sampler,
+                                 pending.seed, pending.sample_begin, pending.sample_end);
+            write_checkpoint(path, job, samples);
+            lock.lock();
+            busy = false;
+        }
+    }
+};
+
+#endif
@@ -5,6 +5,7 @@
 
 #include "hittable.h"
 #include "material.h"
+#include "stats.h"
 #include "texture.h"
 
 class constant_medium : public hittable
@@ -22,12 +23,17 @@ class constant_medium : public hittable
 
     bool hit(const ray &r, interval ray_t, hit_record &rec) const override
     {
+        RTW_COUNT(medium_tests);
         // Print occasional samples when debugging. To enable, set enableDebug true.
         const bool enableDebug = false;
         const bool debugging = enableDebug && random_double() < 0.00001;
 
         hit_record rec1, rec2;
 
+        // Skip the two boundary queries when the ray segment cannot overlap the volume at all.
+        if (!boundary->bounding_box().hit(r, ray_t))
+            return false;
+
         if (!boundary->hit(r, universe, rec1))
             return false;
 
@@ -67,7 +73,8 @@ class constant_medium : public hittable
 
         rec.normal = vec3(1, 0, 0); // arbitrary
         rec.front_face = true;      // also arbitrary
-        rec.mat = phase_function;
+        rec.mat = phase_function.get();
+        rec.prim_id = id;
 
         return true;
     }
@@ -0,0 +1,588 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+// Render daemon: a long-running process that takes render jobs over a local (Unix domain)
+// socket. The most recently used built scenes stay resident between jobs, keyed by scene and
+// parameters, and decoded images stay in the image_registry, so rendering a scene again only
+// pays for tracing it.
+//
+// Requests and replies are lines of text. A client sends one of
+//
+//   render <scene> out=<image> [params=<file>] [spp=<n>] [width=<pixels>] [lookfrom=<x,y,z>]
+//          [lookat=<x,y,z>] [vfov=<degrees>] [priority=<n>]
+//   cancel <id>
+//   quit
+//
+// <scene> is a number from 1 to 10 or a scene file (see scene_file.h), built from the daemon's
+// parameters file unless params= names another; the other options override the camera the
+// scene sets up. Jobs with a higher priority go first, equal ones in the order they came. The
+// client that sent a render request hears about its job with
+//
+//   queued <id>
+//   progress <id> <percent>
+//   done <id> <image> build <seconds> render <seconds>
+//   cancelled <id>
+//   error <id> <message>
+//
+// and a job keeps going if that client disconnects. cancel and quit are answered with "ok" or
+// "error - <message>"; quit cancels every job and stops the daemon.
+
+#include "rtweekend.h"
+
+#include "external/log.h"
+#include "external/params.h"
+#include "net.h"
+#include "parallel.h"
+#include "scene_cache.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+class render_daemon
+{
+  public:
+    render_daemon(const std::string &_socket_path, const std::string &_config_text)
+        : socket_path(_socket_path), config_text(_config_text)
+    {
+    }
+
+    bool run()
+    {
+        // Serves requests until a quit request. Jobs render on worker_count() threads, each job
+        // on one of them.
+        listener = net_socket::listen_local(socket_path);
+        if (!listener.valid())
+        {
+            std::cerr << "ERROR: Could not listen on '" << socket_path << "'.\n";
+            return false;
+        }
+        LOG(INFO) << "DAEMON: LISTENING ON " << socket_path << " WITH " << worker_count() << " RENDER THREADS";
+
+        std::vector<std::thread> renderers;
+        for (int t = 0; t < worker_count(); t++)
+            renderers.emplace_back([this] { render_jobs(); });
+
+        std::vector<std::pair<shared_ptr<client>, std::thread>> connections;
+        while (!stopping)
+        {
+            std::string peer;
+            auto socket = listener.accept_within(0.25, peer);
+            if (socket.valid())
+            {
+                auto c = make_shared<client>(std::move(socket));
+                connections.emplace_back(c, std::thread([this, c] { serve(c); }));
+            }
+
+            // Every request is usually a connection of its own, so don't let closed ones pile up.
+            for (size_t k = 0; k < connections.size();)
+                if (connections[k].first->closed)
+                {
+                    connections[k].second.join();
+                    connections.erase(connections.begin() + k);
+                }
+                else
+                    k++;
+        }
+
+        // quit() has cancelled every job; the renderers tell their clients before returning.
+        for (auto &thread : renderers)
+            thread.join();
+        for (auto &connection : connections)
+        {
+            connection.first->socket.interrupt();
+            connection.second.join();
+        }
+        std::remove(socket_path.c_str());
+
+        LOG(INFO) << "DAEMON: STOPPED AFTER " << next_id << " JOBS, " << resident.size() << " SCENES RESIDENT";
+        return true;
+    }
+
+  private:
+    struct client
+    {
+        net_socket socket;
+        std::mutex send_mutex;           // Renderers and the reader thread all reply
+        std::atomic<bool> closed{false}; // The reader thread is done with it
+
+        explicit client(net_socket &&_socket) : socket(std::move(_socket))
+        {
+        }
+
+        void send(const std::string &line)
+        {
+            // A client that went away just misses its replies.
+            std::lock_guard<std::mutex> lock(send_mutex);
+            auto text = line + '\n';
+            socket.send_all(text.data(), text.size());
+        }
+    };
+
+    struct daemon_job
+    {
+        int id = 0;
+        int priority = 0;
+        int scene = 0;
+        std::string scene_file;
+        std::string config_text; // parameters.txt text the scene is built from
+        std::string output;
+        bool write_aovs = false;
+        shared_ptr<client> owner;
+        std::atomic<bool> cancelled{false};
+
+        // Camera overrides; zero or unset keeps what the scene sets up.
+        int samples_per_pixel = 0;
+        int image_width = 0;
+        double vfov = 0;
+        bool set_lookfrom = false, set_lookat = false;
+        point3 lookfrom, lookat;
+    };
+
+    using scene_future = std::shared_future<shared_ptr<const scene>>;
+
+    struct resident_entry
+    {
+        scene_future future;
+        uint64_t build = 0; // Which build made the entry
+        uint64_t used = 0;  // When a job last asked for it, for evicting the least recently used
+    };
+
+    static const size_t max_resident_scenes = 8; // Jobs still rendering an evicted scene keep it
+
+    std::string socket_path;
+    std::string config_text;
+    net_socket listener;
+    std::atomic<bool> stopping{false};
+
+    std::mutex mutex; // Guards everything below
+    std::condition_variable wake;
+    std::map<std::pair<int, int>, shared_ptr<daemon_job>> queue; // By (-priority, id)
+    std::map<int, shared_ptr<daemon_job>> running;               // By id
+    std::map<std::string, resident_entry> resident;              // By scene_key()
+    uint64_t resident_clock = 0;
+    int next_id = 0;
+
+    void serve(shared_ptr<client> c)
+    {
+        // Reads one connection's requests until it closes.
+        std::string buffer;
+        char chunk[4096];
+        for (;;)
+        {
+            auto newline = buffer.find('\n');
+            if (newline == std::string::npos)
+            {
+                auto n = c->socket.recv_some(chunk, sizeof(chunk));
+                if (n <= 0)
+                {
+                    c->closed = true;
+                    return;
+                }
+                buffer.append(chunk, n);
+                continue;
+            }
+
+            auto line = buffer.substr(0, newline);
+            buffer.erase(0, newline + 1);
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+
+            std::istringstream words(line);
+            std::string command;
+            int id;
+            if (!(words >> command))
+                continue;
+            if (command == "render")
+                submit(c, words);
+            else if (command == "cancel" && words >> id)
+                c->send(cancel(id) ? "ok" : "error - no job " + std::to_string(id) + " is queued or running");
+            else if (command == "quit")
+            {
+                quit();
+                c->send("ok");
+            }
+            else
+                c->send("error - unknown request '" + line + "'");
+        }
+    }
+
+    void submit(const shared_ptr<client> &c, std::istringstream &words)
+    {
+        auto job = make_shared<daemon_job>();
+        job->owner = c;
+        job->config_text = config_text;
+
+        std::string scene_name, option;
+        words >> scene_name;
+        if (scene_name.size() > 5 && scene_name.compare(scene_name.size() - 5, 5, ".json") == 0)
+        {
+            job->scene_file = scene_name;
+            job->scene = 1;
+        }
+        else
+            job->scene = std::atoi(scene_name.c_str());
+        if (job->scene < 1 || job->scene > 10)
+        {
+            c->send("error - no scene '" + scene_name + "'");
+            return;
+        }
+
+        while (words >> option)
+        {
+            auto equals = option.find('=');
+            auto key = option.substr(0, equals);
+            auto value = equals == std::string::npos ? "" : option.substr(equals + 1);
+            try
+            {
+                if (key == "out")
+                    job->output = value;
+                else if (key == "params")
+                {
+                    std::ifstream file(value);
+                    if (!file.is_open())
+                    {
+                        c->send("error - could not open '" + value + "'");
+                        return;
+                    }
+                    job->config_text.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+                }
+                else if (key == "spp")
+                    job->samples_per_pixel = std::max(1, std::stoi(value));
+                else if (key == "width")
+                    job->image_width = std::max(1, std::stoi(value));
+                else if (key == "vfov")
+                    job->vfov = std::stod(value);
+                else if (key == "priority")
+                    job->priority = std::stoi(value);
+                else if (key == "lookfrom" || key == "lookat")
+                {
+                    auto v = splitComma(value);
+                    if (v.size() != 3)
+                        throw std::invalid_argument(key);
+                    point3 p(std::stod(v[0]), std::stod(v[1]), std::stod(v[2]));
+                    (key == "lookfrom" ? job->lookfrom : job->lookat) = p;
+                    (key == "lookfrom" ? job->set_lookfrom : job->set_lookat) = true;
+                }
+                else
+                {
+                    c->send("error - unknown option '" + option + "'");
+                    return;
+                }
+            }
+            catch (const std::exception &)
+            {
+                c->send("error - bad value in '" + option + "'");
+                return;
+            }
+        }
+        if (job->output.empty())
+        {
+            c->send("error - a render needs out=<image>");
+            return;
+        }
+        RenderParameters params;
+        try
+        {
+            if (!params.setFromConfigText(job->config_text))
+                throw std::invalid_argument("parameters");
+        }
+        catch (const std::exception &)
+        {
+            c->send("error - the parameters can't be read");
+            return;
+        }
+        job->write_aovs = params.write_aovs;
+
+        // queued has to reach the client before any progress a renderer sends, so it goes out
+        // between taking an id and queueing the job.
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!stopping)
+                job->id = ++next_id;
+        }
+        if (job->id == 0)
+        {
+            c->send("error - the daemon is stopping");
+            return;
+        }
+        c->send("queued " + std::to_string(job->id));
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping)
+            {
+                c->send("cancelled " + std::to_string(job->id));
+                return;
+            }
+            queue.emplace(std::make_pair(-job->priority, job->id), job);
+        }
+        wake.notify_one();
+    }
+
+    bool cancel(int id)
+    {
+        // A queued job is dropped; a running one stops at its next row, and its renderer replies.
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = queue.begin(); it != queue.end(); ++it)
+            if (it->second->id == id)
+            {
+                it->second->owner->send("cancelled " + std::to_string(id));
+                queue.erase(it);
+                return true;
+            }
+        auto it = running.find(id);
+        if (it == running.end())
+            return false;
+        it->second->cancelled = true;
+        return true;
+    }
+
+    void quit()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        for (const auto &entry : queue)
+            entry.second->owner->send("cancelled " + std::to_string(entry.second->id));
+        queue.clear();
+        for (const auto &entry : running)
+            entry.second->cancelled = true;
+        wake.notify_all();
+    }
+
+    void render_jobs()
+    {
+        // One of worker_count() renderers, so a job's own parallel loops (denoising) stay here.
+        parallel_work_scope scope;
+        for (;;)
+        {
+            shared_ptr<daemon_job> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (queue.empty())
+                    return;
+                job = queue.begin()->second;
+                queue.erase(queue.begin());
+                running[job->id] = job;
+            }
+            render(*job);
+            std::lock_guard<std::mutex> lock(mutex);
+            running.erase(job->id);
+        }
+    }
+
+    static std::string scene_key(const daemon_job &job)
+    {
+        // A scene file's modification time is part of the key, so editing the file rebuilds it.
+        if (job.scene_file.empty())
+            return std::to_string(job.scene) + '\n' + job.config_text;
+        std::error_code ec;
+        auto modified = std::filesystem::last_write_time(job.scene_file, ec).time_since_epoch().count();
+        return job.scene_file + '@' + std::to_string(ec ? 0 : modified) + '\n' + job.config_text;
+    }
+
+    shared_ptr<const scene> resident_scene(const daemon_job &job, double &build_secs)
+    {
+        // The scene a job renders. The first job that needs it builds it; jobs that want it
+        // meanwhile wait for that build instead of starting their own. Scenes that fail to
+        // build aren't kept, so a fixed scene file is tried again, and past
+        // max_resident_scenes the least recently used scene is dropped.
+        auto key = scene_key(job);
+        std::promise<shared_ptr<const scene>> promise;
+        scene_future future;
+        uint64_t build = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = resident.find(key);
+            if (it == resident.end())
+            {
+                it = resident.emplace(key, resident_entry{promise.get_future().share(), ++resident_clock}).first;
+                build = resident_clock;
+                evict_resident(key);
+            }
+            it->second.used = ++resident_clock;
+            future = it->second.future;
+        }
+        if (!build)
+            return future.get();
+
+        auto start = std::chrono::steady_clock::now();
+        RenderParameters params;
+        params.setFromConfigText(job.config_text);
+        params.scene_file = job.scene_file;
+        random_generator().seed(std::mt19937::default_seed); // As if built by a fresh process
+
+        auto s = make_shared<scene>();
+        try
+        {
+            if (!load_scene(job.scene, params, *s))
+                s = nullptr;
+        }
+        catch (const std::exception &e)
+        {
+            // Jobs waiting on this build must still hear that it failed.
+            std::cerr << "ERROR: Building the scene for job " << job.id << " failed: " << e.what() << '\n';
+            s = nullptr;
+        }
+        if (!s)
+        {
+            // Unless the entry was evicted and another build took the key meanwhile.
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = resident.find(key);
+            if (it != resident.end() && it->second.build == build)
+                resident.erase(it);
+        }
+        promise.set_value(s);
+        build_secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return s;
+    }
+
+    void evict_resident(const std::string &keep)
+    {
+        // Drops the least recently used scenes other than keep, down to max_resident_scenes.
+        // Call with mutex held.
+        while (resident.size() > max_resident_scenes)
+        {
+            auto oldest = resident.end();
+            for (auto it = resident.begin(); it != resident.end(); ++it)
+                if (it->first != keep && (oldest == resident.end() || it->second.used < oldest->second.used))
+                    oldest = it;
+            resident.erase(oldest);
+        }
+    }
+
+    void render(daemon_job &job)
+    {
+        auto id = std::to_string(job.id);
+        double build_secs = 0;
+        auto s = resident_scene(job, build_secs);
+        if (!s)
+        {
+            job.owner->send("error " + id + " could not build the scene");
+            return;
+        }
+
+        // The resident camera is shared; this job renders a copy with its overrides.
+        auto cam = s->cam;
+        if (job.samples_per_pixel > 0)
+            cam.samples_per_pixel = job.samples_per_pixel;
+        if (job.image_width > 0)
+            cam.image_width = job.image_width;
+        if (job.vfov > 0)
+            cam.vfov = job.vfov;
+        if (job.set_lookfrom)
+            cam.lookfrom = job.lookfrom;
+        if (job.set_lookat)
+            cam.lookat = job.lookat;
+        if (job.write_aovs)
+            cam.aov_prefix = job.output.substr(0, job.output.rfind(".ppm"));
+
+        std::ofstream file(job.output);
+        if (!file.is_open())
+        {
+            job.owner->send("error " + id + " could not write '" + job.output + "'");
+            return;
+        }
+        cam.image_out = &file;
+        cam.show_progress = false;
+        int reported = -1;
+        cam.on_progress = [&](double done) {
+            auto percent = static_cast<int>(100 * done);
+            if (percent != reported)
+            {
+                reported = percent;
+                job.owner->send("progress " + id + " " + std::to_string(percent));
+            }
+            return !job.cancelled;
+        };
+
+        auto start = std::chrono::steady_clock::now();
+        cam.render(s->world, s->lights);
+        auto render_secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (job.cancelled)
+        {
+            file.close();
+            std::remove(job.output.c_str());
+            LOG(INFO) << "DAEMON: JOB " << id << " CANCELLED";
+            job.owner->send("cancelled " + id);
+            return;
+        }
+
+        file.close(); // The image is complete by the time the client hears about it
+        if (!file)
+        {
+            job.owner->send("error " + id + " could not write '" + job.output + "'");
+            return;
+        }
+
+        LOG(INFO) << "DAEMON: JOB " << id << " " << job.output << ": BUILD " << build_secs << "s, RENDER "
+                  << render_secs << "s";
+        std::ostringstream reply;
+        reply << "done " << id << ' ' << job.output << " build " << build_secs << " render " << render_secs;
+        job.owner->send(reply.str());
+    }
+};
+
+inline bool submit_to_daemon(const std::string &socket_path, const std::string &request)
+{
+    // Sends one request to a daemon and prints its replies until the request is settled: a
+    // render once its job is done, cancelled or failed, anything else after the first reply.
+    auto start = std::chrono::steady_clock::now();
+    auto socket = net_socket::connect_local(socket_path);
+    if (!socket.valid())
+    {
+        std::cerr << "ERROR: No render daemon is listening on '" << socket_path << "'.\n";
+        return false;
+    }
+    auto text = request + '\n';
+    if (!socket.send_all(text.data(), text.size()))
+        return false;
+
+    bool render = request.compare(0, 7, "render ") == 0;
+    std::string buffer;
+    char chunk[4096];
+    for (;;)
+    {
+        auto newline = buffer.find('\n');
+        if (newline == std::string::npos)
+        {
+            auto n = socket.recv_some(chunk, sizeof(chunk));
+            if (n <= 0)
+            {
+                std::cerr << "ERROR: The render daemon closed the connection.\n";
+                return false;
+            }
+            buffer.append(chunk, n);
+            continue;
+        }
+
+        auto line = buffer.substr(0, newline);
+        buffer.erase(0, newline + 1);
+        std::cout << line << std::endl;
+        auto reply = line.substr(0, line.find(' '));
+        if (!render || reply == "error" || reply == "cancelled")
+            return reply == "ok";
+        if (reply == "done")
+        {
+            auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "latency " << secs << "s" << std::endl;
+            return true;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,223 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "rtweekend.h"
+
+#include "color.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+struct denoise_input
+{
+    // Per-pixel means from the render, as planar float rows (index y * width + x).
+    int width = 0, height = 0;
+    std::vector<float> radiance[3]; // Linear color
+    std::vector<float> albedo[3];   // First-hit albedo
+    std::vector<float> normal[3];   // First-hit normal, zero where the camera ray escaped
+    std::vector<float> variance;    // Variance of the mean luminance
+};
+
+struct denoise_settings
+{
+    int iterations = 5;           // Filter passes; pass i uses taps 2^i pixels apart
+    float sigma_luminance = 4.0f; // Luminance edge stop, in standard deviations of the noise
+    float sigma_albedo = 0.1f;    // Albedo edge stop, as a squared RGB distance
+};
+
+namespace denoising
+{
+
+inline float fast_exp(float x)
+{
+    // e^x for x <= 0 to about 1e-5 relative error. Only arithmetic and bit casts, so loops
+    // that call it can be vectorized.
+    auto t = x * 1.44269504f;
+    t = 0.5f * (t - 120.0f + std::fabs(t + 120.0f)); // max(t, -120); a compare here becomes a branch
+    auto i = static_cast<int>(t + 128.0f) - 128; // floor(t), as truncation of a positive value
+    auto f = t - static_cast<float>(i);
+    auto p = 1.0f + f * (0.693147f + f * (0.240227f + f * (0.0555041f + f * (0.00961813f + f * 0.00133336f))));
+
+    int32_t bits = (i + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+inline float luminance(float r, float g, float b)
+{
+    return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
+struct filter_row
+{
+    // Pointers to the start of one image row in each plane the filter reads.
+    const float *normal[3], *albedo[3], *color[3];
+    const float *has_normal, *variance;
+};
+
+inline void accumulate_taps(const filter_row &p, const float *p_luminance, const float *p_inv_sigma,
+                            const filter_row &q, int x0, int x1, int offset, float k, float inv_sigma_albedo,
+                            float *__restrict sum0, float *__restrict sum1, float *__restrict sum2,
+                            float *__restrict weight_sum, float *__restrict variance_sum)
+{
+    // Adds the tap at x + offset in row q to the sums for each pixel x in [x0, x1) of row p.
+    // The loop is contiguous and branch-free, and the sums are __restrict so it vectorizes
+    // without runtime alias checks.
+    const float *pn0 = p.normal[0], *pn1 = p.normal[1], *pn2 = p.normal[2], *ph = p.has_normal;
+    const float *pa0 = p.albedo[0], *pa1 = p.albedo[1], *pa2 = p.albedo[2];
+    const float *qn0 = q.normal[0], *qn1 = q.normal[1], *qn2 = q.normal[2], *qh = q.has_normal;
+    const float *qa0 = q.albedo[0], *qa1 = q.albedo[1], *qa2 = q.albedo[2];
+    const float *qc0 = q.color[0], *qc1 = q.color[1], *qc2 = q.color[2], *qv = q.variance;
+
+    for (int x = x0; x < x1; x++)
+    {
+        const int t = x + offset;
+
+        // Normal weight: cos^128 of the angle between normals. Two pixels that both missed
+        // count as facing the same way.
+        auto d = pn0[x] * qn0[t] + pn1[x] * qn1[t] + pn2[x] * qn2[t];
+        d = std::max(d, 0.0f) + (1 - ph[x]) * (1 - qh[t]);
+        d *= d, d *= d, d *= d, d *= d, d *= d, d *= d, d *= d;
+
+        auto dl = std::fabs(p_luminance[x] - luminance(qc0[t], qc1[t], qc2[t]));
+        auto da0 = pa0[x] - qa0[t], da1 = pa1[x] - qa1[t], da2 = pa2[x] - qa2[t];
+        auto da = da0 * da0 + da1 * da1 + da2 * da2;
+
+        auto weight = k * d * fast_exp(-dl * p_inv_sigma[x] - da * inv_sigma_albedo);
+        sum0[x] += weight * qc0[t];
+        sum1[x] += weight * qc1[t];
+        sum2[x] += weight * qc2[t];
+        weight_sum[x] += weight;
+        variance_sum[x] += weight * weight * qv[t];
+    }
+}
+
+} // namespace denoising
+
+inline std::vector<color> atrous_denoise(const denoise_input &in, const denoise_settings &settings = {})
+{
+    // Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010, with the variance-guided
+    // luminance weight of SVGF). The image is divided by albedo, filtered with a 5x5 B3-spline
+    // kernel whose taps spread out each pass, and multiplied back, so texture detail survives.
+    // Tap weights fall off with normal, albedo and luminance differences; the luminance scale
+    // follows the per-pixel noise estimate, which is filtered along with the image.
+    using namespace denoising;
+
+    const int w = in.width, h = in.height;
+    const auto n = static_cast<size_t>(w) * h;
+    const float eps = 0.001f;
+    const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+    // Demodulate, and mark pixels whose camera ray hit something (they have a normal).
+    std::vector<float> irr[3], next[3], has_normal(n), var(n), next_var(n);
+    for (int c = 0; c < 3; c++)
+    {
+        irr[c].resize(n);
+        next[c].resize(n);
+    }
+    parallel_for(0, h, [&](int y) {
+        for (size_t i = static_cast<size_t>(y) * w; i < static_cast<size_t>(y + 1) * w; i++)
+        {
+            for (int c = 0; c < 3; c++)
+                irr[c][i] = in.radiance[c][i] / (in.albedo[c][i] + eps);
+            auto a = luminance(in.albedo[0][i], in.albedo[1][i], in.albedo[2][i]) + eps;
+            var[i] = in.variance[i] / (a * a);
+            has_normal[i] = in.normal[0][i] != 0 || in.normal[1][i] != 0 || in.normal[2][i] != 0;
+        }
+    });
+
+    // A 3x3 blur of the variance makes the single-pixel estimate usable at low sample counts.
+    parallel_for(0, h, [&](int y) {
+        for (int x = 0; x < w; x++)
+        {
+            float sum = 0, weight = 0;
+            for (int dy = -1; dy <= 1; dy++)
+                for (int dx = -1; dx <= 1; dx++)
+                {
+                    int qx = x + dx, qy = y + dy;
+                    if (qx < 0 || qy < 0 || qx >= w || qy >= h)
+                        continue;
+                    auto k = kernel[2 + dx] * kernel[2 + dy];
+                    sum += k * var[static_cast<size_t>(qy) * w + qx];
+                    weight += k;
+                }
+            next_var[static_cast<size_t>(y) * w + x] = sum / weight;
+        }
+    });
+    var.swap(next_var);
+
+    auto row_at = [&](size_t start) {
+        filter_row r;
+        for (int c = 0; c < 3; c++)
+        {
+            r.normal[c] = &in.normal[c][start];
+            r.albedo[c] = &in.albedo[c][start];
+            r.color[c] = &irr[c][start];
+        }
+        r.has_normal = &has_normal[start];
+        r.variance = &var[start];
+        return r;
+    };
+
+    for (int pass = 0; pass < settings.iterations; pass++)
+    {
+        const int step = 1 << pass;
+        parallel_for(0, h, [&](int y) {
+            const auto row = static_cast<size_t>(y) * w;
+            std::vector<float> acc[3], wsum(w, 0.0f), vsum(w, 0.0f), lum(w), inv_sigma(w);
+            for (int c = 0; c < 3; c++)
+                acc[c].assign(w, 0.0f);
+            for (int x = 0; x < w; x++)
+            {
+                auto i = row + x;
+                lum[x] = luminance(irr[0][i], irr[1][i], irr[2][i]);
+                inv_sigma[x] = 1.0f / (settings.sigma_luminance * std::sqrt(var[i]) + eps);
+            }
+            const auto inv_sigma_albedo = 1.0f / settings.sigma_albedo;
+            const auto p = row_at(row);
+
+            for (int ty = -2; ty <= 2; ty++)
+            {
+                int qy = y + ty * step;
+                if (qy < 0 || qy >= h)
+                    continue;
+                const auto q = row_at(static_cast<size_t>(qy) * w);
+
+                for (int tx = -2; tx <= 2; tx++)
+                {
+                    // Taps that fall outside the image are skipped; the weights renormalize.
+                    const int offset = tx * step;
+                    accumulate_taps(p, lum.data(), inv_sigma.data(), q, std::max(0, -offset), std::min(w, w - offset),
+                                    offset, kernel[2 + tx] * kernel[2 + ty], inv_sigma_albedo, acc[0].data(),
+                                    acc[1].data(), acc[2].data(), wsum.data(), vsum.data());
+                }
+            }
+
+            for (int x = 0; x < w; x++)
+            {
+                auto i = row + x;
+                auto inv = wsum[x] > 0 ? 1.0f / wsum[x] : 0.0f;
+                for (int c = 0; c < 3; c++)
+                    next[c][i] = wsum[x] > 0 ? acc[c][x] * inv : irr[c][i];
+                next_var[i] = wsum[x] > 0 ? vsum[x] * inv * inv : var[i];
+            }
+        });
+
+        for (int c = 0; c < 3; c++)
+            irr[c].swap(next[c]);
+        var.swap(next_var);
+    }
+
+    // Remodulate.
+    std::vector<color> out(n);
+    for (size_t i = 0; i < n; i++)
+        out[i] = color(irr[0][i] * (in.albedo[0][i] + eps), irr[1][i] * (in.albedo[1][i] + eps),
+                       irr[2][i] * (in.albedo[2][i] + eps));
+    return out;
+}
+
+#endif
@@ -1,3 +1,6 @@
+#ifndef EXAMPLE_H
+#define EXAMPLE_H
+
 #include <iostream>
 
 #include "bvh.h"
@@ -12,6 +15,17 @@
 #include "rtweekend.h"
 #include "sphere.h"
 #include "texture.h"
+#include "texture_cache.h"
+#include "trace.h"
+#include "volume.h"
+
+struct scene
+{
+    // Everything a scene function builds: rendering it is cam.render(world, lights).
+    hittable_list world;
+    hittable_list lights;
+    camera cam;
+};
 
 hittable_list get_ligths()
 {
@@ -76,8 +90,25 @@ camera initialize_camera(const point3 &lookfrom, const point3 &lookat, const vec
     return cam;
 }
 
-void random_spheres(RenderParameters params, int start = -11, int end = 11)
+void apply_render_options(camera &cam, const RenderParameters &params)
 {
+    // Options that change how a scene is rendered, but not what it looks like.
+    cam.wavefront_size = params.wavefront_size;
+    cam.sort_secondary = params.sort_rays;
+    cam.sampler = params.sampler;
+    cam.sampler_seed = params.seed;
+    cam.first_sample = params.first_sample;
+    cam.accumulation_path = params.accumulation_path;
+    cam.checkpoint_path = params.checkpoint_path;
+    cam.aov_prefix = params.aov_prefix;
+    cam.heatmap_prefix = params.heatmap_prefix;
+    cam.denoise = params.denoise;
+    cam.show_progress = params.show_progress;
+}
+
+scene random_spheres(RenderParameters params, int start = -11, int end = 11)
+{
+    RTW_TRACE_ZONE("random_spheres");
     // World
     hittable_list world;
 
@@ -144,13 +175,13 @@ void random_spheres(RenderParameters params, int start = -11, int end = 11)
     camera cam = initialize_camera(params.lookfrom, params.lookat, params.vup, params.vfov, params.aspect_ratio,
                                    params.image_width, params.samples_per_pixel, params.max_depth, params.defocus_angle,
                                    params.focus_dist, params.c);
-    LOG(INFO) << "START RENDERING";
-    cam.render(world, get_ligths());
-    LOG(INFO) << "END RENDERING\n";
+    apply_render_options(cam, params);
+    return {world, get_ligths(), cam};
 }
 
-void two_spheres(RenderParameters params)
+scene two_spheres(RenderParameters params)
 {
+    RTW_TRACE_ZONE("two_spheres");
     // World
     hittable_list world;
 
@@ -162,13 +193,13 @@ void two_spheres(RenderParameters params)
     camera cam = initialize_camera(params.lookfrom, params.lookat, params.vup, params.vfov, params.aspect_ratio,
                                    params.image_width, params.samples_per_pixel, params.max_depth, params.defocus_angle,
                                    params.focus_dist, params.c);
-    LOG(INFO) << "START RENDERING";
-    cam.render(world, get_ligths());
-    LOG(INFO) << "END RENDERING\n";
+    apply_render_options(cam, params);
+    return {world, get_ligths(), cam};
 }
 
-void earth(RenderParameters params)
+scene earth(RenderParameters params)
 {
+    RTW_TRACE_ZONE("earth");
 
     // World
     hittable_list world;
@@ -180,13 +211,13 @@ void earth(RenderParameters params)
     camera cam = initialize_camera(point3(0, 0, 12), params.lookat, params.vup, params.vfov, params.aspect_ratio,
                                    params.image_width, params.samples_per_pixel, params.max_depth, params.defocus_angle,
                                    params.focus_dist, params.c);
-    LOG(INFO) << "START RENDERING";
-    cam.render(world, get_ligths());
-    LOG(INFO) << "END RENDERING\n";
+    apply_render_options(cam, params);
+    return {world, get_ligths(), cam};
 }
 
-void two_perlin_spheres(RenderParameters params)
+scene two_perlin_spheres(RenderParameters params)
 {
+    RTW_TRACE_ZONE("two_perlin_spheres");
     hittable_list world;
 
     auto pertext = make_shared<noise_texture>(4);
@@ -196,13 +227,13 @@ void two_perlin_spheres(RenderParameters params)
     camera cam = initialize_camera(params.lookfrom, params.lookat, params.vup, params.vfov, params.aspect_ratio,
                                    params.image_width, params.samples_per_pixel, params.max_depth, 0, params.focus_dist,
                                    params.c);
-    LOG(INFO) << "START RENDERING";
-    cam.render(world, get_ligths());
-    LOG(INFO) << "END RENDERING\n";
+    apply_render_options(cam, params);
+    return {world, get_ligths(), cam};
 }
 
-void quads(RenderParameters params)
+scene quads(RenderParameters params)
 {
+    RTW_TRACE_ZONE("quads");
     hittable_list world;
 
     // Materials
@@ -223,13 +254,13 @@ void quads(RenderParameters params)
         initialize_camera(point3(0, 0, 9), params.lookat, params.vup, 80, params.aspect_ratio, params.image_width,
                           params.samples_per_pixel, params.max_depth, 0, params.focus_dist, params.c);
 
-    LOG(INFO) << "START RENDERING";
-    cam.render(world, get_ligths());
-    LOG(INFO) << "END RENDERING\n";
+    apply_render_options(cam, params);
+    return {world, get_ligths(), cam};
 }
 
-void simple_light(RenderParameters params)
+scene simple_light(RenderParameters params)
 {
+    RTW_TRACE_ZONE("simple_light");
     hittable_list world;
 
     auto pertext = make_shared<noise_texture>(4);
@@ -244,13 +275,13 @@ void simple_light(RenderParameters params)
                                    params.image_width, params.samples_per_pixel, params.max_depth, 0, params.focus_dist,
                                    params.c);
 
-    LOG(INFO) << "START RENDERING";
-    cam.render(world, get_ligths());
-    LOG(INFO) << "END RENDERING\n";
+    apply_render_options(cam, params);
+    return {world, get_ligths(), cam};
 }
 
-void cornell_box(RenderParameters params)
+scene cornell_box(RenderParameters params)
 {
+    RTW_TRACE_ZONE("cornell_box");
     hittable_list world;
 
     auto red = make_shared<lambertian>(color(.65, .05, .05));
@@ -279,13 +310,13 @@ void cornell_box(RenderParameters params)
                                    params.image_width, params.samples_per_pixel, params.max_depth, 0, params.focus_dist,
                                    color(0, 0, 0));
 
-    LOG(INFO) << "START RENDERING";
-    cam.render(world, get_ligths());
-    LOG(INFO) << "END RENDERING\n";
+    apply_render_options(cam, params);
+    return {world, get_ligths(), cam};
 }
 
-void cornell_smoke(RenderParameters params)
+scene cornell_smoke(RenderParameters params)
 {
+    RTW_TRACE_ZONE("cornell_smoke");
     hittable_list world;
 
     auto red = make_shared<lambertian>(color(.65, .05, .05));
@@ -314,13 +345,13 @@ void cornell_smoke(RenderParameters params)
     camera cam = initialize_camera(point3(278, 278, -800), point3(278, 278, 0), params.vup, 40, params.aspect_ratio,
                                    params.image_width, 200, params.max_depth, 0, params.focus_dist, color(0, 0, 0));
 
-    LOG(INFO) << "START RENDERING";
-    cam.render(world, get_ligths());
-    LOG(INFO) << "END RENDERING\n";
+    apply_render_options(cam, params);
+    return {world, get_ligths(), cam};
 }
 
-void final_scene(RenderParameters params)
+scene final_scene(RenderParameters params)
 {
+    RTW_TRACE_ZONE("final_scene");
     hittable_list boxes1;
     auto ground = make_shared<lambertian>(color(0.48, 0.83, 0.53));
 
@@ -359,8 +390,6 @@ void final_scene(RenderParameters params)
     auto boundary = make_shared<sphere>(point3(360, 150, 145), 70, make_shared<dielectric>(1.5));
     world.add(boundary);
     world.add(make_shared<constant_medium>(boundary, 0.2, color(0.2, 0.4, 0.9)));
-    boundary = make_shared<sphere>(point3(0, 0, 0), 5000, make_shared<dielectric>(1.5));
-    world.add(make_shared<constant_medium>(boundary, .0001, color(1, 1, 1)));
 
     auto emat = make_shared<lambertian>(make_shared<image_texture>("img/earthmap.jpg"));
     world.add(make_shared<sphere>(point3(400, 200, 400), 100, emat));
@@ -380,14 +409,16 @@ void final_scene(RenderParameters params)
     camera cam = initialize_camera(point3(478, 278, -600), point3(278, 278, 0), params.vup, 40, params.aspect_ratio,
                                    params.image_width, params.samples_per_pixel, params.max_depth, 0, params.focus_dist,
                                    color(0, 0, 0));
+    // Thin fog over the whole scene, sampled by the camera instead of living in the world list.
+    cam.medium = make_shared<atmosphere>(.0001, color(1, 1, 1), point3(0, 0, 0), 5000);
 
-    LOG(INFO) << "START RENDERING";
-    cam.render(world, get_ligths());
-    LOG(INFO) << "END RENDERING\n";
+    apply_render_options(cam, params);
+    return {world, get_ligths(), cam};
 }
 
-void another_last_scene(RenderParameters params)
+scene another_last_scene(RenderParameters params)
 {
+    RTW_TRACE_ZONE("another_last_scene");
     hittable_list world;
 
     auto red = make_shared<lambertian>(color(.65, .05, .05));
@@ -425,7 +456,60 @@ void another_last_scene(RenderParameters params)
                                    params.image_width, params.samples_per_pixel, params.max_depth, params.defocus_angle,
                                    params.focus_dist, color(0, 0, 0));
 
-    LOG(INFO) << "START RENDERING";
-    cam.render(world, get_ligths());
-    LOG(INFO) << "END RENDERING\n";
+    apply_render_options(cam, params);
+    return {world, get_ligths(), cam};
 }
+
+bool build_scene(int choice, const RenderParameters &params, scene &out)
+{
+    // Builds example scene number choice (1-10). Scene construction draws from the global
+    // generator only, so a fresh process builds the same scene every time.
+    switch (choice)
+    {
+    case 1:
+        LOG(INFO) << "CHOSEN: RANDOM_SPHERES()";
+        out = random_spheres(params, -15, 15);
+        return true;
+    case 2:
+        LOG(INFO) << "CHOSEN: TWO_SPHERES()";
+        out = two_spheres(params);
+        return true;
+    case 3:
+        LOG(INFO) << "CHOSEN: EARTH()"; // FAIL
+        out = earth(params);
+        return true;
+    case 4:
+        LOG(INFO) << "CHOSEN: TWO_PERLIN_SPHERES()";
+        out = two_perlin_spheres(params);
+        return true;
+    case 5:
+        LOG(INFO) << "CHOSEN: QUADS()";
+        out = quads(params);
+        return true;
+    case 6:
+        LOG(INFO) << "CHOSEN: SIMPLE_LIGHT()";
+        out = simple_light(params);
+        return true;
+    case 7:
+        LOG(INFO) << "CHOSEN: CORNELL_BOX()"; // FAIL
+        out = cornell_box(params);
+        return true;
+    case 8:
+        LOG(INFO) << "CHOSEN: CORNELL_SMOKE()"; // FAIL
+        out = cornell_smoke(params);
+        return true;
+    case 9:
+        LOG(INFO) << "CHOSEN: FINAL_SCENE()"; // FAIL
+        out = final_scene(params);
+        return true;
+    case 10:
+        LOG(INFO) << "CHOSEN: ANOTHER_LAST_SCENE()";
+        out = another_last_scene(params);
+        return true;
+    default:
+        LOG(ERROR) << "INVALID CHOICE";
+        return false;
+    }
+}
+
+#endif
@@ -4,6 +4,7 @@
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <string>
 #include <vector>
 
 #include "../color.h"
@@ -14,7 +15,8 @@ class RenderParameters
   public:
     RenderParameters()
         : lookfrom(13, 2, 3), lookat(0, 0, 0), vup(0, 1, 0), vfov(20), aspect_ratio(16.0 / 9.0), image_width(1920),
-          samples_per_pixel(100), max_depth(50), defocus_angle(0.6), focus_dist(10.0), c(0.70, 0.80, 1.00)
+          samples_per_pixel(100), max_depth(50), defocus_angle(0.6), focus_dist(10.0), c(0.70, 0.80, 1.00),
+          wavefront_size(0), sort_rays(false), sampler(sampler_kind::sobol), write_aovs(false), denoise(false), seed(0)
     {
     }
 
@@ -30,8 +32,30 @@ class RenderParameters
     double defocus_angle;
     double focus_dist;
     color c;
+    int wavefront_size;   // Optional: paths per wavefront batch, 0 renders depth-first
+    bool sort_rays;       // Optional: reorder secondary rays in the wavefront renderer
+    sampler_kind sampler; // Optional: independent, sobol, halton or blue_noise
+    bool write_aovs;      // Optional: also write the auxiliary outputs as PFM images
+    bool denoise;         // Optional: denoise the image before writing it
+    unsigned seed;        // Optional: sampler scrambling seed
+
+    // Set per image from the command line; not read from the file.
+    std::string scene_file;        // Render this scene file (see scene_file.h) instead of a numbered scene
+    std::string scene_cache;       // Binary cache of scene_file (see scene_cache.h), rebuilt when stale
+    std::string aov_prefix;        // Prefix of the AOV files when write_aovs is on
+    bool write_heatmaps = false;   // Also write per-pixel cost images (see camera::heatmap_prefix)
+    std::string heatmap_prefix;    // Prefix of the heatmap files when write_heatmaps is on
+    int part = 0, parts = 0;       // Render only part part of parts of the samples, if parts > 0
+    int first_sample = 0;          // First sample index traced per pixel
+    std::string accumulation_path; // Where to write the raw sums (see accumulation.h)
+    std::string checkpoint_path;   // Where to save progress periodically (see checkpoint.h)
+    bool show_progress = true;     // Draw a progress bar while rendering
 
     void setFromConfigFile(const std::string &filename);
+    bool setFromConfigText(const std::string &text); // Same format as the file, e.g. sent by a coordinator
+
+  private:
+    bool setFromValues(const std::vector<std::vector<std::string>> &values);
 };
 
 // TODO: not the best solution but works
@@ -49,18 +73,9 @@ std::vector<std::string> splitComma(std::string input)
     return tokens;
 }
 
-std::vector<std::vector<std::string>> parse_config_file(const std::string &filename)
+std::vector<std::vector<std::string>> parse_config_stream(std::istream &file)
 {
     std::vector<std::vector<std::string>> params;
-    std::ifstream file(filename);
-    std::vector<std::string> lines;
-
-    if (!file.is_open())
-    {
-        std::cerr << "Error: Failed to open file " << filename << std::endl;
-        return params;
-    }
-
     std::string line;
 
     while (std::getline(file, line))
@@ -79,14 +94,37 @@ std::vector<std::vector<std::string>> parse_config_file(const std::string &filen
     return params;
 }
 
+std::vector<std::vector<std::string>> parse_config_file(const std::string &filename)
+{
+    std::ifstream file(filename);
+
+    if (!file.is_open())
+    {
+        std::cerr << "Error: Failed to open file " << filename << std::endl;
+        return {};
+    }
+
+    return parse_config_stream(file);
+}
+
 void RenderParameters::setFromConfigFile(const std::string &filename)
 {
-    std::vector<std::vector<std::string>> values = parse_config_file(filename);
+    if (setFromValues(parse_config_file(filename)))
+        std::cout << "Parameters set from config file: " << filename << std::endl;
+}
+
+bool RenderParameters::setFromConfigText(const std::string &text)
+{
+    std::istringstream stream(text);
+    return setFromValues(parse_config_stream(stream));
+}
 
-    if (values.size() != 11)
+bool RenderParameters::setFromValues(const std::vector<std::vector<std::string>> &values)
+{
+    if (values.size() < 11)
     {
         std::cerr << "Error: Configuration file does not contain all required parameters\n";
-        return;
+        return false;
     }
 
     // Set parameters based on parsed values
@@ -101,8 +139,19 @@ void RenderParameters::setFromConfigFile(const std::string &filename)
     defocus_angle = std::stod(values[8][0]);
     focus_dist = std::stod(values[9][0]);
     c = color(std::stod(values[10][0]), std::stod(values[10][1]), std::stod(values[10][2]));
-
-    std::cout << "Parameters set from config file: " << filename << std::endl;
+    if (values.size() > 11)
+        wavefront_size = std::stoi(values[11][0]);
+    if (values.size() > 12)
+        sort_rays = std::stoi(values[12][0]) != 0;
+    if (values.size() > 13 && !parse_sampler_kind(values[13][0], sampler))
+        std::cerr << "Error: Unknown sampler '" << values[13][0] << "'\n";
+    if (values.size() > 14)
+        write_aovs = std::stoi(values[14][0]) != 0;
+    if (values.size() > 15)
+        denoise = std::stoi(values[15][0]) != 0;
+    if (values.size() > 16)
+        seed = static_cast<unsigned>(std::stoul(values[16][0]));
+    return true;
 }
 
 #endif
@@ -5,6 +5,8 @@
 
 #include "aabb.h"
 
+#include <atomic>
+
 class material;
 
 class hit_record
@@ -12,11 +14,14 @@ class hit_record
   public:
     point3 p;
     vec3 normal;
-    shared_ptr<material> mat;
+    const material *mat; // Owned by the hit object
     double t;
     double u;
     double v;
     bool front_face;
+    double uv_scale = 0;  // Texture-space units per world-space unit around p (0 if unknown)
+    double footprint = 0; // Texture-space width of the ray footprint at p
+    int prim_id = -1;     // id of the primitive that was hit (-1 if not a hittable)
 
     void set_face_normal(const ray &r, const vec3 &outward_normal)
     {
@@ -31,6 +36,8 @@ class hit_record
 class hittable
 {
   public:
+    int id = next_id(); // Unique per object, in construction order
+
     virtual ~hittable() = default;
 
     virtual bool hit(const ray &r, interval ray_t, hit_record &rec) const = 0;
@@ -46,6 +53,13 @@ class hittable
     {
         return vec3(1, 0, 0);
     }
+
+  private:
+    static int next_id()
+    {
+        static std::atomic<int> counter(0);
+        return counter++;
+    }
 };
 
 class translate : public hittable
@@ -168,4 +182,87 @@ class rotate_y : public hittable
     aabb bbox;
 };
 
+class movable : public hittable
+{
+  public:
+    // Like rotate_y followed by translate, but the placement can change after construction, e.g.
+    // per animation frame. Containers caching the old bounding box need a refit (see bvh_node).
+    movable(shared_ptr<hittable> p) : object(p)
+    {
+        auto box = object->bounding_box();
+        pivot = point3((box.x.min + box.x.max) / 2, 0, (box.z.min + box.z.max) / 2);
+        place(vec3(0, 0, 0), 0);
+    }
+
+    void place(const vec3 &displacement, double angle)
+    {
+        // Rotates the object by angle degrees around the vertical axis through its center, then
+        // moves it by displacement.
+        offset = displacement;
+        auto radians = degrees_to_radians(angle);
+        sin_theta = sin(radians);
+        cos_theta = cos(radians);
+
+        auto box = object->bounding_box();
+        point3 min(infinity, infinity, infinity);
+        point3 max(-infinity, -infinity, -infinity);
+        for (int i = 0; i < 2; i++)
+            for (int j = 0; j < 2; j++)
+                for (int k = 0; k < 2; k++)
+                {
+                    auto x = i * box.x.max + (1 - i) * box.x.min;
+                    auto y = j * box.y.max + (1 - j) * box.y.min;
+                    auto z = k * box.z.max + (1 - k) * box.z.min;
+                    auto corner = to_world(point3(x, y, z));
+                    for (int c = 0; c < 3; c++)
+                    {
+                        min[c] = fmin(min[c], corner[c]);
+                        max[c] = fmax(max[c], corner[c]);
+                    }
+                }
+        bbox = aabb(min, max);
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        // Change the ray from world space to object space
+        auto origin = pivot + rotate(r.origin() - offset - pivot, -sin_theta);
+        ray object_r(origin, rotate(r.direction(), -sin_theta), r.time());
+
+        // Determine whether an intersection exists in object space (and if so, where)
+        if (!object->hit(object_r, ray_t, rec))
+            return false;
+
+        // Change the intersection point and normal from object space to world space
+        rec.p = to_world(rec.p);
+        rec.normal = rotate(rec.normal, sin_theta);
+
+        return true;
+    }
+
+    aabb bounding_box() const override
+    {
+        return bbox;
+    }
+
+  private:
+    shared_ptr<hittable> object;
+    point3 pivot; // Center of the object's bounding box, at y = 0
+    vec3 offset;
+    double sin_theta;
+    double cos_theta;
+    aabb bbox;
+
+    vec3 rotate(const vec3 &v, double sine) const
+    {
+        // Rotation around the y axis by the current angle, or by its inverse for -sin_theta.
+        return vec3(cos_theta * v[0] + sine * v[2], v[1], -sine * v[0] + cos_theta * v[2]);
+    }
+
+    point3 to_world(const point3 &p) const
+    {
+        return pivot + rotate(p - pivot, sin_theta) + offset;
+    }
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,146 @@
+#ifndef IMAGE_REGISTRY_H
+#define IMAGE_REGISTRY_H
+
+#include "rtweekend.h"
+
+#include "rtw_stb_image.h"
+#include "trace.h"
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class image_registry
+{
+  public:
+    using image_future = std::shared_future<shared_ptr<const rtw_image>>;
+
+    struct statistics
+    {
+        int requests;       // Calls to acquire()
+        int path_hits;      // Requests for a path that was already requested
+        int content_hits;   // New paths whose bytes matched an image already decoded
+        int decodes;        // Images actually decoded
+        double decode_secs; // Total time spent reading, hashing and decoding
+    };
+
+    static image_registry &global()
+    {
+        // The registry shared by every image_texture in the process.
+        static image_registry registry;
+        return registry;
+    }
+
+    image_future acquire(const char *image_filename)
+    {
+        // Returns a future for the image named image_filename. Each file is located and decoded
+        // once, on a background thread, so callers can keep building the scene meanwhile. Files
+        // with identical contents share one decoded image. A missing file yields an empty image.
+        std::lock_guard<std::mutex> lock(mutex);
+        counters.requests++;
+
+        auto path = resolve_image_path(image_filename);
+        if (path.empty())
+        {
+            std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
+            return missing();
+        }
+
+        std::error_code ec;
+        auto key = std::filesystem::weakly_canonical(path, ec).string();
+        if (ec)
+            key = path;
+
+        auto it = by_path.find(key);
+        if (it != by_path.end())
+        {
+            counters.path_hits++;
+            return it->second;
+        }
+
+        image_future result = std::async(std::launch::async, [this, path] { return decode(path); }).share();
+        by_path.emplace(key, result);
+        return result;
+    }
+
+    statistics stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return counters;
+    }
+
+  private:
+    mutable std::mutex mutex;
+    std::map<std::string, image_future> by_path;
+    std::map<uint64_t, image_future> by_content;
+    statistics counters = {0, 0, 0, 0, 0.0};
+
+    image_future missing()
+    {
+        static const image_future empty = [] {
+            std::promise<shared_ptr<const rtw_image>> p;
+            p.set_value(make_shared<const rtw_image>());
+            return p.get_future().share();
+        }();
+        return empty;
+    }
+
+    static uint64_t content_hash(const std::vector<unsigned char> &bytes)
+    {
+        // 64-bit FNV-1a over the encoded file.
+        uint64_t h = 14695981039346656037ull;
+        for (auto b : bytes)
+        {
+            h ^= b;
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    shared_ptr<const rtw_image> decode(const std::string &path)
+    {
+        RTW_TRACE_ZONE("decode image");
+        auto start = std::chrono::steady_clock::now();
+
+        std::ifstream file(path, std::ios::binary);
+        std::vector<unsigned char> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        auto hash = content_hash(bytes);
+
+        // If another path already holds the same bytes, wait for (or reuse) that decode instead.
+        std::promise<shared_ptr<const rtw_image>> promise;
+        image_future existing;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = by_content.find(hash);
+            if (it != by_content.end())
+            {
+                counters.content_hits++;
+                existing = it->second;
+            }
+            else
+                by_content.emplace(hash, promise.get_future().share());
+        }
+        if (existing.valid())
+            return existing.get();
+
+        auto image = make_shared<rtw_image>();
+        if (!image->load_from_memory(bytes.data(), bytes.size()))
+            std::cerr << "ERROR: Could not decode image file '" << path << "'.\n";
+        promise.set_value(image);
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::lock_guard<std::mutex> lock(mutex);
+        counters.decodes++;
+        counters.decode_secs += elapsed.count();
+        return image;
+    }
+};
+
+#endif
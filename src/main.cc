@@ -1,11 +1,21 @@
+#include <algorithm>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <string>
 #include <vector>
 
+#include "animation.h"
+#include "batch.h"
+#include "checkpoint.h"
+#include "daemon.h"
 #include "example.h"
 #include "external/log.h"
 #include "external/params.h"
+#include "net.h"
+#include "scene_cache.h"
+#include "throughput.h"
 
 // g++ main.cc -o main
 
@@ -15,63 +25,79 @@ const char *filenames[10] = {
     "img/final_scene.ppm",    "img/another_last_scene.ppm",
 };
 
-bool choice(int choice, RenderParameters params)
+struct render_session
 {
-    switch (choice)
-    {
-    case 1:
-        LOG(INFO) << "CHOSEN: RANDOM_SPHERES()";
-        random_spheres(params, -15, 15);
-        return true;
-    case 2:
-        LOG(INFO) << "CHOSEN: TWO_SPHERES()";
-        two_spheres(params);
-        return true;
-    case 3:
-        LOG(INFO) << "CHOSEN: EARTH()"; // FAIL
-        earth(params);
-        return true;
-    case 4:
-        LOG(INFO) << "CHOSEN: TWO_PERLIN_SPHERES()";
-        two_perlin_spheres(params);
-        return true;
-    case 5:
-        LOG(INFO) << "CHOSEN: QUADS()";
-        quads(params);
-        return true;
-    case 6:
-        LOG(INFO) << "CHOSEN: SIMPLE_LIGHT()";
-        simple_light(params);
-        return true;
-    case 7:
-        LOG(INFO) << "CHOSEN: CORNELL_BOX()"; // FAIL
-        cornell_box(params);
-        return true;
-    case 8:
-        LOG(INFO) << "CHOSEN: CORNELL_SMOKE()"; // FAIL
-        cornell_smoke(params);
-        return true;
-    case 9:
-        LOG(INFO) << "CHOSEN: FINAL_SCENE()"; // FAIL
-        final_scene(params);
-        return true;
-    case 10:
-        LOG(INFO) << "CHOSEN: ANOTHER_LAST_SCENE()";
-        another_last_scene(params);
-        return true;
-    default:
-        LOG(ERROR) << "INVALID CHOICE";
+    // What one render needs besides its parameters, and which no parameters file holds: where
+    // the image goes, and what a checkpointed render saves and resumes from.
+    render_job job;
+    shared_ptr<const accumulation> resume_from;
+    std::ostream *image_out = &std::cout;
+};
+
+bool choice(int choice, RenderParameters params, const render_session &session)
+{
+    scene s;
+    if (!load_scene(choice, params, s))
         return false;
-    }
+    s.cam.job = session.job;
+    s.cam.resume_from = session.resume_from;
+    s.cam.image_out = session.image_out;
+    LOG(INFO) << "START RENDERING";
+    s.cam.render(s.world, s.lights);
+    LOG(INFO) << "END RENDERING\n";
+    return true;
+}
+
+std::string image_name(int i, const RenderParameters &params)
+{
+    // img/name.ppm for scene i, or for scene file path/name.json.
+    if (params.scene_file.empty())
+        return filenames[i - 1];
+    auto file = params.scene_file.substr(params.scene_file.find_last_of("/\\") + 1);
+    return "img/" + file.substr(0, file.rfind('.')) + ".ppm";
 }
 
-bool saveImg(int i, RenderParameters params)
+bool saveImg(int i, RenderParameters params, render_session session, const coordinator_options *distributed = nullptr)
 {
-    std::cout << "WORKING ON: " << filenames[i - 1] << std::endl;
+    // img/name.ppm, with AOVs as img/name.<aov>.pfm. Part k of a split render traces its share
+    // of the samples and is written as img/name.part<k>.ppm, plus img/name.part<k>.acc to merge.
+    // Checkpoints of either go to img/name[.part<k>].ckpt until the image is written.
+    auto name = image_name(i, params);
+    auto base = name.substr(0, name.size() - 4);
+    if (params.parts > 0)
+    {
+        base += ".part" + std::to_string(params.part);
+        auto total = params.samples_per_pixel;
+        params.first_sample = total * params.part / params.parts;
+        params.samples_per_pixel = total * (params.part + 1) / params.parts - params.first_sample;
+        params.accumulation_path = base + ".acc";
+    }
+    if (params.write_aovs)
+        params.aov_prefix = base;
+    if (params.write_heatmaps)
+        params.heatmap_prefix = base;
+    if (session.job.interval > 0 && params.scene_file.empty())
+    {
+        params.checkpoint_path = base + ".ckpt";
+        session.job.scene = i;
+        session.job.part = params.part;
+        session.job.parts = params.parts;
+    }
+
+    std::cout << "WORKING ON: " << base << ".ppm" << std::endl;
     std::ofstream file;
-    file.open(filenames[i - 1], std::fstream::in | std::fstream::out | std::fstream::trunc);
-    std::cout.rdbuf(file.rdbuf());
-    if (!choice(i, params))
+    file.open(base + ".ppm", std::fstream::in | std::fstream::out | std::fstream::trunc);
+    session.image_out = &file;
+    bool rendered;
+    if (distributed)
+    {
+        auto options = *distributed;
+        options.image_out = &file;
+        rendered = run_coordinator(i, session.job.config_text, options);
+    }
+    else
+        rendered = choice(i, params, session);
+    if (!rendered)
     {
         LOG(ERROR) << "Invalid choiche " << i;
         return false;
@@ -82,30 +108,273 @@ bool saveImg(int i, RenderParameters params)
 
 int main(int argc, char *argv[])
 {
+    // Usage:
+    //   main                                  render every scene, concurrently (see batch.h)
+    //   main --batch <file>                   render the jobs of a batch file concurrently
+    //   main <scene> [--part <k>/<n>] [--seed <seed>] [--checkpoint <seconds>] [--cache <file>]
+    //                [--heatmaps]
+    //                                         render one scene, or only the k-th of n equal
+    //                                         sample ranges of it (see merge.cc), saving
+    //                                         progress every so many seconds; a scene file
+    //                                         loads through a binary cache (see scene_cache.h);
+    //                                         --heatmaps also writes img/name.time.pfm and, in
+    //                                         RTW_STATS builds, img/name.nodes.pfm
+    //   main --resume <checkpoint> [--checkpoint <seconds>]
+    //                                         continue the render a checkpoint was saved from
+    //   main <scene> --animate <file>         render the frames of an animation file (see
+    //                                         animation.h) as img/name.frame<NNNN>.ppm
+    //   main <scene> --coordinator <port> [--tile <pixels>] [--ranges <count>]
+    //                                         render one scene on workers that connect to port
+    //   main --worker <host>:<port>           trace tiles for a coordinator
+    //   main --daemon <socket>                serve render requests on a local socket, keeping
+    //                                         scenes built between them (see daemon.h)
+    //   main --submit <socket> <request>...   send a request to a daemon and print its replies
+    //   main --bench [--threads <n,n,...>] [--spp <n>] [--width <pixels>] [--runs <n>]
+    //                [--json <file>] [<scene>...]
+    //                                         time the scenes without writing images, on each
+    //                                         thread count (see throughput.h)
+    // <scene> is a number from 1 to 10 or a scene file like scenes/cornell_box.json (see
+    // scene_file.h); checkpoints and workers only take numbered scenes. Builds with RTW_STATS
+    // print what the renders did on exit (see stats.h); builds with RTW_TRACE write a timeline
+    // of it to trace.json (see trace.h).
     LOG(INFO) << "START WORKING WITH RAYTRACING";
+    render_stats_report stats_report;
+    render_trace_report trace_report("trace.json");
+    RTW_TRACE_ZONE("main");
+
+    if (argc >= 3 && std::string(argv[1]) == "--worker")
+    {
+        std::string address = argv[2];
+        auto colon = address.rfind(':');
+        if (colon == std::string::npos)
+        {
+            std::cerr << "Expected --worker <host>:<port>" << std::endl;
+            return 1;
+        }
+        return run_worker(address.substr(0, colon), std::stoi(address.substr(colon + 1))) ? 0 : 1;
+    }
+
+    if (argc >= 4 && std::string(argv[1]) == "--submit")
+    {
+        std::string request = argv[3];
+        for (int a = 4; a < argc; a++)
+            request += std::string(" ") + argv[a];
+        return submit_to_daemon(argv[2], request) ? 0 : 1;
+    }
+
+    if (argc >= 2 && std::string(argv[1]) == "--bench")
+    {
+        throughput_options options;
+        auto number = [](const std::string &arg, int &value) {
+            char *end = nullptr;
+            auto parsed = std::strtol(arg.c_str(), &end, 10);
+            if (end == arg.c_str() || *end != '\0')
+                return false;
+            value = static_cast<int>(parsed);
+            return true;
+        };
+        // An unknown option, an option without its value or anything but a whole number where
+        // one is expected prints the usage instead.
+        bool valid = true;
+        for (int a = 2; a < argc && valid; a++)
+        {
+            std::string option = argv[a];
+            bool valued = a + 1 < argc;
+            if (option == "--threads" && valued)
+                for (const auto &text : splitComma(argv[++a]))
+                {
+                    int count = 0;
+                    valid = valid && number(text, count);
+                    options.threads.push_back(std::max(1, count));
+                }
+            else if (option == "--spp" && valued)
+                valid = number(argv[++a], options.samples_per_pixel);
+            else if (option == "--width" && valued)
+                valid = number(argv[++a], options.image_width);
+            else if (option == "--runs" && valued)
+                valid = number(argv[++a], options.runs);
+            else if (option == "--json" && valued)
+                options.json_path = argv[++a];
+            else
+            {
+                int scene = 0;
+                valid = number(option, scene);
+                options.scenes.push_back(scene);
+            }
+        }
+        if (!valid)
+        {
+            std::cerr << "Expected --bench [--threads <n,n,...>] [--spp <n>] [--width <pixels>] [--runs <n>] "
+                         "[--json <file>] [<scene>...]"
+                      << std::endl;
+            return 1;
+        }
+        options.samples_per_pixel = std::max(1, options.samples_per_pixel);
+        options.image_width = std::max(1, options.image_width);
+        options.runs = std::max(1, options.runs);
+        return run_throughput_benchmark(options) ? 0 : 1;
+    }
+
     // set parameters before run
     RenderParameters params;
     // TODO: use relative path not absolute
-    params.setFromConfigFile("..\\parameters.txt");
+    const std::string config_file = "..\\parameters.txt";
+    params.setFromConfigFile(config_file);
+
+    // Workers and checkpoints get the parameters as text, so every process parses exactly the
+    // same file.
+    render_session session;
+    std::ifstream file(config_file);
+    session.job.config_text.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+    // A scene file renders as scene 1 would, but builds from the file.
+    auto scene_choice = [&params](const std::string &arg) {
+        if (arg.size() > 5 && arg.compare(arg.size() - 5, 5, ".json") == 0)
+        {
+            params.scene_file = arg;
+            return 1;
+        }
+        // Anything but a whole number is no scene, which the callers report as an invalid choice.
+        char *end = nullptr;
+        auto number = std::strtol(arg.c_str(), &end, 10);
+        return end != arg.c_str() && *end == '\0' ? static_cast<int>(number) : 0;
+    };
+
+    if (argc >= 3 && std::string(argv[1]) == "--daemon")
+    {
+        render_daemon daemon(argv[2], session.job.config_text);
+        return daemon.run() ? 0 : 1;
+    }
+
+    if (argc >= 3 && std::string(argv[1]) == "--batch")
+    {
+        std::vector<batch_job> jobs;
+        if (!read_batch(argv[2], jobs))
+            return 1;
+        return run_batch(jobs) ? 0 : 1;
+    }
+
+    if (argc >= 3 && std::string(argv[1]) == "--resume")
+    {
+        // Everything comes from the checkpoint, not from the current parameters file.
+        render_job job;
+        auto samples = make_shared<accumulation>();
+        if (!read_checkpoint(argv[2], job, *samples))
+            return 1;
+        params = RenderParameters();
+        if (!params.setFromConfigText(job.config_text))
+            return 1;
+        params.seed = samples->header.seed;
+        params.part = job.part;
+        params.parts = job.parts;
+        session.job = job;
+        session.resume_from = samples;
+        if (argc >= 5 && std::string(argv[3]) == "--checkpoint")
+            session.job.interval = std::max(0, std::stoi(argv[4]));
+
+        LOG(INFO) << "RESUMING " << argv[2];
+        return saveImg(job.scene, params, session) ? 0 : 1;
+    }
+
+    if (argc >= 4 && std::string(argv[2]) == "--coordinator")
+    {
+        coordinator_options options;
+        options.port = std::stoi(argv[3]);
+        for (int a = 4; a + 1 < argc; a += 2)
+        {
+            if (std::string(argv[a]) == "--tile")
+                options.tile_size = std::max(1, std::stoi(argv[a + 1]));
+            else if (std::string(argv[a]) == "--ranges")
+                options.sample_ranges = std::max(1, std::stoi(argv[a + 1]));
+        }
+
+        // Workers rebuild the scene from its number and the parameters text they are sent.
+        int i = scene_choice(argv[1]);
+        if (!params.scene_file.empty() || i < 1 || i > 10)
+        {
+            std::cerr << "ERROR: A coordinator only renders numbered scenes, from 1 to 10.\n";
+            return 1;
+        }
+        return saveImg(i, params, session, &options) ? 0 : 1;
+    }
+
+    if (argc >= 4 && std::string(argv[2]) == "--animate")
+    {
+        animation anim;
+        int i = scene_choice(argv[1]);
+        if (i < 1 || i > 10 || !anim.read(argv[3]))
+            return 1;
+        auto name = image_name(i, params);
+        return render_animation(i, params, anim, name.substr(0, name.size() - 4)) ? 0 : 1;
+    }
+
+    for (int a = 2; a < argc; a++)
+    {
+        std::string option = argv[a];
+        if (option == "--heatmaps")
+        {
+            params.write_heatmaps = true;
+            continue;
+        }
+        if (a + 1 == argc)
+            break;
+        std::string value = argv[++a];
+        if (option == "--part" && value.find('/') != std::string::npos)
+        {
+            params.part = std::stoi(value.substr(0, value.find('/')));
+            params.parts = std::stoi(value.substr(value.find('/') + 1));
+            if (params.parts < 1 || params.part < 0 || params.part >= params.parts)
+            {
+                std::cerr << "Expected --part <k>/<n> with 0 <= k < n" << std::endl;
+                return 1;
+            }
+        }
+        else if (option == "--seed")
+            params.seed = static_cast<unsigned>(std::stoul(value));
+        else if (option == "--checkpoint")
+            session.job.interval = std::max(0, std::stoi(value));
+        else if (option == "--cache")
+            params.scene_cache = value;
+    }
+
     if (argc < 2)
     {
+        std::vector<batch_job> jobs(10);
         for (int i = 1; i <= 10; i++)
-            saveImg(i, params);
+        {
+            jobs[i - 1].scene = i;
+            jobs[i - 1].params = params;
+            jobs[i - 1].output = image_name(i, params);
+        }
+        run_batch(jobs);
     }
     else
     {
-        int i = std::stoi(argv[1]);
-        if (saveImg(i, params))
-            return 0;
-        std::cerr << "Invalid choice! Available options: ";
-        for (int j = 1; j <= 10; j++)
+        int i = scene_choice(argv[1]);
+        bool known = !params.scene_file.empty() || (i >= 1 && i <= 10);
+        if (!known || !saveImg(i, params, session))
         {
-            std::cerr << j;
-            if (j < 10)
-                std::cerr << ", ";
+            if (!params.scene_file.empty())
+                return 1;
+            std::cerr << "Invalid choice! Available options: ";
+            for (int j = 1; j <= 10; j++)
+            {
+                std::cerr << j;
+                if (j < 10)
+                    std::cerr << ", ";
+            }
+            std::cerr << std::endl;
         }
-        std::cerr << std::endl;
     }
 
+    auto images = image_registry::global().stats();
+    LOG(INFO) << "IMAGES: " << images.requests << " requests, " << images.decodes << " decoded in "
+              << images.decode_secs << "s, " << images.path_hits << " path hits, " << images.content_hits
+              << " content hits";
+    auto tiles = tile_cache::global().stats();
+    if (tiles.hits + tiles.misses > 0)
+        LOG(INFO) << "TILES: " << tiles.hits << " hits, " << tiles.misses << " misses, " << tiles.evictions
+                  << " evictions, " << tiles.tiles_resident << " resident in " << tiles.bytes_resident << " bytes";
+
     return 0;
 }
\ No newline at end of file
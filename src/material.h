@@ -6,118 +6,122 @@
 #include "pdf.h"
 #include "texture.h"
 
+#include <atomic>
+
 class scatter_record
 {
   public:
     color attenuation;
-    shared_ptr<pdf> pdf_ptr;
+    scatter_pdf lobe; // Direction distribution, used when skip_pdf is false
     bool skip_pdf;
     ray skip_pdf_ray;
 };
 
 class material
 {
+    // Every material is one tagged record: the kind selects which fields are used and which
+    // branch of scatter/emitted/scattering_pdf runs. There are no virtual functions, so the
+    // integrator can inline the shading code, and rays can be grouped by kind.
   public:
-    virtual ~material() = default;
-
-    virtual color emitted(const ray &r_in, const hit_record &rec, double u, double v, const point3 &p) const
+    enum material_kind
     {
-        return color(0, 0, 0);
-    }
+        none,
+        lambertian_kind,
+        metal_kind,
+        dielectric_kind,
+        diffuse_light_kind,
+        isotropic_kind
+    };
 
-    virtual bool scatter(const ray &r_in, const hit_record &rec, scatter_record &srec) const
-    {
-        return false;
-    }
+    material_kind kind = none;
+    texture_program albedo; // Reflectance, or emitted radiance for diffuse_light
+    double fuzz = 0;        // metal: radius of the reflection perturbation
+    double ir = 1;          // dielectric: index of refraction
+    int id = next_id();     // Unique per material, in construction order
 
-    virtual double scattering_pdf(const ray &r_in, const hit_record &rec, const ray &scattered) const
+    color emitted(const ray &r_in, const hit_record &rec, double u, double v, const point3 &p) const
     {
-        return 0;
+        if (kind != diffuse_light_kind || !rec.front_face)
+            return color(0, 0, 0);
+        return albedo.value(u, v, p, rec.footprint);
     }
-};
 
-class lambertian : public material
-{
-  public:
-    lambertian(const color &a) : albedo(make_shared<solid_color>(a))
-    {
-    }
-    lambertian(shared_ptr<texture> a) : albedo(a)
+    bool scatter(const ray &r_in, const hit_record &rec, scatter_record &srec) const
     {
-    }
+        switch (kind)
+        {
+        case lambertian_kind:
+            srec.attenuation = albedo.value(rec.u, rec.v, rec.p, rec.footprint);
+            srec.lobe.set_cosine(rec.normal);
+            srec.skip_pdf = false;
+            return true;
 
-    bool scatter(const ray &r_in, const hit_record &rec, scatter_record &srec) const override
-    {
-        srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
-        srec.pdf_ptr = make_shared<cosine_pdf>(rec.normal);
-        srec.skip_pdf = false;
-        return true;
-    }
+        case metal_kind: {
+            srec.attenuation = albedo.value(rec.u, rec.v, rec.p, rec.footprint);
+            srec.skip_pdf = true;
+            vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
+            srec.skip_pdf_ray = ray(rec.p, reflected + fuzz * random_in_unit_sphere(), r_in.time());
+            return true;
+        }
 
-    double scattering_pdf(const ray &r_in, const hit_record &rec, const ray &scattered) const override
-    {
-        auto cos_theta = dot(rec.normal, unit_vector(scattered.direction()));
-        return cos_theta < 0 ? 0 : cos_theta / pi;
-    }
+        case dielectric_kind: {
+            srec.attenuation = color(1.0, 1.0, 1.0);
+            srec.skip_pdf = true;
+            double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
 
-  private:
-    shared_ptr<texture> albedo;
-};
+            vec3 unit_direction = unit_vector(r_in.direction());
+            double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
+            double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
 
-class metal : public material
-{
-  public:
-    metal(const color &a, double f) : albedo(a), fuzz(f < 1 ? f : 1)
-    {
-    }
+            bool cannot_refract = refraction_ratio * sin_theta > 1.0;
+            vec3 direction;
 
-    bool scatter(const ray &r_in, const hit_record &rec, scatter_record &srec) const override
-    {
-        srec.attenuation = albedo;
-        srec.pdf_ptr = nullptr;
-        srec.skip_pdf = true;
-        vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-        srec.skip_pdf_ray = ray(rec.p, reflected + fuzz * random_in_unit_sphere(), r_in.time());
-        return true;
-    }
+            if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
+                direction = reflect(unit_direction, rec.normal);
+            else
+                direction = refract(unit_direction, rec.normal, refraction_ratio);
 
-  private:
-    color albedo;
-    double fuzz;
-};
+            srec.skip_pdf_ray = ray(rec.p, direction, r_in.time());
+            return true;
+        }
 
-class dielectric : public material
-{
-  public:
-    dielectric(double index_of_refraction) : ir(index_of_refraction)
-    {
+        case isotropic_kind:
+            srec.attenuation = albedo.value(rec.u, rec.v, rec.p, rec.footprint);
+            srec.lobe.set_uniform_sphere();
+            srec.skip_pdf = false;
+            return true;
+
+        default:
+            return false;
+        }
     }
 
-    bool scatter(const ray &r_in, const hit_record &rec, scatter_record &srec) const override
+    double scattering_pdf(const ray &r_in, const hit_record &rec, const ray &scattered) const
     {
-        srec.attenuation = color(1.0, 1.0, 1.0);
-        srec.pdf_ptr = nullptr;
-        srec.skip_pdf = true;
-        double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
-
-        vec3 unit_direction = unit_vector(r_in.direction());
-        double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
-        double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
-
-        bool cannot_refract = refraction_ratio * sin_theta > 1.0;
-        vec3 direction;
-
-        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
-            direction = reflect(unit_direction, rec.normal);
-        else
-            direction = refract(unit_direction, rec.normal, refraction_ratio);
+        switch (kind)
+        {
+        case lambertian_kind: {
+            auto cos_theta = dot(rec.normal, unit_vector(scattered.direction()));
+            return cos_theta < 0 ? 0 : cos_theta / pi;
+        }
+        case isotropic_kind:
+            return 1 / (4 * pi);
+        default:
+            return 0;
+        }
+    }
 
-        srec.skip_pdf_ray = ray(rec.p, direction, r_in.time());
-        return true;
+  protected:
+    material(material_kind k, texture_program a) : kind(k), albedo(a)
+    {
     }
 
   private:
-    double ir; // Index of Refraction
+    static int next_id()
+    {
+        static std::atomic<int> counter(0);
+        return counter++;
+    }
 
     static double reflectance(double cosine, double ref_idx)
     {
@@ -128,52 +132,57 @@ class dielectric : public material
     }
 };
 
-class diffuse_light : public material
+// The named materials below only fill in a material record; they add no state or behavior.
+
+class lambertian : public material
 {
   public:
-    diffuse_light(shared_ptr<texture> a) : emit(a)
+    lambertian(const color &a) : material(lambertian_kind, a)
     {
     }
-    diffuse_light(color c) : emit(make_shared<solid_color>(c))
+    lambertian(shared_ptr<texture> a) : material(lambertian_kind, a)
     {
     }
+};
 
-    color emitted(const ray &r_in, const hit_record &rec, double u, double v, const point3 &p) const override
+class metal : public material
+{
+  public:
+    metal(const color &a, double f) : material(metal_kind, a)
     {
-        if (!rec.front_face)
-            return color(0, 0, 0);
-        return emit->value(u, v, p);
+        fuzz = f < 1 ? f : 1;
     }
+};
 
-  private:
-    shared_ptr<texture> emit;
+class dielectric : public material
+{
+  public:
+    dielectric(double index_of_refraction) : material(dielectric_kind, color(1, 1, 1))
+    {
+        ir = index_of_refraction;
+    }
 };
 
-class isotropic : public material
+class diffuse_light : public material
 {
   public:
-    isotropic(color c) : albedo(make_shared<solid_color>(c))
+    diffuse_light(shared_ptr<texture> a) : material(diffuse_light_kind, a)
     {
     }
-    isotropic(shared_ptr<texture> a) : albedo(a)
+    diffuse_light(color c) : material(diffuse_light_kind, c)
     {
     }
+};
 
-    bool scatter(const ray &r_in, const hit_record &rec, scatter_record &srec) const override
+class isotropic : public material
+{
+  public:
+    isotropic(color c) : material(isotropic_kind, c)
     {
-        srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
-        srec.pdf_ptr = make_shared<sphere_pdf>();
-        srec.skip_pdf = false;
-        return true;
     }
-
-    double scattering_pdf(const ray &r_in, const hit_record &rec, const ray &scattered) const override
+    isotropic(shared_ptr<texture> a) : material(isotropic_kind, a)
     {
-        return 1 / (4 * pi);
     }
-
-  private:
-    shared_ptr<texture> albedo;
 };
 
-#endif
\ No newline at end of file
+#endif
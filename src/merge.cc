@@ -0,0 +1,110 @@
+#include "rtweekend.h"
+
+#include "accumulation.h"
+#include "aov.h"
+#include "color.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Merges partial renders of one frame (main <scene> --part k/n writes img/name.part<k>.acc) into
+// the final image, by adding their sums and sample counts.
+// Usage: merge output.{ppm,pfm,acc} input.acc...
+//   .ppm   gamma-corrected 8-bit image, as main writes it
+//   .pfm   linear float image of the per-pixel means
+//   .acc   the merged sums and counts, to merge with more parts later
+
+static bool ends_with(const std::string &s, const std::string &suffix)
+{
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " output.{ppm,pfm,acc} input.acc...\n";
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<accumulation> parts(argc - 2);
+    std::vector<const char *> names(argc - 2);
+    for (int a = 2; a < argc; a++)
+    {
+        names[a - 2] = argv[a];
+        if (!parts[a - 2].read(argv[a]))
+            return 1;
+    }
+
+    // Parts drawn from the same sequence must cover disjoint sample ranges, or the same samples
+    // are counted twice.
+    for (size_t i = 0; i < parts.size(); i++)
+        for (size_t j = i + 1; j < parts.size(); j++)
+        {
+            const auto &a = parts[i].header, &b = parts[j].header;
+            if (a.sampler == b.sampler && a.seed == b.seed && a.sample_begin < b.sample_end &&
+                b.sample_begin < a.sample_end)
+                std::cerr << "WARNING: '" << names[i] << "' and '" << names[j]
+                          << "' have overlapping sample ranges of the same seed.\n";
+        }
+
+    // Merging in order of the sample ranges makes each part touch the samples merged before it.
+    std::vector<size_t> order(parts.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&parts](size_t a, size_t b) {
+        return parts[a].header.sample_begin < parts[b].header.sample_begin;
+    });
+    auto &total = parts[order[0]];
+    for (size_t i = 1; i < order.size(); i++)
+    {
+        if (!total.add(parts[order[i]]))
+        {
+            std::cerr << "Could not merge '" << names[order[i]] << "'\n";
+            return 1;
+        }
+    }
+
+    std::string output = argv[1];
+    bool ok;
+    if (ends_with(output, ".acc"))
+        ok = total.write(output);
+    else if (ends_with(output, ".pfm"))
+    {
+        std::vector<float> rgb(3 * total.pixel_count());
+        for (size_t i = 0; i < total.pixel_count(); i++)
+        {
+            auto c = total.mean(i);
+            for (int k = 0; k < 3; k++)
+                rgb[3 * i + k] = static_cast<float>(c[k]);
+        }
+        ok = write_pfm(output, total.header.width, total.header.height, 3, rgb);
+    }
+    else
+    {
+        std::ofstream file(output);
+        total.write_ppm(file);
+        ok = static_cast<bool>(file);
+    }
+    if (!ok)
+    {
+        std::cerr << "Could not write '" << output << "'\n";
+        return 1;
+    }
+
+    uint32_t fewest = 0, most = 0;
+    if (!total.counts.empty())
+    {
+        fewest = *std::min_element(total.counts.begin(), total.counts.end());
+        most = *std::max_element(total.counts.begin(), total.counts.end());
+    }
+    auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << output << ": " << argc - 2 << " parts, " << total.header.width << 'x' << total.header.height << ", "
+              << fewest << '-' << most << " samples per pixel, merged in " << secs << "s\n";
+    return 0;
+}
@@ -0,0 +1,675 @@
+#ifndef NET_H
+#define NET_H
+
+// Distributed rendering over TCP. A coordinator splits the image into tiles (and optionally each
+// tile's samples into ranges) and hands them out to worker processes as they ask for work.
+// Workers build the same scene from the same parameters, trace their tiles with
+// camera::render_tile() and send the per-pixel sums back. Sample streams are a pure function of
+// pixel and sample index, so the assembled image doesn't depend on which worker traced what.
+//
+// Messages are the fixed-size little-endian structs below, some followed by a payload:
+//
+//   coordinator -> worker   net_job      once per connection, then the parameters.txt text
+//   coordinator -> worker   net_tile     the next tile to trace; id -1 means the frame is done
+//   worker -> coordinator   net_result   then 3 doubles (RGB sums) per tile pixel, row by row
+//
+// A worker that disconnects gives its tile back to the queue. Once the queue is empty, idle
+// workers are handed copies of tiles still in flight and the first copy back wins, so neither a
+// dead nor a slow worker holds up the end of the frame.
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "example.h"
+#include "external/log.h"
+#include "external/params.h"
+#include "external/progressbar.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <afunix.h> // After winsock2.h; Windows 10 1803 or later
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+struct net_job
+{
+    char magic[4];      // "RTJB"
+    int32_t scene;      // Example scene number, as on the command line
+    uint32_t text_size; // Length of the parameters.txt text that follows
+};
+
+struct net_tile
+{
+    int32_t id; // Tile index, or -1 when there is no more work
+    int32_t x0, y0, x1, y1;
+    int32_t sample_begin, sample_end;
+};
+
+struct net_result
+{
+    int32_t id;          // Tile index from net_tile
+    int32_t pixel_count; // Pixels in the payload
+    double trace_secs;   // Time the worker spent in render_tile()
+};
+
+class net_socket
+{
+    // A TCP or local (Unix domain) socket, closed on destruction.
+  public:
+#ifdef _WIN32
+    using handle = SOCKET;
+    static constexpr handle invalid = INVALID_SOCKET;
+#else
+    using handle = int;
+    static constexpr handle invalid = -1;
+#endif
+
+    net_socket()
+    {
+    }
+
+    explicit net_socket(handle _fd) : fd(_fd)
+    {
+    }
+
+    net_socket(net_socket &&other) : fd(other.fd)
+    {
+        other.fd = invalid;
+    }
+
+    net_socket &operator=(net_socket &&other)
+    {
+        if (this != &other)
+        {
+            close();
+            fd = other.fd;
+            other.fd = invalid;
+        }
+        return *this;
+    }
+
+    ~net_socket()
+    {
+        close();
+    }
+
+    net_socket(const net_socket &) = delete;
+    net_socket &operator=(const net_socket &) = delete;
+
+    bool valid() const
+    {
+        return fd != invalid;
+    }
+
+    static net_socket connect_to(const std::string &host, int port)
+    {
+        startup();
+        addrinfo hints = {}, *found = nullptr;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &found) != 0)
+            return net_socket();
+
+        net_socket result;
+        for (auto a = found; a && !result.valid(); a = a->ai_next)
+        {
+            net_socket s(::socket(a->ai_family, a->ai_socktype, a->ai_protocol));
+            if (s.valid() && ::connect(s.fd, a->ai_addr, static_cast<int>(a->ai_addrlen)) == 0)
+                result = std::move(s);
+        }
+        freeaddrinfo(found);
+
+        result.configure();
+        return result;
+    }
+
+    static net_socket listen_on(int port)
+    {
+        // Listens on every IPv4 interface.
+        startup();
+        net_socket s(::socket(AF_INET, SOCK_STREAM, 0));
+        if (!s.valid())
+            return s;
+
+        int yes = 1;
+        setsockopt(s.fd, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char *>(&yes), sizeof(yes));
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(static_cast<uint16_t>(port));
+        if (::bind(s.fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0 || ::listen(s.fd, 64) != 0)
+            return net_socket();
+        return s;
+    }
+
+    static net_socket connect_local(const std::string &path)
+    {
+        sockaddr_un addr;
+        startup();
+        if (!local_address(path, addr))
+            return net_socket();
+        net_socket s(::socket(AF_UNIX, SOCK_STREAM, 0));
+        if (s.valid() && ::connect(s.fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0)
+            return net_socket();
+        return s;
+    }
+
+    static net_socket listen_local(const std::string &path)
+    {
+        // Listens on the socket file path, replacing a stale one left by a previous process.
+        sockaddr_un addr;
+        startup();
+        if (!local_address(path, addr))
+            return net_socket();
+        net_socket s(::socket(AF_UNIX, SOCK_STREAM, 0));
+        if (!s.valid())
+            return s;
+
+        std::remove(path.c_str());
+        if (::bind(s.fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0 || ::listen(s.fd, 64) != 0)
+            return net_socket();
+        return s;
+    }
+
+    net_socket accept_within(double seconds, std::string &peer) const
+    {
+        // Waits up to seconds for a connection on a listening socket; invalid if none came.
+        fd_set ready;
+        FD_ZERO(&ready);
+        FD_SET(fd, &ready);
+        timeval timeout;
+        timeout.tv_sec = static_cast<long>(seconds);
+        timeout.tv_usec = static_cast<long>((seconds - timeout.tv_sec) * 1e6);
+        if (select(static_cast<int>(fd + 1), &ready, nullptr, nullptr, &timeout) <= 0)
+            return net_socket();
+
+        sockaddr_storage addr;
+        socklen_t length = sizeof(addr);
+        net_socket s(::accept(fd, reinterpret_cast<sockaddr *>(&addr), &length));
+        if (!s.valid())
+            return s;
+
+        char host[NI_MAXHOST], service[NI_MAXSERV];
+        if (addr.ss_family == AF_UNIX)
+            return s; // Nothing to name, and nothing to configure
+        if (getnameinfo(reinterpret_cast<const sockaddr *>(&addr), length, host, sizeof(host), service,
+                        sizeof(service), NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+            peer = std::string(host) + ":" + service;
+        s.configure();
+        return s;
+    }
+
+    bool send_all(const void *data, size_t size)
+    {
+        auto p = static_cast<const char *>(data);
+        while (size > 0)
+        {
+            auto n = ::send(fd, p, static_cast<int>(std::min<size_t>(size, 1 << 20)), send_flags);
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    bool recv_all(void *data, size_t size)
+    {
+        // False if the connection failed or was closed before size bytes arrived.
+        auto p = static_cast<char *>(data);
+        while (size > 0)
+        {
+            auto n = ::recv(fd, p, static_cast<int>(std::min<size_t>(size, 1 << 20)), 0);
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    int recv_some(void *data, size_t size)
+    {
+        // Receives whatever has arrived, up to size bytes, waiting until something has. 0 when
+        // the connection was closed, negative if it failed.
+        return static_cast<int>(::recv(fd, static_cast<char *>(data), static_cast<int>(size), 0));
+    }
+
+    void interrupt()
+    {
+        // Makes a send or receive blocked on another thread fail.
+        if (valid())
+        {
+#ifdef _WIN32
+            ::shutdown(fd, SD_BOTH);
+#else
+            ::shutdown(fd, SHUT_RDWR);
+#endif
+        }
+    }
+
+  private:
+    handle fd = invalid;
+
+#ifdef MSG_NOSIGNAL
+    static const int send_flags = MSG_NOSIGNAL; // A closed peer fails the send instead of raising SIGPIPE
+#else
+    static const int send_flags = 0;
+#endif
+
+    static void startup()
+    {
+#ifdef _WIN32
+        static const bool started = [] {
+            WSADATA data;
+            return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+        }();
+        (void)started;
+#endif
+    }
+
+    static bool local_address(const std::string &path, sockaddr_un &addr)
+    {
+        addr = {};
+        addr.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(addr.sun_path))
+        {
+            std::cerr << "ERROR: '" << path << "' can't be a socket path.\n";
+            return false;
+        }
+        std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        return true;
+    }
+
+    void configure()
+    {
+        // Requests and results are sent whole, so don't hold back small writes. Keepalives let
+        // the coordinator notice a worker whose machine went away without closing the connection.
+        if (!valid())
+            return;
+        int yes = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&yes), sizeof(yes));
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, reinterpret_cast<const char *>(&yes), sizeof(yes));
+#ifdef SO_NOSIGPIPE
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, reinterpret_cast<const char *>(&yes), sizeof(yes));
+#endif
+    }
+
+    void close()
+    {
+        if (!valid())
+            return;
+#ifdef _WIN32
+        ::closesocket(fd);
+#else
+        ::close(fd);
+#endif
+        fd = invalid;
+    }
+};
+
+inline std::vector<image_tile> split_into_tiles(int width, int height, int samples, int tile_size, int sample_ranges)
+{
+    // Row-major tiles of tile_size^2 pixels (smaller at the right and bottom edges), each split
+    // into sample_ranges consecutive ranges of the pixel samples.
+    std::vector<image_tile> tiles;
+    sample_ranges = std::max(1, std::min(sample_ranges, samples));
+    for (int y = 0; y < height; y += tile_size)
+        for (int x = 0; x < width; x += tile_size)
+            for (int r = 0; r < sample_ranges; r++)
+            {
+                image_tile tile;
+                tile.x0 = x;
+                tile.y0 = y;
+                tile.x1 = std::min(width, x + tile_size);
+                tile.y1 = std::min(height, y + tile_size);
+                tile.sample_begin = samples * r / sample_ranges;
+                tile.sample_end = samples * (r + 1) / sample_ranges;
+                tiles.push_back(tile);
+            }
+    return tiles;
+}
+
+class tile_scheduler
+{
+    // Hands out tiles to the threads serving workers, and collects the results. Pending tiles go
+    // out first, a tile given back by a lost worker ahead of the rest. When none are pending, a
+    // tile that only one worker holds is handed out again.
+  public:
+    int reassigned = 0; // Tiles given back by a lost worker
+    int duplicated = 0; // Tiles handed to a second worker while in flight
+
+    explicit tile_scheduler(int count) : results(count), holders(count, 0), done(count, 0), remaining(count)
+    {
+        for (int id = 0; id < count; id++)
+            pending.push_back(id);
+    }
+
+    int acquire()
+    {
+        // Returns the id of a tile to trace, or -1 once every tile is done.
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            if (remaining == 0)
+                return -1;
+
+            while (!pending.empty())
+            {
+                auto id = pending.front();
+                pending.pop_front();
+                if (!done[id])
+                {
+                    holders[id]++;
+                    return id;
+                }
+            }
+
+            for (int id = 0; id < static_cast<int>(done.size()); id++)
+                if (!done[id] && holders[id] == 1)
+                {
+                    holders[id]++;
+                    duplicated++;
+                    return id;
+                }
+
+            changed.wait(lock);
+        }
+    }
+
+    bool complete(int id, std::vector<color> &sums)
+    {
+        // Stores a returned tile. False if another worker's copy was stored already.
+        std::lock_guard<std::mutex> lock(mutex);
+        holders[id]--;
+        if (done[id])
+            return false;
+        done[id] = 1;
+        results[id].swap(sums);
+        remaining--;
+        changed.notify_all();
+        return true;
+    }
+
+    void release(int id)
+    {
+        // The worker holding the tile was lost.
+        std::lock_guard<std::mutex> lock(mutex);
+        holders[id]--;
+        if (!done[id] && holders[id] == 0)
+        {
+            pending.push_front(id);
+            reassigned++;
+        }
+        changed.notify_all();
+    }
+
+    bool finished()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return remaining == 0;
+    }
+
+    const std::vector<color> &result(int id) const
+    {
+        return results[id];
+    }
+
+  private:
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<int> pending;
+    std::vector<std::vector<color>> results;
+    std::vector<int> holders;
+    std::vector<char> done;
+    int remaining;
+};
+
+struct coordinator_options
+{
+    int port = 7878;                      // TCP port to listen on
+    int tile_size = 32;                   // Tile edge in pixels
+    int sample_ranges = 1;                // Ranges each tile's samples are split into
+    std::ostream *image_out = &std::cout; // Where the assembled PPM image is written
+};
+
+inline bool run_coordinator(int choice, const std::string &config_text, const coordinator_options &options)
+{
+    // Renders scene choice on the workers that connect, and writes the image to
+    // options.image_out like camera::render(). Returns once every tile is back, whichever workers come and go meanwhile.
+    RenderParameters params;
+    scene s;
+    if (!params.setFromConfigText(config_text) || !build_scene(choice, params, s))
+        return false;
+    if (params.write_aovs || params.denoise)
+        LOG(WARNING) << "DISTRIBUTED RENDERS HAVE NO AOVS AND ARE NOT DENOISED";
+
+    auto &cam = s.cam;
+    auto width = cam.image_width, height = cam.output_height();
+    auto tiles = split_into_tiles(width, height, cam.samples_per_pixel, options.tile_size, options.sample_ranges);
+    tile_scheduler scheduler(static_cast<int>(tiles.size()));
+
+    auto listener = net_socket::listen_on(options.port);
+    if (!listener.valid())
+    {
+        std::cerr << "ERROR: Could not listen on port " << options.port << ".\n";
+        return false;
+    }
+    std::clog << "Coordinator listening on port " << options.port << ", " << tiles.size() << " tiles\n";
+
+    struct connection
+    {
+        net_socket socket;
+        std::thread thread;
+        std::atomic<bool> busy{false}; // Waiting for a tile result
+        std::string peer;
+        int tiles = 0;          // Results received, including copies that lost the race
+        long long samples = 0;  // Pixel samples in those results
+        double trace_secs = 0;  // Worker time spent tracing them
+        double connected_secs = 0;
+        bool lost = false;      // Disconnected while holding a tile
+    };
+    std::vector<std::unique_ptr<connection>> workers;
+
+    std::mutex progress_mutex;
+    progressbar pb(static_cast<int>(tiles.size()));
+    pb.set_done_char("█");
+
+    auto serve = [&](connection &worker) {
+        // Feeds one worker tiles until the frame is done or the worker is lost.
+        auto start = std::chrono::steady_clock::now();
+        net_job job = {{'R', 'T', 'J', 'B'}, choice, static_cast<uint32_t>(config_text.size())};
+        bool connected = worker.socket.send_all(&job, sizeof(job)) &&
+                         worker.socket.send_all(config_text.data(), config_text.size());
+
+        std::vector<double> payload;
+        std::vector<color> sums;
+        while (connected)
+        {
+            auto id = scheduler.acquire();
+            const auto &tile = id >= 0 ? tiles[id] : image_tile();
+            net_tile request = {id, tile.x0, tile.y0, tile.x1, tile.y1, tile.sample_begin, tile.sample_end};
+            worker.busy = id >= 0;
+            if (!worker.socket.send_all(&request, sizeof(request)) || id < 0)
+                break;
+
+            net_result result;
+            payload.resize(3 * static_cast<size_t>(tile.pixel_count()));
+            connected = worker.socket.recv_all(&result, sizeof(result)) && result.id == id &&
+                        result.pixel_count == tile.pixel_count() &&
+                        worker.socket.recv_all(payload.data(), payload.size() * sizeof(double));
+            worker.busy = false;
+            if (!connected)
+            {
+                worker.lost = !scheduler.finished();
+                scheduler.release(id);
+                break;
+            }
+
+            worker.tiles++;
+            worker.samples += static_cast<long long>(tile.pixel_count()) * (tile.sample_end - tile.sample_begin);
+            worker.trace_secs += result.trace_secs;
+
+            sums.resize(tile.pixel_count());
+            for (size_t p = 0; p < sums.size(); p++)
+                sums[p] = color(payload[3 * p], payload[3 * p + 1], payload[3 * p + 2]);
+            if (scheduler.complete(id, sums))
+            {
+                std::lock_guard<std::mutex> lock(progress_mutex);
+                pb.update();
+            }
+        }
+        worker.connected_secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    // Accept workers for as long as there is work, so late or replacement workers can join.
+    auto start = std::chrono::steady_clock::now();
+    while (!scheduler.finished())
+    {
+        std::string peer = "unknown";
+        auto socket = listener.accept_within(0.25, peer);
+        if (!socket.valid())
+            continue;
+        LOG(INFO) << "WORKER CONNECTED: " << peer;
+        workers.push_back(std::make_unique<connection>());
+        auto &worker = *workers.back();
+        worker.socket = std::move(socket);
+        worker.peer = peer;
+        worker.thread = std::thread(serve, std::ref(worker));
+    }
+
+    // Workers still tracing a copy of a finished tile are cut off rather than waited for.
+    for (auto &worker : workers)
+        if (worker->busy)
+            worker->socket.interrupt();
+    for (auto &worker : workers)
+        worker->thread.join();
+    auto wall_secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::clog << "\rDone.                 \n";
+
+    // Assemble in tile order, so sample ranges of a pixel are always summed in the same order.
+    std::vector<color> framebuffer(static_cast<size_t>(width) * height, color(0, 0, 0));
+    for (size_t id = 0; id < tiles.size(); id++)
+    {
+        const auto &tile = tiles[id];
+        const auto &sums = scheduler.result(static_cast<int>(id));
+        for (int j = tile.y0; j < tile.y1; j++)
+            for (int i = tile.x0; i < tile.x1; i++)
+                framebuffer[j * width + i] += sums[(j - tile.y0) * (tile.x1 - tile.x0) + (i - tile.x0)];
+    }
+    cam.image_out = options.image_out;
+    cam.write_sums(framebuffer);
+
+    long long total_samples = static_cast<long long>(width) * height * cam.samples_per_pixel;
+    LOG(INFO) << "DISTRIBUTED: " << tiles.size() << " tiles on " << workers.size() << " workers in " << wall_secs
+              << "s, " << total_samples / wall_secs / 1e6 << " Msamples/s, " << scheduler.reassigned
+              << " reassigned, " << scheduler.duplicated << " duplicated";
+    for (const auto &worker : workers)
+        LOG(INFO) << "  WORKER " << worker->peer << ": " << worker->tiles << " tiles, " << worker->samples
+                  << " samples, " << worker->samples / std::max(worker->trace_secs, 1e-9) / 1e6
+                  << " Msamples/s tracing, " << 100 * worker->trace_secs / std::max(worker->connected_secs, 1e-9)
+                  << "% busy" << (worker->lost ? ", LOST" : "");
+    return true;
+}
+
+inline bool run_worker(const std::string &host, int port)
+{
+    // Connects to a coordinator and traces the tiles it sends until it says the frame is done.
+    // Scenes are built from the global generator, so a worker serves one frame per process.
+    auto socket = net_socket::connect_to(host, port);
+    if (!socket.valid())
+    {
+        std::cerr << "ERROR: Could not connect to " << host << ":" << port << ".\n";
+        return false;
+    }
+
+    net_job job;
+    std::string config_text;
+    if (!socket.recv_all(&job, sizeof(job)) || std::memcmp(job.magic, "RTJB", 4) != 0)
+    {
+        std::cerr << "ERROR: " << host << ":" << port << " is not a render coordinator.\n";
+        return false;
+    }
+    config_text.resize(job.text_size);
+    RenderParameters params;
+    scene s;
+    if (!socket.recv_all(&config_text[0], config_text.size()) || !params.setFromConfigText(config_text) ||
+        !build_scene(job.scene, params, s))
+        return false;
+
+    std::vector<color> sums;
+    std::vector<double> payload;
+    int tiles = 0;
+    double trace_secs = 0;
+    for (;;)
+    {
+        net_tile request;
+        if (!socket.recv_all(&request, sizeof(request)))
+        {
+            std::cerr << "ERROR: Lost the connection to the coordinator.\n";
+            return false;
+        }
+        if (request.id < 0)
+            break;
+
+        image_tile tile;
+        tile.x0 = request.x0;
+        tile.y0 = request.y0;
+        tile.x1 = request.x1;
+        tile.y1 = request.y1;
+        tile.sample_begin = request.sample_begin;
+        tile.sample_end = request.sample_end;
+
+        auto start = std::chrono::steady_clock::now();
+        s.cam.render_tile(s.world, s.lights, tile, sums);
+        auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        payload.resize(3 * sums.size());
+        for (size_t p = 0; p < sums.size(); p++)
+            for (int c = 0; c < 3; c++)
+                payload[3 * p + c] = sums[p][c];
+        net_result result = {request.id, tile.pixel_count(), secs};
+        if (!socket.send_all(&result, sizeof(result)) ||
+            !socket.send_all(payload.data(), payload.size() * sizeof(double)))
+        {
+            std::cerr << "ERROR: Lost the connection to the coordinator.\n";
+            return false;
+        }
+        tiles++;
+        trace_secs += secs;
+    }
+
+    LOG(INFO) << "WORKER DONE: " << tiles << " tiles in " << trace_secs << "s of tracing";
+    return true;
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+inline int worker_count()
+{
+    // Threads used by parallel_for: one per hardware thread.
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+inline bool &in_parallel_work()
+{
+    // Set on threads that are one of a full set of workers already, such as parallel_for bodies
+    // or daemon renderers, so that loops nested in their work stay on them.
+    thread_local bool inside = false;
+    return inside;
+}
+
+class parallel_work_scope
+{
+    // Marks this thread as a worker until the scope ends.
+  public:
+    parallel_work_scope() : outer(in_parallel_work())
+    {
+        in_parallel_work() = true;
+    }
+
+    ~parallel_work_scope()
+    {
+        in_parallel_work() = outer;
+    }
+
+    parallel_work_scope(const parallel_work_scope &) = delete;
+    parallel_work_scope &operator=(const parallel_work_scope &) = delete;
+
+  private:
+    bool outer;
+};
+
+template <typename F> void parallel_for(int begin, int end, F body, int grain = 1)
+{
+    // Calls body(i) for every i in [begin, end) across worker_count() threads. Work is handed
+    // out in chunks of grain indices from a shared counter, so uneven rows balance themselves.
+    // Called from inside parallel work, such as a batch job denoising its image, it runs on the
+    // calling thread: the other workers are busy with work of their own.
+    auto threads = std::min(worker_count(), (end - begin + grain - 1) / grain);
+    if (threads <= 1 || in_parallel_work())
+    {
+        for (int i = begin; i < end; i++)
+            body(i);
+        return;
+    }
+
+    std::atomic<int> next(begin);
+    auto work = [&] {
+        parallel_work_scope scope;
+        for (int first; (first = next.fetch_add(grain)) < end;)
+            for (int i = first; i < std::min(end, first + grain); i++)
+                body(i);
+    };
+
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; t++)
+        pool.emplace_back(work);
+    work();
+    for (auto &thread : pool)
+        thread.join();
+}
+
+#endif
@@ -5,6 +5,7 @@
 
 #include "hittable_list.h"
 #include "onb.h"
+#include "stats.h"
 
 class pdf
 {
@@ -27,12 +28,14 @@ class cosine_pdf : public pdf
 
     double value(const vec3 &direction) const override
     {
+        RTW_COUNT(pdf_values);
         auto cosine_theta = dot(unit_vector(direction), uvw.w());
         return fmax(0, cosine_theta / pi);
     }
 
     vec3 generate() const override
     {
+        RTW_COUNT(pdf_samples);
         return uvw.local(random_cosine_direction());
     }
 
@@ -49,15 +52,60 @@ class sphere_pdf : public pdf
 
     double value(const vec3 &direction) const override
     {
+        RTW_COUNT(pdf_values);
         return 1 / (4 * pi);
     }
 
     vec3 generate() const override
     {
+        RTW_COUNT(pdf_samples);
         return random_unit_vector();
     }
 };
 
+class scatter_pdf
+{
+  public:
+    // The direction distribution of a material lobe, held by value so scattering never allocates.
+    // Dispatches on the lobe kind instead of through the pdf vtable.
+    enum lobe_kind
+    {
+        cosine,
+        uniform_sphere
+    };
+
+    void set_cosine(const vec3 &w)
+    {
+        kind = cosine;
+        uvw.build_from_w(w);
+    }
+
+    void set_uniform_sphere()
+    {
+        kind = uniform_sphere;
+    }
+
+    double value(const vec3 &direction) const
+    {
+        RTW_COUNT(pdf_values);
+        if (kind == cosine)
+            return fmax(0, dot(unit_vector(direction), uvw.w()) / pi);
+        return 1 / (4 * pi);
+    }
+
+    vec3 generate() const
+    {
+        RTW_COUNT(pdf_samples);
+        if (kind == cosine)
+            return uvw.local(random_cosine_direction());
+        return random_unit_vector();
+    }
+
+  private:
+    lobe_kind kind = cosine;
+    onb uvw;
+};
+
 class hittable_pdf : public pdf
 {
   public:
@@ -67,11 +115,13 @@ class hittable_pdf : public pdf
 
     double value(const vec3 &direction) const override
     {
+        RTW_COUNT(pdf_values);
         return objects.pdf_value(origin, direction);
     }
 
     vec3 generate() const override
     {
+        RTW_COUNT(pdf_samples);
         return objects.random(origin);
     }
 
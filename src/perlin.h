@@ -3,81 +3,177 @@
 
 #include "rtweekend.h"
 
+#include <algorithm>
+#include <array>
+
+struct alignas(64) perlin_lattice
+{
+    // Gradient vectors (stored by component) and the three permutation tables, kept together
+    // in one cache-aligned block: 6 KiB of gradients followed by 3 KiB of permutations.
+    static const int point_count = 256;
+
+    double ranvec_x[point_count];
+    double ranvec_y[point_count];
+    double ranvec_z[point_count];
+    int perm_x[point_count];
+    int perm_y[point_count];
+    int perm_z[point_count];
+};
+
 class perlin
 {
   public:
-    perlin()
+    // Points are evaluated in batches of this many lanes; the per-lane loops below are written
+    // without branches so the compiler can vectorize them.
+    static const int lanes = 8;
+
+    perlin() : lattice(shared_lattice())
+    {
+    }
+
+    double noise(const point3 &p) const
     {
-        ranvec = new vec3[point_count];
-        for (int i = 0; i < point_count; ++i)
+        double result;
+        noise(&p, &result, 1);
+        return result;
+    }
+
+    void noise(const point3 *points, double *out, int n) const
+    {
+        // Batched noise: out[i] = noise(points[i]).
+        for (int start = 0; start < n; start += lanes)
         {
-            ranvec[i] = unit_vector(vec3::random(-1, 1));
+            int count = std::min(lanes, n - start);
+            double x[lanes], y[lanes], z[lanes];
+            for (int l = 0; l < lanes; l++)
+            {
+                const auto &p = points[start + std::min(l, count - 1)];
+                x[l] = p.x();
+                y[l] = p.y();
+                z[l] = p.z();
+            }
+
+            double result[lanes];
+            noise_lanes(x, y, z, result, count);
+            std::copy(result, result + count, out + start);
         }
-
-        perm_x = perlin_generate_perm();
-        perm_y = perlin_generate_perm();
-        perm_z = perlin_generate_perm();
     }
 
-    ~perlin()
+    double turb(const point3 &p, int depth = 7) const
     {
-        delete[] ranvec;
-        delete[] perm_x;
-        delete[] perm_y;
-        delete[] perm_z;
+        // All octaves of one point are independent, so they are evaluated as one batch.
+        double result;
+        turb(&p, &result, 1, depth);
+        return result;
     }
 
-    double noise(const point3 &p) const
+    void turb(const point3 *points, double *out, int n, int depth = 7) const
     {
-        auto u = p.x() - floor(p.x());
-        auto v = p.y() - floor(p.y());
-        auto w = p.z() - floor(p.z());
+        // Batched turbulence: out[i] = turb(points[i], depth). Octaves of consecutive points are
+        // packed together into full batches.
+        double x[lanes], y[lanes], z[lanes], result[lanes];
+        int owner[lanes], octave[lanes];
+
+        for (int i = 0; i < n; i++)
+            out[i] = 0.0;
+
+        // No octaves sum to 0. Octaves past the last one weighed are below 2^-31 of the first.
+        if (depth > max_octaves)
+            depth = max_octaves;
+        if (depth <= 0)
+            return;
+
+        int point = 0, level = 0;
+        while (point < n)
+        {
+            int count = 0;
+            for (; count < lanes && point < n; count++)
+            {
+                auto scale = static_cast<double>(1u << level);
+                x[count] = points[point].x() * scale;
+                y[count] = points[point].y() * scale;
+                z[count] = points[point].z() * scale;
+                owner[count] = point;
+                octave[count] = level;
+                if (++level == depth)
+                {
+                    level = 0;
+                    point++;
+                }
+            }
+            for (int l = count; l < lanes; l++)
+            {
+                x[l] = x[0];
+                y[l] = y[0];
+                z[l] = z[0];
+            }
+
+            noise_lanes(x, y, z, result, count);
+
+            // Accumulate octave by octave, in order, so the sums match the sequential loop.
+            for (int l = 0; l < count; l++)
+                out[owner[l]] += octave_weight(octave[l]) * result[l];
+        }
+
+        for (int i = 0; i < n; i++)
+            out[i] = fabs(out[i]);
+    }
 
-        auto i = static_cast<int>(4 * p.x()) & 255;
-        auto j = static_cast<int>(4 * p.y()) & 255;
-        auto k = static_cast<int>(4 * p.z()) & 255;
-        vec3 c[2][2][2];
+  private:
+    static const int max_octaves = 32;
 
-        for (int di = 0; di < 2; di++)
-            for (int dj = 0; dj < 2; dj++)
-                for (int dk = 0; dk < 2; dk++)
-                    c[di][dj][dk] = ranvec[perm_x[(i + di) & 255] ^ perm_y[(j + dj) & 255] ^ perm_z[(k + dk) & 255]];
+    shared_ptr<const perlin_lattice> lattice;
 
-        return perlin_interp(c, u, v, w);
+    static double octave_weight(int octave)
+    {
+        // 2^-octave, exactly.
+        static const auto table = [] {
+            std::array<double, max_octaves> w;
+            w[0] = 1.0;
+            for (int i = 1; i < max_octaves; i++)
+                w[i] = w[i - 1] * 0.5;
+            return w;
+        }();
+        return table[octave];
     }
 
-    double turb(const point3 &p, int depth = 7) const
+    static shared_ptr<const perlin_lattice> shared_lattice()
     {
-        auto accum = 0.0;
-        auto temp_p = p;
-        auto weight = 1.0;
+        // Every perlin instance shares the lattice built by the first one.
+        static shared_ptr<const perlin_lattice> instance = make_lattice();
+        return instance;
+    }
 
-        for (int i = 0; i < depth; i++)
+    static shared_ptr<const perlin_lattice> make_lattice()
+    {
+        // Drawn from a freshly seeded generator, and the caller's restored afterwards, so the
+        // lattice and the scene building it don't depend on which scene happened to be first.
+        auto caller = random_generator();
+        random_generator().seed(std::mt19937::default_seed);
+
+        auto lat = make_shared<perlin_lattice>();
+        for (int i = 0; i < perlin_lattice::point_count; ++i)
         {
-            accum += weight * noise(temp_p);
-            weight *= 0.5;
-            temp_p *= 2;
+            auto v = unit_vector(vec3::random(-1, 1));
+            lat->ranvec_x[i] = v.x();
+            lat->ranvec_y[i] = v.y();
+            lat->ranvec_z[i] = v.z();
         }
-        return fabs(accum);
-    }
 
-  private:
-    static const int point_count = 256;
-    vec3 *ranvec;
-    int *perm_x;
-    int *perm_y;
-    int *perm_z;
+        perlin_generate_perm(lat->perm_x);
+        perlin_generate_perm(lat->perm_y);
+        perlin_generate_perm(lat->perm_z);
 
-    static int *perlin_generate_perm()
-    {
-        auto p = new int[point_count];
+        random_generator() = caller;
+        return lat;
+    }
 
-        for (int i = 0; i < perlin::point_count; i++)
+    static void perlin_generate_perm(int *p)
+    {
+        for (int i = 0; i < perlin_lattice::point_count; i++)
             p[i] = i;
 
-        permute(p, point_count);
-
-        return p;
+        permute(p, perlin_lattice::point_count);
     }
 
     static void permute(int *p, int n)
@@ -91,34 +187,54 @@ class perlin
         }
     }
 
-    static double trilinear_interp(double c[2][2][2], double u, double v, double w)
+    static double fast_floor(double x)
     {
-        auto accum = 0.0;
-        for (int i = 0; i < 2; i++)
-            for (int j = 0; j < 2; j++)
-                for (int k = 0; k < 2; k++)
-                    accum += (i * u + (1 - i) * (1 - u)) * (j * v + (1 - j) * (1 - v)) * (k * w + (1 - k) * (1 - w)) *
-                             c[i][j][k];
-        return accum;
+        // Same result as floor() for |x| < 2^63, but branch-free and without a library call.
+        auto truncated = static_cast<double>(static_cast<long long>(x));
+        return truncated - (truncated > x);
     }
 
-    static double perlin_interp(vec3 c[2][2][2], double u, double v, double w)
+    void noise_lanes(const double *x, const double *y, const double *z, double *out, int count = lanes) const
     {
-        auto uu = u * u * (3 - 2 * u);
-        auto vv = v * v * (3 - 2 * v);
-        auto ww = w * w * (3 - 2 * w);
-        auto accum = 0.0;
-
-        for (int i = 0; i < 2; i++)
-            for (int j = 0; j < 2; j++)
-                for (int k = 0; k < 2; k++)
-                {
-                    vec3 weight_v(u - i, v - j, w - k);
-                    accum += (i * uu + (1 - i) * (1 - uu)) * (j * vv + (1 - j) * (1 - vv)) *
-                             (k * ww + (1 - k) * (1 - ww)) * dot(c[i][j][k], weight_v);
-                }
-        return accum;
+        // Gradient noise with Hermite smoothing for the first count lanes. Setup runs over every
+        // lane (callers pad unused ones) so it stays a fixed-length, vectorizable loop.
+        const auto &lat = *lattice;
+        double u[lanes], v[lanes], w[lanes], uu[lanes], vv[lanes], ww[lanes];
+        int i[lanes], j[lanes], k[lanes];
+
+        for (int l = 0; l < lanes; l++)
+        {
+            u[l] = x[l] - fast_floor(x[l]);
+            v[l] = y[l] - fast_floor(y[l]);
+            w[l] = z[l] - fast_floor(z[l]);
+
+            i[l] = static_cast<int>(4 * x[l]) & 255;
+            j[l] = static_cast<int>(4 * y[l]) & 255;
+            k[l] = static_cast<int>(4 * z[l]) & 255;
+
+            uu[l] = u[l] * u[l] * (3 - 2 * u[l]);
+            vv[l] = v[l] * v[l] * (3 - 2 * v[l]);
+            ww[l] = w[l] * w[l] * (3 - 2 * w[l]);
+            out[l] = 0.0;
+        }
+
+        for (int l = 0; l < count; l++)
+        {
+            double acc = 0.0;
+            for (int di = 0; di < 2; di++)
+                for (int dj = 0; dj < 2; dj++)
+                    for (int dk = 0; dk < 2; dk++)
+                    {
+                        int idx = lat.perm_x[(i[l] + di) & 255] ^ lat.perm_y[(j[l] + dj) & 255] ^
+                                  lat.perm_z[(k[l] + dk) & 255];
+                        auto gradient = lat.ranvec_x[idx] * (u[l] - di) + lat.ranvec_y[idx] * (v[l] - dj) +
+                                        lat.ranvec_z[idx] * (w[l] - dk);
+                        auto weight = (di ? uu[l] : 1 - uu[l]) * (dj ? vv[l] : 1 - vv[l]) * (dk ? ww[l] : 1 - ww[l]);
+                        acc += weight * gradient;
+                    }
+            out[l] = acc;
+        }
     }
 };
 
-#endif
\ No newline at end of file
+#endif
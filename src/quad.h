@@ -5,6 +5,9 @@
 
 #include "hittable.h"
 #include "hittable_list.h"
+#include "stats.h"
+
+#include <array>
 
 class quad : public hittable
 {
@@ -33,6 +36,36 @@ class quad : public hittable
 
     bool hit(const ray &r, interval ray_t, hit_record &rec) const override
     {
+        RTW_COUNT(quad_tests);
+        double t, alpha, beta;
+        point3 intersection;
+        if (!intersect(Q, u, v, normal, D, w, r, ray_t, t, intersection, alpha, beta))
+            return false;
+
+        if (!is_interior(alpha, beta, rec))
+            return false;
+
+        // Ray hits the 2D shape; set the rest of the hit record and return true.
+        rec.t = t;
+        rec.p = intersection;
+        rec.uv_scale = 1 / sqrt(area);
+        rec.mat = mat.get();
+        rec.prim_id = id;
+        rec.set_face_normal(r, normal);
+
+        return true;
+    }
+
+    virtual bool is_interior(double a, double b, hit_record &rec) const
+    {
+        return in_unit_square(a, b, rec);
+    }
+
+    static bool intersect(const point3 &Q, const vec3 &u, const vec3 &v, const vec3 &normal, double D, const vec3 &w,
+                          const ray &r, interval ray_t, double &t, point3 &intersection, double &alpha, double &beta)
+    {
+        // The ray-plane test, also used by scene caches: where the ray meets the quad's plane
+        // within ray_t, in plane coordinates.
         auto denom = dot(normal, r.direction());
 
         // No hit if the ray is parallel to the plane.
@@ -40,29 +73,19 @@ class quad : public hittable
             return false;
 
         // Return false if the hit point parameter t is outside the ray interval.
-        auto t = (D - dot(normal, r.origin())) / denom;
+        t = (D - dot(normal, r.origin())) / denom;
         if (!ray_t.contains(t))
             return false;
 
         // Determine the hit point lies within the planar shape using its plane coordinates.
-        auto intersection = r.at(t);
+        intersection = r.at(t);
         vec3 planar_hitpt_vector = intersection - Q;
-        auto alpha = dot(w, cross(planar_hitpt_vector, v));
-        auto beta = dot(w, cross(u, planar_hitpt_vector));
-
-        if (!is_interior(alpha, beta, rec))
-            return false;
-
-        // Ray hits the 2D shape; set the rest of the hit record and return true.
-        rec.t = t;
-        rec.p = intersection;
-        rec.mat = mat;
-        rec.set_face_normal(r, normal);
-
+        alpha = dot(w, cross(planar_hitpt_vector, v));
+        beta = dot(w, cross(u, planar_hitpt_vector));
         return true;
     }
 
-    virtual bool is_interior(double a, double b, hit_record &rec) const
+    static bool in_unit_square(double a, double b, hit_record &rec)
     {
         // Given the hit point in plane coordinates, return false if it is outside the
         // primitive, otherwise set the hit record UV coordinates and return true.
@@ -104,11 +127,15 @@ class quad : public hittable
     double area;
 };
 
-inline shared_ptr<hittable_list> box(const point3 &a, const point3 &b, shared_ptr<material> mat)
+struct quad_shape
 {
-    // Returns the 3D box (six sides) that contains the two opposite vertices a & b.
+    point3 Q;
+    vec3 u, v;
+};
 
-    auto sides = make_shared<hittable_list>();
+inline std::array<quad_shape, 6> box_sides(const point3 &a, const point3 &b)
+{
+    // Returns the six sides of the 3D box that contains the two opposite vertices a & b.
 
     // Construct the two opposite vertices with the minimum and maximum coordinates.
     auto min = point3(fmin(a.x(), b.x()), fmin(a.y(), b.y()), fmin(a.z(), b.z()));
@@ -118,14 +145,31 @@ inline shared_ptr<hittable_list> box(const point3 &a, const point3 &b, shared_pt
     auto dy = vec3(0, max.y() - min.y(), 0);
     auto dz = vec3(0, 0, max.z() - min.z());
 
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), max.z()), dx, dy, mat));  // front
-    sides->add(make_shared<quad>(point3(max.x(), min.y(), max.z()), -dz, dy, mat)); // right
-    sides->add(make_shared<quad>(point3(max.x(), min.y(), min.z()), -dx, dy, mat)); // back
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), min.z()), dz, dy, mat));  // left
-    sides->add(make_shared<quad>(point3(min.x(), max.y(), max.z()), dx, -dz, mat)); // top
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), min.z()), dx, dz, mat));  // bottom
+    return {{
+        {point3(min.x(), min.y(), max.z()), dx, dy},  // front
+        {point3(max.x(), min.y(), max.z()), -dz, dy}, // right
+        {point3(max.x(), min.y(), min.z()), -dx, dy}, // back
+        {point3(min.x(), min.y(), min.z()), dz, dy},  // left
+        {point3(min.x(), max.y(), max.z()), dx, -dz}, // top
+        {point3(min.x(), min.y(), min.z()), dx, dz},  // bottom
+    }};
+}
 
+template <typename Allocator>
+shared_ptr<hittable_list> box(const point3 &a, const point3 &b, shared_ptr<material> mat, const Allocator &alloc)
+{
+    // Returns the 3D box (six sides) that contains the two opposite vertices a & b, allocated
+    // with alloc.
+    auto sides = std::allocate_shared<hittable_list>(alloc);
+    for (const auto &side : box_sides(a, b))
+        sides->add(std::allocate_shared<quad>(alloc, side.Q, side.u, side.v, mat));
     return sides;
 }
 
+inline shared_ptr<hittable_list> box(const point3 &a, const point3 &b, shared_ptr<material> mat)
+{
+    // Returns the 3D box (six sides) that contains the two opposite vertices a & b.
+    return box(a, b, mat, std::allocator<quad>());
+}
+
 #endif
\ No newline at end of file
@@ -12,92 +12,133 @@
 #define STBI_FAILURE_USERMSG
 #include "external/stb_image.h"
 
+#include <cmath>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <string>
+#include <vector>
+
+inline std::string resolve_image_path(const char *image_filename)
+{
+    // Finds the file an image name refers to. If the RTW_IMAGES environment variable is
+    // defined, looks in that directory first. Otherwise searches for the specified image file
+    // first from the current directory, then in the images/ subdirectory, then the _parent's_
+    // images/ subdirectory, and then _that_ parent, on so on, for six levels up. Candidates are
+    // only opened, never decoded. Returns an empty string if the file was not found.
+
+    auto filename = std::string(image_filename);
+    auto imagedir = getenv("RTW_IMAGES");
+
+    std::vector<std::string> candidates;
+    if (imagedir)
+        candidates.push_back(std::string(imagedir) + "/" + filename);
+    candidates.push_back(filename);
+
+    std::string prefix = "images/";
+    for (int up = 0; up <= 6; up++)
+    {
+        candidates.push_back(prefix + filename);
+        prefix = "../" + prefix;
+    }
+
+    for (const auto &candidate : candidates)
+        if (std::ifstream(candidate, std::ios::binary).good())
+            return candidate;
+    return std::string();
+}
 
 class rtw_image
 {
   public:
-    rtw_image() : data(nullptr)
+    rtw_image()
     {
     }
 
     rtw_image(const char *image_filename)
     {
-        // Loads image data from the specified file. If the RTW_IMAGES environment variable is
-        // defined, looks only in that directory for the image file. If the image was not found,
-        // searches for the specified image file first from the current directory, then in the
-        // images/ subdirectory, then the _parent's_ images/ subdirectory, and then _that_
-        // parent, on so on, for six levels up. If the image was not loaded successfully,
-        // width() and height() will return 0.
-
-        auto filename = std::string(image_filename);
-        auto imagedir = getenv("RTW_IMAGES");
-
-        // Hunt for the image file in some likely locations.
-        if (imagedir && load(std::string(imagedir) + "/" + image_filename))
-            return;
-        if (load(filename))
-            return;
-        if (load("images/" + filename))
-            return;
-        if (load("../images/" + filename))
-            return;
-        if (load("../../images/" + filename))
-            return;
-        if (load("../../../images/" + filename))
-            return;
-        if (load("../../../../images/" + filename))
-            return;
-        if (load("../../../../../images/" + filename))
-            return;
-        if (load("../../../../../../images/" + filename))
+        // Loads image data from the specified file, located with resolve_image_path(). If the
+        // image was not loaded successfully, width() and height() will return 0.
+
+        auto path = resolve_image_path(image_filename);
+        if (!path.empty() && load(path))
             return;
 
         std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
     }
 
-    ~rtw_image()
+    bool load(const std::string filename)
     {
-        STBI_FREE(data);
+        // Loads image data from the given file name. Returns true if the load succeeded.
+        // The 8-bit sRGB pixels are decoded once into linear float RGBA and a full mip chain
+        // is built, so lookups never touch the byte data again.
+        auto n = bytes_per_pixel; // Dummy out parameter: original components per pixel
+        int w, h;
+        auto bytes = stbi_load(filename.c_str(), &w, &h, &n, bytes_per_pixel);
+        if (bytes == nullptr)
+            return false;
+
+        build_levels(bytes, w, h);
+        STBI_FREE(bytes);
+        return true;
     }
 
-    bool load(const std::string filename)
+    bool load_from_memory(const unsigned char *encoded, size_t length)
     {
-        // Loads image data from the given file name. Returns true if the load succeeded.
+        // As load(), for an encoded file already read into memory.
         auto n = bytes_per_pixel; // Dummy out parameter: original components per pixel
-        data = stbi_load(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
-        bytes_per_scanline = image_width * bytes_per_pixel;
-        return data != nullptr;
+        int w, h;
+        auto bytes = stbi_load_from_memory(encoded, static_cast<int>(length), &w, &h, &n, bytes_per_pixel);
+        if (bytes == nullptr)
+            return false;
+
+        build_levels(bytes, w, h);
+        STBI_FREE(bytes);
+        return true;
     }
 
-    int width() const
+    int width(int level = 0) const
     {
-        return (data == nullptr) ? 0 : image_width;
+        return levels.empty() ? 0 : levels[level].width;
     }
-    int height() const
+    int height(int level = 0) const
     {
-        return (data == nullptr) ? 0 : image_height;
+        return levels.empty() ? 0 : levels[level].height;
+    }
+    int level_count() const
+    {
+        return static_cast<int>(levels.size());
     }
 
-    const unsigned char *pixel_data(int x, int y) const
+    const float *texel(int level, int x, int y) const
     {
-        // Return the address of the three bytes of the pixel at x,y (or magenta if no data).
-        static unsigned char magenta[] = {255, 0, 255};
-        if (data == nullptr)
+        // Return the address of the four linear RGBA floats of the texel at x,y in the given mip
+        // level (or magenta if no data). Coordinates are clamped to the level's extent.
+        static const float magenta[] = {1, 0, 1, 1};
+        if (levels.empty())
             return magenta;
 
-        x = clamp(x, 0, image_width);
-        y = clamp(y, 0, image_height);
-
-        return data + y * bytes_per_scanline + x * bytes_per_pixel;
+        const auto &l = levels[level];
+        x = clamp(x, 0, l.width);
+        y = clamp(y, 0, l.height);
+        return l.texels.data() + texel_offset(l, x, y);
     }
 
   private:
+    // Texels are stored as RGBA float in 4x4 tiles, so a bilinear footprint (and most of its
+    // neighbours) falls in one 256-byte block.
+    static const int tile_size = 4;
+    static const int channels = 4;
+
+    struct mip_level
+    {
+        int width, height;
+        int tiles_per_row;
+        std::vector<float> texels;
+    };
+
     const int bytes_per_pixel = 3;
-    unsigned char *data;
-    int image_width, image_height;
-    int bytes_per_scanline;
+    std::vector<mip_level> levels;
 
     static int clamp(int x, int low, int high)
     {
@@ -108,6 +149,83 @@ class rtw_image
             return x;
         return high - 1;
     }
+
+    static size_t texel_offset(const mip_level &l, int x, int y)
+    {
+        auto tile = static_cast<size_t>(y / tile_size) * l.tiles_per_row + x / tile_size;
+        auto within = (y % tile_size) * tile_size + (x % tile_size);
+        return (tile * tile_size * tile_size + within) * channels;
+    }
+
+    static mip_level make_level(int w, int h)
+    {
+        mip_level l;
+        l.width = w;
+        l.height = h;
+        l.tiles_per_row = (w + tile_size - 1) / tile_size;
+        auto tile_rows = (h + tile_size - 1) / tile_size;
+        l.texels.assign(static_cast<size_t>(l.tiles_per_row) * tile_rows * tile_size * tile_size * channels, 0.0f);
+        return l;
+    }
+
+    static float srgb_to_linear(int byte)
+    {
+        auto c = byte / 255.0;
+        return static_cast<float>(c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4));
+    }
+
+    void build_levels(const unsigned char *bytes, int w, int h)
+    {
+        float decode[256];
+        for (int i = 0; i < 256; i++)
+            decode[i] = srgb_to_linear(i);
+
+        levels.clear();
+        levels.push_back(make_level(w, h));
+        auto &base = levels.back();
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++)
+            {
+                auto src = bytes + (static_cast<size_t>(y) * w + x) * bytes_per_pixel;
+                auto dst = base.texels.data() + texel_offset(base, x, y);
+                dst[0] = decode[src[0]];
+                dst[1] = decode[src[1]];
+                dst[2] = decode[src[2]];
+                dst[3] = 1.0f;
+            }
+
+        // Each further level is a 2x2 box filter of the previous one, down to 1x1. On an odd-sized
+        // level the last texel of a row or column is folded into the last output texel, which then
+        // averages 3 texels across, so no part of the image is dropped.
+        while (w > 1 || h > 1)
+        {
+            const auto prev = levels.size() - 1;
+            auto nw = w > 1 ? w / 2 : 1;
+            auto nh = h > 1 ? h / 2 : 1;
+            levels.push_back(make_level(nw, nh));
+
+            const auto &src = levels[prev];
+            auto &dst = levels.back();
+            for (int y = 0; y < nh; y++)
+                for (int x = 0; x < nw; x++)
+                {
+                    auto x0 = 2 * x, x1 = x + 1 == nw ? w : x0 + 2;
+                    auto y0 = 2 * y, y1 = y + 1 == nh ? h : y0 + 2;
+                    auto weight = 1.0f / ((x1 - x0) * (y1 - y0));
+                    auto out = dst.texels.data() + texel_offset(dst, x, y);
+                    for (int sy = y0; sy < y1; sy++)
+                        for (int sx = x0; sx < x1; sx++)
+                        {
+                            auto in = src.texels.data() + texel_offset(src, sx, sy);
+                            for (int c = 0; c < channels; c++)
+                                out[c] += weight * in[c];
+                        }
+                }
+
+            w = nw;
+            h = nh;
+        }
+    }
 };
 
 // Restore MSVC compiler warnings
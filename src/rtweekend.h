@@ -6,6 +6,8 @@
 #include <memory>
 #include <random>
 
+#include "sampler.h"
+
 // Usings
 
 using std::make_shared;
@@ -24,12 +26,24 @@ inline double degrees_to_radians(double degrees)
     return degrees * pi / 180.0;
 }
 
+inline std::mt19937 &random_generator()
+{
+    // The generator random_double() draws from outside pixel samples, i.e. while scenes are
+    // built. One per thread, so scenes can be built concurrently; reseeding it before a build
+    // makes the scene independent of whatever the thread built before.
+    thread_local std::mt19937 generator;
+    return generator;
+}
+
 inline double random_double()
 {
-    // Returns a (psuedo) random real in [0,1)
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
+    // Returns a (psuedo) random real in [0,1). While a pixel sample is being traced, the value
+    // is the next dimension of that sample's stream instead.
+    if (auto stream = sample_stream::active())
+        return stream->next();
+
+    std::uniform_real_distribution<double> distribution(0.0, 1.0);
+    return distribution(random_generator());
 }
 
 inline double random_double(double min, double max)
@@ -0,0 +1,306 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+// Per-pixel-sample random streams. While a pixel sample is traced, random_double() reads the
+// active sample_stream, so every random decision along the path (pixel jitter, lens, time,
+// lobe and light choices, ...) takes the next dimension of that sample's low-discrepancy point.
+// Streams are pure functions of (pixel, sample index, dimension, seed), so any sample can be
+// regenerated independently of the order in which samples are traced.
+
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class sampler_kind
+{
+    independent, // Hashed uniform random numbers
+    sobol,       // Owen-scrambled Sobol, padded in shuffled dimension pairs
+    halton,      // Owen-scrambled Halton
+    blue_noise   // Sobol shared by all pixels, dithered by a blue-noise tile per dimension
+};
+
+inline bool parse_sampler_kind(const std::string &name, sampler_kind &kind)
+{
+    if (name == "independent")
+        kind = sampler_kind::independent;
+    else if (name == "sobol")
+        kind = sampler_kind::sobol;
+    else if (name == "halton")
+        kind = sampler_kind::halton;
+    else if (name == "blue_noise")
+        kind = sampler_kind::blue_noise;
+    else
+        return false;
+    return true;
+}
+
+namespace sampling
+{
+
+inline uint32_t hash(uint32_t a, uint32_t b)
+{
+    // 32-bit finalizer of a 64-bit mix of a and b.
+    uint64_t x = (static_cast<uint64_t>(a) << 32) | b;
+    x ^= x >> 31;
+    x *= 0x7fb5d329728ea185ull;
+    x ^= x >> 27;
+    x *= 0x81dadef4bc2dd44dull;
+    x ^= x >> 33;
+    return static_cast<uint32_t>(x);
+}
+
+inline uint32_t reverse_bits(uint32_t x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+    x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+    x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+    x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+    return x;
+}
+
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+{
+    // Owen scrambling of a base-2 fixed-point value via a Laine-Karras style hash: each bit is
+    // flipped depending only on the bits above it.
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+inline uint32_t sobol(uint32_t index, int dimension)
+{
+    // First two dimensions of the Sobol sequence, as 32-bit fixed point.
+    if (dimension == 0)
+        return reverse_bits(index);
+
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+        if (index & 1)
+            result ^= v;
+    return result;
+}
+
+inline double to_unit(uint32_t x)
+{
+    return x * (1.0 / 4294967296.0);
+}
+
+inline double scrambled_sobol(uint32_t index, uint32_t dimension, uint32_t seed)
+{
+    // Dimensions are taken in pairs from the 2D Sobol (0,2)-sequence. Each pair gets its own
+    // index shuffle and value scramble, so pairs are decorrelated but each stays stratified.
+    auto pair_seed = hash(seed, dimension / 2);
+    auto shuffled = nested_uniform_scramble(index, pair_seed);
+    auto value = sobol(shuffled, dimension % 2);
+    return to_unit(nested_uniform_scramble(value, hash(pair_seed, dimension)));
+}
+
+inline double scrambled_halton(uint32_t index, uint32_t dimension, uint32_t seed)
+{
+    // Radical inverse in the dimension's prime base, where each digit is shifted by a hash of
+    // the digits before it (a nested, Owen-style scramble). Past the prime table the dimension
+    // falls back to scrambled Sobol.
+    static const uint32_t primes[] = {2,   3,   5,   7,   11,  13,  17,  19,  23,  29,  31,  37,  41,
+                                      43,  47,  53,  59,  61,  67,  71,  73,  79,  83,  89,  97,  101,
+                                      103, 107, 109, 113, 127, 131, 137, 139, 149, 151, 157, 163};
+    const uint32_t prime_count = sizeof(primes) / sizeof(primes[0]);
+    if (dimension >= prime_count)
+        return scrambled_sobol(index, dimension, seed);
+
+    auto base = primes[dimension];
+    auto digit_seed = hash(seed, dimension);
+    double inv_base = 1.0 / base, weight = inv_base, result = 0;
+    uint32_t prefix = 0;
+    while (weight * base > 0x1p-32) // Digits down to 32-bit precision
+    {
+        auto digit = index % base;
+        index /= base;
+        digit = (digit + hash(digit_seed, prefix)) % base;
+        prefix = prefix * base + digit + 1;
+        result += digit * weight;
+        weight *= inv_base;
+    }
+    return result < 1.0 ? result : std::nextafter(1.0, 0.0);
+}
+
+class blue_noise_tile
+{
+    // A 64x64 tile of ranks in [0,1) with a blue-noise spectrum, built once with the
+    // void-and-cluster method (Ulichney 1993) using a deterministic private generator.
+  public:
+    static const int size = 64;
+
+    static const blue_noise_tile &instance()
+    {
+        static const blue_noise_tile tile;
+        return tile;
+    }
+
+    double value(uint32_t x, uint32_t y) const
+    {
+        return ranks[(y % size) * size + (x % size)];
+    }
+
+  private:
+    std::vector<double> ranks;
+
+    blue_noise_tile() : ranks(size * size)
+    {
+        const int n = size * size;
+        const double sigma = 1.5;
+
+        // Gaussian energy kernel over toroidal offsets.
+        std::vector<double> kernel(n);
+        for (int dy = 0; dy < size; dy++)
+            for (int dx = 0; dx < size; dx++)
+            {
+                auto x = std::fmin(dx, size - dx), y = std::fmin(dy, size - dy);
+                kernel[dy * size + dx] = std::exp(-(x * x + y * y) / (2 * sigma * sigma));
+            }
+
+        std::vector<char> on(n, 0);
+        std::vector<double> energy(n, 0.0);
+        auto toggle = [&](int p, int sign) {
+            on[p] = sign > 0;
+            int px = p % size, py = p / size;
+            for (int y = 0; y < size; y++)
+                for (int x = 0; x < size; x++)
+                    energy[y * size + x] +=
+                        sign * kernel[((y - py + size) % size) * size + (x - px + size) % size];
+        };
+        auto extreme = [&](bool want_on, bool highest) {
+            int best = -1;
+            for (int p = 0; p < n; p++)
+                if (on[p] == want_on &&
+                    (best < 0 || (highest ? energy[p] > energy[best] : energy[p] < energy[best])))
+                    best = p;
+            return best;
+        };
+
+        // Initial pattern: a tenth of the pixels at random, then relaxed by moving the tightest
+        // cluster into the largest void until that is a no-op.
+        uint32_t state = 0x9e3779b9u;
+        int initial = n / 10;
+        for (int placed = 0; placed < initial;)
+        {
+            state = state * 1664525u + 1013904223u;
+            int p = static_cast<int>(state >> 8) % n;
+            if (!on[p])
+            {
+                toggle(p, +1);
+                placed++;
+            }
+        }
+        for (int step = 0; step < n; step++)
+        {
+            int cluster = extreme(true, true);
+            toggle(cluster, -1);
+            int hole = extreme(false, false);
+            toggle(hole, +1);
+            if (hole == cluster)
+                break;
+        }
+
+        // Rank the initial points by repeatedly removing the tightest cluster, then fill in the
+        // rest of the tile by repeatedly filling the largest void.
+        auto pattern = on;
+        auto saved_energy = energy;
+        for (int rank = initial - 1; rank >= 0; rank--)
+        {
+            int cluster = extreme(true, true);
+            toggle(cluster, -1);
+            ranks[cluster] = (rank + 0.5) / n;
+        }
+        on = pattern;
+        energy = saved_energy;
+        for (int rank = initial; rank < n; rank++)
+        {
+            int hole = extreme(false, false);
+            toggle(hole, +1);
+            ranks[hole] = (rank + 0.5) / n;
+        }
+    }
+};
+
+} // namespace sampling
+
+class sample_stream
+{
+  public:
+    sample_stream()
+    {
+    }
+
+    sample_stream(sampler_kind _kind, int px, int py, uint32_t _index, uint32_t seed)
+        : kind(_kind), x(static_cast<uint32_t>(px)), y(static_cast<uint32_t>(py)), index(_index),
+          pixel_seed(sampling::hash(sampling::hash(x, y), seed)), global_seed(seed)
+    {
+    }
+
+    double next()
+    {
+        // The next dimension of this sample, in [0,1).
+        auto d = dimension++;
+        switch (kind)
+        {
+        case sampler_kind::sobol:
+            return sampling::scrambled_sobol(index, d, pixel_seed);
+        case sampler_kind::halton:
+            return sampling::scrambled_halton(index, d, pixel_seed);
+        case sampler_kind::blue_noise: {
+            // Toroidally shift the tile per dimension so dimensions don't share a mask.
+            auto shift = sampling::hash(global_seed, d);
+            auto offset = sampling::blue_noise_tile::instance().value(x + (shift & 0xffff), y + (shift >> 16));
+            auto v = sampling::scrambled_sobol(index, d, global_seed) + offset;
+            v -= std::floor(v);
+            return v < 1.0 ? v : 0.0;
+        }
+        default:
+            return sampling::to_unit(sampling::hash(sampling::hash(pixel_seed, index), d));
+        }
+    }
+
+    static sample_stream *&active()
+    {
+        // The stream random_double() draws from on this thread, or null outside of sampling.
+        thread_local sample_stream *stream = nullptr;
+        return stream;
+    }
+
+  private:
+    sampler_kind kind = sampler_kind::independent;
+    uint32_t x = 0, y = 0;
+    uint32_t index = 0;
+    uint32_t pixel_seed = 0;
+    uint32_t global_seed = 0;
+    uint32_t dimension = 0;
+};
+
+class sample_scope
+{
+    // Makes a stream the active one for the lifetime of the scope.
+  public:
+    sample_scope(sample_stream &stream) : previous(sample_stream::active())
+    {
+        sample_stream::active() = &stream;
+    }
+
+    ~sample_scope()
+    {
+        sample_stream::active() = previous;
+    }
+
+    sample_scope(const sample_scope &) = delete;
+    sample_scope &operator=(const sample_scope &) = delete;
+
+  private:
+    sample_stream *previous;
+};
+
+#endif
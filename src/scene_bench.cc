@@ -0,0 +1,191 @@
+#include "rtweekend.h"
+
+#include "scene_cache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Times loading a large generated scene file: reading, parsing and building, the last also
+// against building the same objects directly with make_shared as the example scenes do. Then
+// times loading it through its binary cache (see scene_cache.h), cold when the cache has to be
+// compiled first and warm when it is only mapped.
+// Usage: scene_bench [objects] [runs]
+//   objects   spheres and boxes in the generated scene, 100000 by default
+//   runs      loads to time, the median of which is reported, 5 by default
+
+struct generated_object
+{
+    bool is_box;
+    point3 a, b; // Sphere center and (radius, 0, 0), or box corners
+    double angle;
+    vec3 offset;
+    int material; // Index into the named materials, or -1 for an inline lambertian
+    color albedo;
+};
+
+static const char *material_names[] = {"matte", "metal", "glass"};
+
+static std::vector<generated_object> generate(int count)
+{
+    std::vector<generated_object> objects(count);
+    for (auto &o : objects)
+    {
+        o.is_box = random_double() < 0.3;
+        o.a = point3::random(-500, 500);
+        o.b = o.is_box ? o.a + vec3::random(1, 5) : vec3(random_double(0.5, 2.5), 0, 0);
+        o.angle = random_double(-45, 45);
+        o.offset = vec3::random(-10, 10);
+        o.material = random_int(-1, 2);
+        o.albedo = color::random(0.1, 0.9);
+    }
+    return objects;
+}
+
+static void write_vec3(std::ostream &out, const vec3 &v)
+{
+    out << '[' << v.x() << ", " << v.y() << ", " << v.z() << ']';
+}
+
+static std::string to_json(const std::vector<generated_object> &objects)
+{
+    std::ostringstream out;
+    out.precision(9);
+    out << "// Generated by scene_bench\n{\n"
+        << "    \"materials\": {\n"
+        << "        \"matte\": {\"type\": \"lambertian\", \"albedo\": [0.5, 0.5, 0.5]},\n"
+        << "        \"metal\": {\"type\": \"metal\", \"albedo\": [0.7, 0.6, 0.5], \"fuzz\": 0.1},\n"
+        << "        \"glass\": {\"type\": \"dielectric\", \"ir\": 1.5}\n"
+        << "    },\n"
+        << "    \"objects\": [{\"type\": \"bvh\", \"objects\": [\n";
+    for (size_t i = 0; i < objects.size(); i++)
+    {
+        const auto &o = objects[i];
+        out << "        {\"type\": ";
+        if (o.is_box)
+        {
+            out << "\"box\", \"a\": ";
+            write_vec3(out, o.a);
+            out << ", \"b\": ";
+            write_vec3(out, o.b);
+        }
+        else
+        {
+            out << "\"sphere\", \"center\": ";
+            write_vec3(out, o.a);
+            out << ", \"radius\": " << o.b.x();
+        }
+        out << ", \"material\": ";
+        if (o.material < 0)
+        {
+            out << "{\"type\": \"lambertian\", \"albedo\": ";
+            write_vec3(out, o.albedo);
+            out << '}';
+        }
+        else
+            out << '"' << material_names[o.material] << '"';
+        if (o.is_box)
+        {
+            out << ", \"rotate_y\": " << o.angle << ", \"translate\": ";
+            write_vec3(out, o.offset);
+        }
+        out << (i + 1 < objects.size() ? "},\n" : "}\n");
+    }
+    out << "    ]}]\n}\n";
+    return out.str();
+}
+
+static hittable_list build_directly(const std::vector<generated_object> &objects)
+{
+    shared_ptr<material> named[] = {make_shared<lambertian>(color(0.5, 0.5, 0.5)),
+                                    make_shared<metal>(color(0.7, 0.6, 0.5), 0.1), make_shared<dielectric>(1.5)};
+    hittable_list list;
+    for (const auto &o : objects)
+    {
+        auto mat = o.material < 0 ? make_shared<lambertian>(o.albedo) : named[o.material];
+        if (o.is_box)
+        {
+            shared_ptr<hittable> b = box(o.a, o.b, mat);
+            b = make_shared<rotate_y>(b, o.angle);
+            list.add(make_shared<translate>(b, o.offset));
+        }
+        else
+            list.add(make_shared<sphere>(o.a, o.b.x(), mat));
+    }
+    return hittable_list(make_shared<bvh_node>(list));
+}
+
+static double median(std::vector<double> times)
+{
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+int main(int argc, char *argv[])
+{
+    int count = argc > 1 ? std::stoi(argv[1]) : 100000;
+    int runs = argc > 2 ? std::max(1, std::stoi(argv[2])) : 5;
+
+    auto objects = generate(count);
+    const std::string path = "scene_bench.json";
+    {
+        std::ofstream file(path, std::ios::binary);
+        file << to_json(objects);
+    }
+
+    const std::string cache_path = "scene_bench.rtsc";
+    auto seconds_since = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    RenderParameters params;
+    std::vector<double> read, parse, build, direct, cold, warm, warm_map;
+    size_t bytes = 0;
+    for (int r = 0; r < runs; r++)
+    {
+        scene_loader loader;
+        scene s;
+        if (!loader.load(path, params, s))
+            return 1;
+        read.push_back(loader.read_secs);
+        parse.push_back(loader.parse_secs);
+        build.push_back(loader.build_secs);
+        bytes = loader.bytes;
+
+        auto start = std::chrono::steady_clock::now();
+        auto world = build_directly(objects);
+        direct.push_back(seconds_since(start));
+
+        std::remove(cache_path.c_str());
+        for (bool rebuild : {true, false})
+        {
+            scene_cache_loader cached;
+            scene c;
+            start = std::chrono::steady_clock::now();
+            if (!cached.load(path, cache_path, params, c) || cached.rebuilt != rebuild)
+                return 1;
+            (rebuild ? cold : warm).push_back(seconds_since(start));
+            if (!rebuild)
+                warm_map.push_back(cached.map_secs + cached.setup_secs);
+        }
+    }
+    std::remove(path.c_str());
+    std::remove(cache_path.c_str());
+
+    auto parse_secs = median(parse);
+    std::cout << count << " objects, " << bytes / 1000 << " kB, median of " << runs << " runs:\n"
+              << "  read    " << median(read) << "s\n"
+              << "  parse   " << parse_secs << "s (" << bytes / parse_secs / 1e6 << " MB/s)\n"
+              << "  build   " << median(build) << "s\n"
+              << "  direct  " << median(direct) << "s (the same objects built with make_shared)\n"
+              << "  total   " << median(read) + parse_secs + median(build) << "s from the scene file\n"
+              << "  cold    " << median(cold) << "s through a missing cache: compile, write and map it\n"
+              << "  warm    " << median(warm) << "s through the cache: hash the scene file, then map the cache ("
+              << median(warm_map) << "s)\n";
+    return 0;
+}
@@ -0,0 +1,988 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "constant_medium.h"
+#include "example.h"
+#include "external/log.h"
+#include "external/params.h"
+#include "quad.h"
+#include "scene_file.h"
+#include "sphere.h"
+#include "stats.h"
+#include "texture_cache.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Scene cache file (.rtsc) layout, all fields little-endian and every section 8-byte aligned:
+//
+//   cache_header                    magic "RTS1", version, hash of the scene file, the camera
+//                                   settings it makes and where each section below starts
+//   cache_texture[textures]         checker halves before their checker
+//   cache_material[materials]
+//   cache_medium[media]             constant media, each with the root node of its boundary, and
+//                                   grid media, voxelized again at load
+//   cache_primitive[primitives]     spheres, quads and media in world space: box sides and
+//                                   rotate_y/translate are baked in, and each BVH leaf is a range
+//   cache_node[nodes]               flattened BVHs, the world's and one per medium boundary
+//   cache_primitive[lights]         the light list, numbered by the object they came from
+//   char strings[]                  image texture paths, each NUL-terminated
+//
+// The file holds no pointers, so it is used where it is mapped: rays traverse the nodes and
+// primitives in place, once a pass over their indices has found them all in range. Only
+// textures, materials, media and lights, a handful of objects even in large scenes, are created
+// at load. Camera settings the scene file leaves out still come from parameters.txt, and image
+// textures are read from their paths, so neither is part of the hash.
+
+const uint32_t cache_version = 3;
+const uint32_t cache_none = 0xffffffff;
+
+struct cache_texture
+{
+    enum kind_t : uint32_t
+    {
+        solid_kind,
+        checker_kind,
+        image_kind,
+        noise_kind
+    };
+
+    uint32_t kind;
+    uint32_t even, odd; // Checker halves, as texture indices
+    uint32_t path;      // Image file, as offset into the strings
+    double scale;       // Checker or noise scale
+    double color[3];    // Solid color
+};
+
+struct cache_material
+{
+    uint32_t kind;    // scene_material_kind
+    uint32_t texture; // Texture index, or cache_none to use color
+    double color[3];  // Albedo or emission
+    double value;     // Metal fuzz or dielectric index of refraction
+};
+
+struct cache_medium
+{
+    uint32_t boundary;      // Root node of the boundary's BVH, or cache_none for a grid medium
+    uint32_t texture;       // Texture index, or cache_none to use albedo
+    double density;
+    double albedo[3];
+    uint32_t resolution[4]; // A grid medium's voxels along x, y and z (and padding)
+    double min[3], max[3];  // Its bounds in its own coordinates,
+    double noise_scale;     // its density noise (see scene_grid_density),
+    double turn[2];         // and the cosine and sine of its rotation around y, then its offset
+    double offset[3];
+};
+
+struct cache_primitive
+{
+    enum kind_t : uint32_t
+    {
+        sphere_kind,
+        quad_kind,
+        medium_kind
+    };
+
+    uint32_t kind;
+    uint32_t index;   // Material, medium for medium_kind, or the object number of a light
+    double origin[3]; // Sphere center at time 0, or quad corner Q
+    double edge1[3];  // Sphere motion over the exposure, or quad u
+    double edge2[3];  // Quad v
+    double normal[3]; // Quad unit normal
+    double w[3];      // Quad n / (n . n)
+    double plane;     // Quad D
+    double size;      // Sphere radius or quad area
+    double turn[2];   // Cosine and sine of the sphere's rotation around y, for its texture
+};
+
+struct cache_node
+{
+    double min[3], max[3];
+    uint32_t first; // First primitive of a leaf; of an interior node its second child (the first follows it)
+    uint32_t count; // Primitives of a leaf, 0 for interior nodes
+};
+
+struct cache_section
+{
+    uint64_t offset; // From the start of the file
+    uint64_t count;  // Of records, or bytes for the strings
+};
+
+struct cache_header
+{
+    char magic[4];
+    uint32_t version;        // cache_version
+    uint64_t source_hash;    // FNV-1a of the scene file
+    uint64_t source_size;    // Bytes of the scene file
+    uint32_t default_lights; // The scene file has no light list, so the example scenes' is used
+    uint32_t world_root;     // Root node of the world, cache_none for an empty world
+    scene_camera_settings camera;
+    cache_section textures, materials, media, primitives, nodes, lights, strings;
+};
+
+static_assert(sizeof(cache_texture) % 8 == 0 && sizeof(cache_material) % 8 == 0 && sizeof(cache_medium) % 8 == 0 &&
+                  sizeof(cache_primitive) % 8 == 0 && sizeof(cache_node) % 8 == 0 && sizeof(cache_header) % 8 == 0,
+              "cache records keep the sections 8-byte aligned");
+
+inline uint64_t source_hash(std::string_view text)
+{
+    // 64-bit FNV-1a over the scene file.
+    uint64_t h = 14695981039346656037ull;
+    for (auto c : text)
+    {
+        h ^= static_cast<unsigned char>(c);
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+class scene_compiler
+{
+  public:
+    // Turns the text of a scene file into the bytes of its cache file.
+    bool compile(const std::string &path, const std::string &text, std::vector<char> &out)
+    {
+        scene_walker<scene_compiler> walker(*this);
+        std::pmr::monotonic_buffer_resource arena(text.size() * 2);
+        json_value root(&arena);
+        if (!walker.parse(path, text, root, &arena))
+            return false;
+
+        header = cache_header();
+        std::memcpy(header.magic, "RTS1", 4);
+        header.version = cache_version;
+        header.source_hash = source_hash(text);
+        header.source_size = text.size();
+        header.world_root = cache_none;
+        header.default_lights = 1;
+        if (!walker.walk(root))
+            return false;
+
+        write(out);
+        return true;
+    }
+
+  private:
+    friend class scene_walker<scene_compiler>;
+
+    struct built_primitive
+    {
+        cache_primitive prim;
+        aabb box;
+        size_t order; // Position in the scene file, to break ties
+    };
+
+    using texture_ref = uint32_t;
+    using material_ref = uint32_t;
+    using object_list = std::vector<built_primitive>;
+    static const bool lights_hold_media = false;
+
+    cache_header header;
+    std::vector<cache_texture> textures;
+    std::vector<cache_material> materials;
+    std::vector<cache_medium> media;
+    std::vector<cache_primitive> primitives, lights;
+    std::vector<cache_node> nodes;
+    std::string strings;
+    uint32_t light_objects = 0;
+
+    static void store(double *out, const vec3 &v)
+    {
+        out[0] = v.x();
+        out[1] = v.y();
+        out[2] = v.z();
+    }
+
+    static bool empty(const object_list &list)
+    {
+        return list.empty();
+    }
+
+    void set_camera(const scene_camera_settings &settings)
+    {
+        header.camera = settings;
+    }
+
+    void set_world(object_list &world)
+    {
+        header.world_root = world.empty() ? cache_none : build_tree(world);
+    }
+
+    void add_light(const object_list &parts)
+    {
+        // Lights are numbered by their object, so a box stays one light.
+        header.default_lights = 0;
+        for (auto part : parts)
+        {
+            part.prim.index = light_objects;
+            lights.push_back(part.prim);
+        }
+        light_objects++;
+    }
+
+    void default_lights()
+    {
+        header.default_lights = 1;
+    }
+
+    uint32_t add_texture(const cache_texture &t)
+    {
+        textures.push_back(t);
+        return static_cast<uint32_t>(textures.size() - 1);
+    }
+
+    uint32_t make_solid(const color &c)
+    {
+        cache_texture t = {};
+        t.kind = cache_texture::solid_kind;
+        store(t.color, c);
+        return add_texture(t);
+    }
+
+    uint32_t make_checker(double scale, uint32_t even, uint32_t odd)
+    {
+        cache_texture t = {};
+        t.kind = cache_texture::checker_kind;
+        t.scale = scale;
+        t.even = even;
+        t.odd = odd;
+        return add_texture(t);
+    }
+
+    uint32_t make_image(std::string_view file)
+    {
+        cache_texture t = {};
+        t.kind = cache_texture::image_kind;
+        t.path = static_cast<uint32_t>(strings.size());
+        strings.append(file);
+        strings.push_back('\0');
+        return add_texture(t);
+    }
+
+    uint32_t make_noise(double scale)
+    {
+        cache_texture t = {};
+        t.kind = cache_texture::noise_kind;
+        t.scale = scale;
+        return add_texture(t);
+    }
+
+    uint32_t make_material(scene_material_kind kind, const uint32_t *tex, const color &albedo, double value)
+    {
+        cache_material m = {};
+        m.kind = kind;
+        m.texture = tex ? *tex : cache_none;
+        store(m.color, albedo);
+        m.value = value;
+        materials.push_back(m);
+        return static_cast<uint32_t>(materials.size() - 1);
+    }
+
+    void add_sphere(object_list &out, const scene_placement &place, const point3 &center, const point3 *center2,
+                    double radius, uint32_t mat)
+    {
+        auto start = place.apply(center), end = place.apply(center2 ? *center2 : center);
+        built_primitive p = {};
+        p.prim.kind = cache_primitive::sphere_kind;
+        p.prim.index = mat;
+        store(p.prim.origin, start);
+        store(p.prim.edge1, end - start);
+        p.prim.size = radius;
+        p.prim.turn[0] = place.cos_theta;
+        p.prim.turn[1] = place.sin_theta;
+        auto rvec = vec3(radius, radius, radius);
+        p.box = aabb(aabb(start - rvec, start + rvec), aabb(end - rvec, end + rvec));
+        out.push_back(p);
+    }
+
+    void add_quad(object_list &out, const scene_placement &place, const point3 &corner, const vec3 &side1,
+                  const vec3 &side2, uint32_t mat)
+    {
+        // The same plane terms the quad constructor computes.
+        auto q = place.apply(corner);
+        auto u = place.turn(side1), v = place.turn(side2);
+        built_primitive p = {};
+        p.prim.kind = cache_primitive::quad_kind;
+        p.prim.index = mat;
+        auto n = cross(u, v);
+        auto normal = unit_vector(n);
+        store(p.prim.origin, q);
+        store(p.prim.edge1, u);
+        store(p.prim.edge2, v);
+        store(p.prim.normal, normal);
+        store(p.prim.w, n / dot(n, n));
+        p.prim.plane = dot(normal, q);
+        p.prim.size = n.length();
+        p.box = aabb(aabb(q, q + u + v), aabb(q + u, q + v)).pad();
+        out.push_back(p);
+    }
+
+    void add_box(object_list &out, const scene_placement &place, const point3 &a, const point3 &b, uint32_t mat)
+    {
+        for (const auto &side : box_sides(a, b))
+            add_quad(out, place, side.Q, side.u, side.v, mat);
+    }
+
+    void add_medium(object_list &out, object_list &boundary, double density, const uint32_t *tex,
+                    const color &albedo)
+    {
+        cache_medium medium = {};
+        medium.texture = tex ? *tex : cache_none;
+        medium.density = density;
+        if (!tex)
+            store(medium.albedo, albedo);
+        medium.boundary = build_tree(boundary);
+
+        built_primitive p = {};
+        p.prim.kind = cache_primitive::medium_kind;
+        p.prim.index = static_cast<uint32_t>(media.size());
+        const auto &root = nodes[medium.boundary];
+        p.box = aabb(point3(root.min[0], root.min[1], root.min[2]), point3(root.max[0], root.max[1], root.max[2]));
+        media.push_back(medium);
+        out.push_back(p);
+    }
+
+    void add_grid_medium(object_list &out, const scene_placement &place, const aabb &bounds, const int *resolution,
+                         double density, double noise_scale, const uint32_t *tex, const color &albedo)
+    {
+        // The grid is voxelized at load, in its own coordinates, and placed by wrappers.
+        cache_medium medium = {};
+        medium.boundary = cache_none;
+        medium.texture = tex ? *tex : cache_none;
+        medium.density = density;
+        if (!tex)
+            store(medium.albedo, albedo);
+        for (int a = 0; a < 3; a++)
+        {
+            medium.resolution[a] = static_cast<uint32_t>(resolution[a]);
+            medium.min[a] = bounds.axis(a).min;
+            medium.max[a] = bounds.axis(a).max;
+        }
+        medium.noise_scale = noise_scale;
+        medium.turn[0] = place.cos_theta;
+        medium.turn[1] = place.sin_theta;
+        store(medium.offset, place.offset);
+
+        built_primitive p = {};
+        p.prim.kind = cache_primitive::medium_kind;
+        p.prim.index = static_cast<uint32_t>(media.size());
+        for (int corner = 0; corner < 8; corner++)
+        {
+            auto c = point3(corner & 1 ? medium.max[0] : medium.min[0], corner & 2 ? medium.max[1] : medium.min[1],
+                            corner & 4 ? medium.max[2] : medium.min[2]);
+            auto q = place.apply(c);
+            p.box = aabb(p.box, aabb(q, q));
+        }
+        media.push_back(medium);
+        out.push_back(p);
+    }
+
+    void add_bvh(object_list &out, const object_list &children)
+    {
+        // Nested BVHs dissolve into the one the cache builds over the whole tree.
+        out.insert(out.end(), children.begin(), children.end());
+    }
+
+    void wrap(object_list &, const double *, const vec3 *)
+    {
+        // The placement is already baked into the primitives.
+    }
+
+    uint32_t build_tree(std::vector<built_primitive> &tree)
+    {
+        // Primitives keep their file order wherever the split can't tell them apart, so of two
+        // coincident surfaces the first in the file is hit first and wins, as in the scene files.
+        for (size_t i = 0; i < tree.size(); i++)
+            tree[i].order = i;
+        return build_node(tree, 0, tree.size());
+    }
+
+    uint32_t build_node(std::vector<built_primitive> &tree, size_t start, size_t end)
+    {
+        // Splits at the median of the primitive centers along their longest axis, which
+        // unlike bvh_node's random axis is deterministic, so a cache is a pure function of
+        // its scene file.
+        const size_t leaf_size = 4;
+        auto index = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+
+        aabb box, centers;
+        for (size_t i = start; i < end; i++)
+        {
+            box = aabb(box, tree[i].box);
+            auto c = point3((tree[i].box.x.min + tree[i].box.x.max) / 2, (tree[i].box.y.min + tree[i].box.y.max) / 2,
+                            (tree[i].box.z.min + tree[i].box.z.max) / 2);
+            centers = aabb(centers, aabb(c, c));
+        }
+
+        cache_node node = {};
+        for (int a = 0; a < 3; a++)
+        {
+            node.min[a] = box.axis(a).min;
+            node.max[a] = box.axis(a).max;
+        }
+
+        if (end - start <= leaf_size)
+        {
+            std::sort(tree.begin() + start, tree.begin() + end,
+                      [](const built_primitive &a, const built_primitive &b) { return a.order < b.order; });
+            node.first = static_cast<uint32_t>(primitives.size());
+            node.count = static_cast<uint32_t>(end - start);
+            for (size_t i = start; i < end; i++)
+                primitives.push_back(tree[i].prim);
+            nodes[index] = node;
+            return index;
+        }
+
+        int axis = 0;
+        for (int a = 1; a < 3; a++)
+            if (centers.axis(a).size() > centers.axis(axis).size())
+                axis = a;
+        auto mid = start + (end - start) / 2;
+        std::nth_element(tree.begin() + start, tree.begin() + mid, tree.begin() + end,
+                         [axis](const built_primitive &a, const built_primitive &b) {
+                             auto ca = a.box.axis(axis).min + a.box.axis(axis).max;
+                             auto cb = b.box.axis(axis).min + b.box.axis(axis).max;
+                             return ca < cb || (ca == cb && a.order < b.order);
+                         });
+
+        build_node(tree, start, mid);
+        node.first = build_node(tree, mid, end);
+        nodes[index] = node;
+        return index;
+    }
+
+    template <typename T> void append(std::vector<char> &out, cache_section &section, const T *data, size_t count)
+    {
+        section.offset = out.size();
+        section.count = count;
+        auto bytes = reinterpret_cast<const char *>(data);
+        out.insert(out.end(), bytes, bytes + count * sizeof(T));
+        out.resize((out.size() + 7) / 8 * 8);
+    }
+
+    void write(std::vector<char> &out)
+    {
+        out.assign(sizeof(cache_header), 0);
+        append(out, header.textures, textures.data(), textures.size());
+        append(out, header.materials, materials.data(), materials.size());
+        append(out, header.media, media.data(), media.size());
+        append(out, header.primitives, primitives.data(), primitives.size());
+        append(out, header.nodes, nodes.data(), nodes.size());
+        append(out, header.lights, lights.data(), lights.size());
+        append(out, header.strings, strings.data(), strings.size());
+        std::memcpy(out.data(), &header, sizeof(header));
+    }
+};
+
+class scene_cache
+{
+  public:
+    // A cache file in memory: the sections where they are mapped, plus the textures, materials
+    // and media their records describe.
+    const cache_header *header = nullptr;
+    const cache_texture *textures = nullptr;
+    const cache_material *cache_materials = nullptr;
+    const cache_medium *cache_media = nullptr;
+    const cache_primitive *primitives = nullptr;
+    const cache_node *nodes = nullptr;
+    const cache_primitive *lights = nullptr;
+    const char *strings = nullptr;
+
+    std::vector<shared_ptr<material>> materials;
+    std::vector<shared_ptr<hittable>> media;
+
+    bool map(const std::string &path)
+    {
+        release();
+        mapping = std::make_unique<mapped_file>(path);
+        bytes = reinterpret_cast<const char *>(mapping->bytes());
+        length = mapping->length();
+        return bytes != nullptr;
+    }
+
+    void hold(std::vector<char> data)
+    {
+        // Uses data instead of a mapped file, for when the cache couldn't be written.
+        release();
+        held = std::move(data);
+        bytes = held.data();
+        length = held.size();
+    }
+
+    void release()
+    {
+        mapping.reset();
+        held.clear();
+        bytes = nullptr;
+        length = 0;
+    }
+
+    bool open(uint64_t hash, uint64_t size)
+    {
+        // Points the sections into file, or returns false if it isn't a complete cache of a
+        // scene file with this hash and size.
+        if (length < sizeof(cache_header))
+            return false;
+        header = reinterpret_cast<const cache_header *>(bytes);
+        if (std::memcmp(header->magic, "RTS1", 4) != 0 || header->version != cache_version ||
+            header->source_hash != hash || header->source_size != size)
+            return false;
+
+        bool fits = section(header->textures, textures) && section(header->materials, cache_materials) &&
+                    section(header->media, cache_media) && section(header->primitives, primitives) &&
+                    section(header->nodes, nodes) && section(header->lights, lights) &&
+                    section(header->strings, strings);
+        return fits && (header->world_root == cache_none || header->world_root < header->nodes.count) &&
+               check_records();
+    }
+
+    bool hit(uint32_t root, const ray &r, interval ray_t, hit_record &rec) const
+    {
+        // Walks the BVH at root in the same order as bvh_node: the first child, then the second
+        // up to the closest hit so far. open() has checked that no BVH is deeper than the stack.
+        uint32_t stack[max_depth];
+        int depth = 0;
+        uint32_t index = root;
+        bool hit_anything = false;
+        for (;;)
+        {
+            const auto &node = nodes[index];
+            RTW_COUNT(bvh_nodes);
+            if (hit_box(node, r, ray_t))
+            {
+                if (node.count == 0)
+                {
+                    stack[depth++] = node.first;
+                    index++;
+                    continue;
+                }
+                for (uint32_t i = node.first; i < node.first + node.count; i++)
+                {
+                    if (hit_primitive(i, r, ray_t, rec))
+                    {
+                        hit_anything = true;
+                        ray_t.max = rec.t;
+                    }
+                }
+            }
+            if (depth == 0)
+                return hit_anything;
+            index = stack[--depth];
+        }
+    }
+
+    aabb bounds(uint32_t root) const
+    {
+        const auto &node = nodes[root];
+        return aabb(point3(node.min[0], node.min[1], node.min[2]), point3(node.max[0], node.max[1], node.max[2]));
+    }
+
+  private:
+    static const int max_depth = 64; // Interior nodes on any path from a root, and so the traversal stack
+
+    std::unique_ptr<mapped_file> mapping;
+    std::vector<char> held;
+    const char *bytes = nullptr;
+    size_t length = 0;
+
+    template <typename T> bool section(const cache_section &s, const T *&out)
+    {
+        if (s.offset % 8 != 0 || s.offset > length || s.count > (length - s.offset) / sizeof(T))
+            return false;
+        out = reinterpret_cast<const T *>(bytes + s.offset);
+        return true;
+    }
+
+    bool check_records() const
+    {
+        // One pass over the indices that rays follow without checking: the primitives of each
+        // leaf, the children of each interior node, which come after it, and the material or
+        // medium of each primitive. A damaged file then fails here instead of sending a ray
+        // outside the mapping.
+        const auto &h = *header;
+        for (uint64_t i = 0; i < h.primitives.count; i++)
+        {
+            const auto &p = primitives[i];
+            auto records = p.kind == cache_primitive::medium_kind ? h.media.count : h.materials.count;
+            if (p.kind > cache_primitive::medium_kind || p.index >= records)
+                return false;
+        }
+        for (uint64_t i = 0; i < h.lights.count; i++)
+            if (lights[i].kind > cache_primitive::quad_kind)
+                return false;
+
+        // Children come after their parents, so one pass in file order finds every node's depth.
+        std::vector<unsigned char> depths(h.nodes.count, 0);
+        for (uint64_t i = 0; i < h.nodes.count; i++)
+        {
+            const auto &node = nodes[i];
+            if (node.count > 0)
+            {
+                if (node.first > h.primitives.count || node.count > h.primitives.count - node.first)
+                    return false;
+                continue;
+            }
+            if (node.first <= i + 1 || node.first >= h.nodes.count || depths[i] + 1 >= max_depth)
+                return false;
+            auto depth = static_cast<unsigned char>(depths[i] + 1);
+            depths[i + 1] = std::max(depths[i + 1], depth);
+            depths[node.first] = std::max(depths[node.first], depth);
+        }
+        return h.strings.count == 0 || strings[h.strings.count - 1] == '\0';
+    }
+
+    static bool hit_box(const cache_node &node, const ray &r, interval ray_t)
+    {
+        for (int a = 0; a < 3; a++)
+            if (!aabb::clip_slab(node.min[a], node.max[a], r.origin()[a], r.direction()[a], ray_t))
+                return false;
+        return true;
+    }
+
+    bool hit_primitive(uint32_t i, const ray &r, interval ray_t, hit_record &rec) const
+    {
+        const auto &p = primitives[i];
+        if (p.kind == cache_primitive::medium_kind)
+            return media[p.index]->hit(r, ray_t, rec);
+
+        if (p.kind == cache_primitive::sphere_kind)
+        {
+            RTW_COUNT(sphere_tests);
+            point3 center = point3(p.origin[0], p.origin[1], p.origin[2]) +
+                            r.time() * vec3(p.edge1[0], p.edge1[1], p.edge1[2]);
+            vec3 n;
+            if (!sphere::intersect(center, p.size, r, ray_t, rec, n))
+                return false;
+
+            // Texture coordinates come from the normal before the sphere was turned.
+            auto unturned = vec3(p.turn[0] * n.x() - p.turn[1] * n.z(), n.y(), p.turn[1] * n.x() + p.turn[0] * n.z());
+            sphere::get_sphere_uv(unturned, rec.u, rec.v);
+            rec.uv_scale = 1 / (2 * pi * p.size);
+        }
+        else
+        {
+            RTW_COUNT(quad_tests);
+            auto normal = vec3(p.normal[0], p.normal[1], p.normal[2]);
+            double t, alpha, beta;
+            point3 intersection;
+            if (!quad::intersect(point3(p.origin[0], p.origin[1], p.origin[2]), vec3(p.edge1[0], p.edge1[1], p.edge1[2]),
+                                 vec3(p.edge2[0], p.edge2[1], p.edge2[2]), normal, p.plane,
+                                 vec3(p.w[0], p.w[1], p.w[2]), r, ray_t, t, intersection, alpha, beta) ||
+                !quad::in_unit_square(alpha, beta, rec))
+                return false;
+
+            rec.t = t;
+            rec.p = intersection;
+            rec.uv_scale = 1 / sqrt(p.size);
+            rec.set_face_normal(r, normal);
+        }
+        rec.mat = materials[p.index].get();
+        rec.prim_id = static_cast<int>(i); // Index in the cache, not a hittable::id
+        return true;
+    }
+};
+
+class cache_bvh : public hittable
+{
+  public:
+    // One of the BVHs in a scene cache. The world's keeps the cache alive; a medium's boundary
+    // is owned by the cache and only points back to it.
+    cache_bvh(shared_ptr<const scene_cache> _owner, const scene_cache *_cache, uint32_t _root)
+        : owner(_owner), cache(_cache), root(_root), bbox(_cache->bounds(_root))
+    {
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        return cache->hit(root, r, ray_t, rec);
+    }
+
+    aabb bounding_box() const override
+    {
+        return bbox;
+    }
+
+  private:
+    shared_ptr<const scene_cache> owner;
+    const scene_cache *cache;
+    uint32_t root;
+    aabb bbox;
+};
+
+class scene_cache_loader
+{
+  public:
+    bool rebuilt = false;    // The cache was missing or stale and was compiled from the scene file
+    double read_secs = 0;    // Time spent reading and hashing the scene file,
+    double map_secs = 0;     // mapping and checking the cache file,
+    double compile_secs = 0; // compiling, writing and mapping it again if it was rebuilt,
+    double setup_secs = 0;   // and creating the textures, materials, media, lights and camera
+    size_t primitives = 0;
+    size_t nodes = 0;
+
+    bool load(const std::string &path, const std::string &cache_path, const RenderParameters &params, scene &out)
+    {
+        // Renders of the scene in path use the cache at cache_path, which is compiled (again)
+        // first if it doesn't belong to the file's current contents.
+        auto start = std::chrono::steady_clock::now();
+        std::string text;
+        {
+            std::ifstream file(path, std::ios::binary);
+            if (!file.is_open())
+            {
+                std::cerr << "ERROR: Could not open scene '" << path << "'.\n";
+                return false;
+            }
+            text.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        }
+        auto hash = source_hash(text);
+        auto map_start = std::chrono::steady_clock::now();
+
+        auto cache = make_shared<scene_cache>();
+        rebuilt = !(cache->map(cache_path) && cache->open(hash, text.size()));
+        auto compile_start = std::chrono::steady_clock::now();
+        if (rebuilt)
+        {
+            std::vector<char> bytes;
+            scene_compiler compiler;
+            if (!compiler.compile(path, text, bytes))
+                return false;
+            cache->release();
+            if (!(write_cache(cache_path, bytes) && cache->map(cache_path)))
+                cache->hold(std::move(bytes));
+            if (!cache->open(hash, text.size()))
+                return false;
+        }
+        auto setup_start = std::chrono::steady_clock::now();
+
+        if (!instantiate(cache, params, out))
+            return false;
+        primitives = cache->header->primitives.count;
+        nodes = cache->header->nodes.count;
+
+        auto done = std::chrono::steady_clock::now();
+        read_secs = std::chrono::duration<double>(map_start - start).count();
+        map_secs = std::chrono::duration<double>(compile_start - map_start).count();
+        compile_secs = std::chrono::duration<double>(setup_start - compile_start).count();
+        setup_secs = std::chrono::duration<double>(done - setup_start).count();
+        return true;
+    }
+
+  private:
+    static bool write_cache(const std::string &path, const std::vector<char> &bytes)
+    {
+        // Writes to a temporary file that then replaces path, so other renders never map a
+        // partly written cache.
+        auto temporary = path + ".tmp";
+        {
+            std::ofstream file(temporary, std::ios::binary);
+            file.write(bytes.data(), bytes.size());
+            if (!file)
+            {
+                std::cerr << "WARNING: Could not write the scene cache '" << temporary << "'.\n";
+                return false;
+            }
+        }
+#ifdef _WIN32
+        std::remove(path.c_str()); // rename() doesn't replace existing files here
+#endif
+        if (std::rename(temporary.c_str(), path.c_str()) != 0)
+        {
+            std::cerr << "WARNING: Could not replace the scene cache '" << path << "'.\n";
+            return false;
+        }
+        return true;
+    }
+
+    static bool instantiate(const shared_ptr<scene_cache> &cache, const RenderParameters &params, scene &out)
+    {
+        const auto &h = *cache->header;
+        auto vec = [](const double *v) { return vec3(v[0], v[1], v[2]); };
+
+        std::vector<shared_ptr<texture>> textures;
+        for (uint64_t i = 0; i < h.textures.count; i++)
+        {
+            const auto &t = cache->textures[i];
+            if (t.kind == cache_texture::checker_kind && (t.even >= i || t.odd >= i))
+                return corrupt();
+            if (t.kind == cache_texture::solid_kind)
+                textures.push_back(make_shared<solid_color>(vec(t.color)));
+            else if (t.kind == cache_texture::checker_kind)
+                textures.push_back(make_shared<checker_texture>(t.scale, textures[t.even], textures[t.odd]));
+            else if (t.kind == cache_texture::image_kind && t.path < h.strings.count &&
+                     is_tiled_texture_file(cache->strings + t.path))
+                textures.push_back(make_shared<tiled_image_texture>(cache->strings + t.path));
+            else if (t.kind == cache_texture::image_kind && t.path < h.strings.count)
+                textures.push_back(make_shared<image_texture>(cache->strings + t.path));
+            else if (t.kind == cache_texture::noise_kind)
+                textures.push_back(make_shared<noise_texture>(t.scale));
+            else
+                return corrupt();
+        }
+
+        for (uint64_t i = 0; i < h.materials.count; i++)
+        {
+            const auto &m = cache->cache_materials[i];
+            if (m.texture != cache_none && m.texture >= textures.size())
+                return corrupt();
+            auto tex = m.texture != cache_none ? textures[m.texture] : nullptr;
+            shared_ptr<material> mat;
+            if (m.kind == lambertian_material)
+                mat = tex ? make_shared<lambertian>(tex) : make_shared<lambertian>(vec(m.color));
+            else if (m.kind == metal_material)
+                mat = make_shared<metal>(vec(m.color), m.value);
+            else if (m.kind == dielectric_material)
+                mat = make_shared<dielectric>(m.value);
+            else if (m.kind == diffuse_light_material)
+                mat = tex ? make_shared<diffuse_light>(tex) : make_shared<diffuse_light>(vec(m.color));
+            else if (m.kind == isotropic_material)
+                mat = tex ? make_shared<isotropic>(tex) : make_shared<isotropic>(vec(m.color));
+            else
+                return corrupt();
+            cache->materials.push_back(mat);
+        }
+
+        for (uint64_t i = 0; i < h.media.count; i++)
+        {
+            const auto &m = cache->cache_media[i];
+            if (m.texture != cache_none && m.texture >= textures.size())
+                return corrupt();
+            if (m.boundary == cache_none)
+            {
+                if (!make_grid_medium(m, m.texture != cache_none ? textures[m.texture] : nullptr, cache->media))
+                    return corrupt();
+                continue;
+            }
+            if (m.boundary >= h.nodes.count)
+                return corrupt();
+            auto boundary = make_shared<cache_bvh>(nullptr, cache.get(), m.boundary);
+            if (m.texture != cache_none)
+                cache->media.push_back(make_shared<constant_medium>(boundary, m.density, textures[m.texture]));
+            else
+                cache->media.push_back(make_shared<constant_medium>(boundary, m.density, vec(m.albedo)));
+        }
+
+        hittable_list world;
+        if (h.world_root != cache_none)
+            world.add(make_shared<cache_bvh>(cache, cache.get(), h.world_root));
+
+        // Lights are ordinary objects: sampling them needs pdf_value and random.
+        hittable_list lights = get_ligths();
+        if (!h.default_lights)
+        {
+            lights.clear();
+            shared_ptr<hittable_list> group;
+            for (uint64_t i = 0; i < h.lights.count; i++)
+            {
+                const auto &p = cache->lights[i];
+                shared_ptr<hittable> light;
+                if (p.kind == cache_primitive::sphere_kind)
+                {
+                    auto center = vec(p.origin), motion = vec(p.edge1);
+                    light = motion.near_zero() ? make_shared<sphere>(center, p.size, nullptr)
+                                               : make_shared<sphere>(center, center + motion, p.size, nullptr);
+                }
+                else
+                    light = make_shared<quad>(vec(p.origin), vec(p.edge1), vec(p.edge2), nullptr);
+
+                // A light made of several primitives, like a box, stays one object.
+                bool alone = (i == 0 || cache->lights[i - 1].index != p.index) &&
+                             (i + 1 == h.lights.count || cache->lights[i + 1].index != p.index);
+                if (alone)
+                    lights.add(light);
+                else
+                {
+                    if (i == 0 || cache->lights[i - 1].index != p.index)
+                    {
+                        group = make_shared<hittable_list>();
+                        lights.add(group);
+                    }
+                    group->add(light);
+                }
+            }
+        }
+
+        const auto &settings = h.camera;
+        shared_ptr<atmosphere> medium;
+        if (settings.has_medium)
+            medium = make_shared<atmosphere>(settings.medium_density, vec(settings.medium_albedo),
+                                             vec(settings.medium_center), settings.medium_radius);
+        camera cam = scene_camera(settings, medium, params);
+
+        out = {world, lights, cam};
+        return true;
+    }
+
+    static bool make_grid_medium(const cache_medium &m, const shared_ptr<texture> &tex,
+                                 std::vector<shared_ptr<hittable>> &media)
+    {
+        // Voxelizes a grid medium record again and places it; false if the record is damaged.
+        for (int a = 0; a < 3; a++)
+            if (m.resolution[a] < 1 || m.resolution[a] > static_cast<uint32_t>(scene_grid_max_resolution) ||
+                !(m.min[a] < m.max[a]))
+                return false;
+        auto bounds = aabb(point3(m.min[0], m.min[1], m.min[2]), point3(m.max[0], m.max[1], m.max[2]));
+        int nx = m.resolution[0], ny = m.resolution[1], nz = m.resolution[2];
+        auto grid = make_shared<density_grid>(bounds, nx, ny, nz, scene_grid_density(m.density, m.noise_scale));
+        shared_ptr<hittable> medium;
+        if (tex)
+            medium = make_shared<grid_medium>(grid, tex);
+        else
+            medium = make_shared<grid_medium>(grid, color(m.albedo[0], m.albedo[1], m.albedo[2]));
+        if (m.turn[0] != 1 || m.turn[1] != 0)
+            medium = make_shared<rotate_y>(medium, atan2(m.turn[1], m.turn[0]) * 180 / pi);
+        if (m.offset[0] != 0 || m.offset[1] != 0 || m.offset[2] != 0)
+            medium = make_shared<translate>(medium, vec3(m.offset[0], m.offset[1], m.offset[2]));
+        media.push_back(medium);
+        return true;
+    }
+
+    static bool corrupt()
+    {
+        std::cerr << "ERROR: The scene cache is corrupt; delete it to rebuild it.\n";
+        return false;
+    }
+};
+
+inline bool load_cached_scene(const std::string &path, const std::string &cache_path, const RenderParameters &params,
+                              scene &out)
+{
+    scene_cache_loader loader;
+    if (!loader.load(path, cache_path, params, out))
+        return false;
+    LOG(INFO) << "SCENE " << path << " FROM CACHE " << cache_path << (loader.rebuilt ? " (REBUILT): " : ": ")
+              << loader.primitives << " PRIMITIVES, " << loader.nodes << " NODES, READ IN " << loader.read_secs
+              << "s, MAPPED IN " << loader.map_secs << "s, COMPILED IN " << loader.compile_secs << "s, SET UP IN "
+              << loader.setup_secs << "s";
+    return true;
+}
+
+inline bool load_scene(int choice, const RenderParameters &params, scene &out)
+{
+    // The scene file in params if there is one, through its cache if that is set too, else
+    // example scene number choice.
+    RTW_TRACE_ZONE("load_scene");
+    if (!params.scene_file.empty() && !params.scene_cache.empty())
+        return load_cached_scene(params.scene_file, params.scene_cache, params, out);
+    if (!params.scene_file.empty())
+        return load_scene_file(params.scene_file, params, out);
+    return build_scene(choice, params, out);
+}
+
+#endif
@@ -0,0 +1,1131 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "camera.h"
+#include "constant_medium.h"
+#include "example.h"
+#include "external/params.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "quad.h"
+#include "sphere.h"
+#include "texture.h"
+#include "texture_cache.h"
+#include "volume.h"
+
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Scene files are JSON (plus // comments). Every part is optional except the objects:
+//
+//   {
+//     "camera": {
+//       "lookfrom": [x, y, z], "lookat": [x, y, z], "vup": [x, y, z], "vfov": degrees,
+//       "aspect_ratio": r, "image_width": w, "samples_per_pixel": n, "max_depth": n,
+//       "defocus_angle": degrees, "focus_dist": d, "background": [r, g, b],
+//       "medium": {"density": d, "albedo": [r, g, b], "center": [x, y, z], "radius": r}
+//     },
+//     "textures": {"name": texture, ...},
+//     "materials": {"name": material, ...},
+//     "objects": [object, ...],
+//     "lights": [object, ...]
+//   }
+//
+// Camera fields that are missing come from parameters.txt, and a missing light list is the
+// default one of the example scenes. A camera medium fills the ball of its radius, so the
+// radius is required. Textures and materials are either the name of an entry
+// above or written in place:
+//
+//   texture   {"type": "solid", "color": [r, g, b]}
+//             {"type": "checker", "scale": s, "even": texture or [r, g, b], "odd": ...}
+//             {"type": "image", "file": "path"}                 a .rtt file is read tile by tile
+//             {"type": "noise", "scale": s}
+//   material  {"type": "lambertian", "albedo": [r, g, b]}   or "texture": texture
+//             {"type": "metal", "albedo": [r, g, b], "fuzz": f}
+//             {"type": "dielectric", "ir": index}
+//             {"type": "diffuse_light", "emit": [r, g, b]}  or "texture": texture
+//             {"type": "isotropic", "albedo": [r, g, b]}    or "texture": texture
+//   object    {"type": "sphere", "center": [x, y, z], "radius": r, "material": material}
+//                 with "center2": [x, y, z] for a sphere moving during the exposure
+//             {"type": "quad", "q": [x, y, z], "u": [x, y, z], "v": [x, y, z], "material": ...}
+//             {"type": "box", "a": [x, y, z], "b": [x, y, z], "material": ...}
+//             {"type": "constant_medium", "boundary": object, "density": d, "albedo": [r, g, b]}
+//             {"type": "grid_medium", "min": [x, y, z], "max": [x, y, z], "resolution": [nx, ny, nz],
+//              "density": d, "noise_scale": s, "albedo": [r, g, b]}
+//                 density d, or d * max(0, noise(s * p)) with a noise scale, sampled on the voxels
+//             {"type": "bvh", "objects": [object, ...]}
+//
+// Any object may also have "rotate_y": degrees and then "translate": [x, y, z]. Light objects
+// only steer sampling and have no material.
+
+struct json_member;
+
+struct json_value
+{
+    enum json_kind
+    {
+        null_kind,
+        bool_kind,
+        number_kind,
+        string_kind,
+        array_kind,
+        object_kind
+    };
+
+    json_kind kind = null_kind;
+    double number = 0;                     // number_kind, and 0 or 1 for bool_kind
+    std::string_view text;                 // string_kind
+    std::pmr::vector<json_value> items;    // array_kind
+    std::pmr::vector<json_member> members; // object_kind, in file order
+    int line = 0;                          // Where the value starts, for error messages
+
+    explicit json_value(std::pmr::memory_resource *arena);
+
+    const json_value *find(std::string_view key) const;
+};
+
+struct json_member
+{
+    std::string_view key;
+    json_value value;
+};
+
+inline json_value::json_value(std::pmr::memory_resource *arena) : items(arena), members(arena)
+{
+}
+
+inline const json_value *json_value::find(std::string_view key) const
+{
+    for (const auto &member : members)
+        if (member.key == key)
+            return &member.value;
+    return nullptr;
+}
+
+class json_parser
+{
+  public:
+    // Parses text into values allocated from arena. Strings without escapes point into text, so
+    // text has to outlive the values as well.
+    json_parser(std::string_view _text, std::pmr::memory_resource *_arena)
+        : pos(_text.data()), end(_text.data() + _text.size()), arena(_arena)
+    {
+    }
+
+    bool parse(json_value &root)
+    {
+        skip_space();
+        if (!value(root))
+            return false;
+        skip_space();
+        return pos == end || fail("unexpected text after the end");
+    }
+
+    std::string error; // Set when parse() fails
+    int error_line = 0;
+
+  private:
+    const char *pos;
+    const char *end;
+    std::pmr::memory_resource *arena;
+    int line = 1;
+
+    bool fail(const char *message)
+    {
+        error = message;
+        error_line = line;
+        return false;
+    }
+
+    void skip_space()
+    {
+        while (pos != end)
+        {
+            if (*pos == '\n')
+                line++;
+            else if (*pos == '/' && pos + 1 != end && pos[1] == '/')
+            {
+                while (pos != end && *pos != '\n')
+                    pos++;
+                continue;
+            }
+            else if (*pos != ' ' && *pos != '\t' && *pos != '\r')
+                return;
+            pos++;
+        }
+    }
+
+    bool value(json_value &out)
+    {
+        out.line = line;
+        if (pos == end)
+            return fail("unexpected end of file");
+        switch (*pos)
+        {
+        case '{':
+            return object(out);
+        case '[':
+            return array(out);
+        case '"':
+            out.kind = json_value::string_kind;
+            return string(out.text);
+        case 't':
+            return literal("true", json_value::bool_kind, 1, out);
+        case 'f':
+            return literal("false", json_value::bool_kind, 0, out);
+        case 'n':
+            return literal("null", json_value::null_kind, 0, out);
+        default: {
+            out.kind = json_value::number_kind;
+            auto result = std::from_chars(pos, end, out.number);
+            if (result.ec != std::errc())
+                return fail("expected a value");
+            pos = result.ptr;
+            return true;
+        }
+        }
+    }
+
+    bool literal(const char *word, json_value::json_kind kind, double number, json_value &out)
+    {
+        auto length = std::strlen(word);
+        if (static_cast<size_t>(end - pos) < length || std::memcmp(pos, word, length) != 0)
+            return fail("expected a value");
+        pos += length;
+        out.kind = kind;
+        out.number = number;
+        return true;
+    }
+
+    bool object(json_value &out)
+    {
+        out.kind = json_value::object_kind;
+        pos++;
+        skip_space();
+        if (pos != end && *pos == '}')
+        {
+            pos++;
+            return true;
+        }
+        for (;;)
+        {
+            skip_space();
+            std::string_view key;
+            if (pos == end || *pos != '"')
+                return fail("expected a member name");
+            if (!string(key))
+                return false;
+            skip_space();
+            if (pos == end || *pos != ':')
+                return fail("expected ':'");
+            pos++;
+            skip_space();
+            out.members.push_back({key, json_value(arena)});
+            if (!value(out.members.back().value))
+                return false;
+            skip_space();
+            if (pos != end && *pos == ',')
+                pos++;
+            else if (pos != end && *pos == '}')
+            {
+                pos++;
+                return true;
+            }
+            else
+                return fail("expected ',' or '}'");
+        }
+    }
+
+    bool array(json_value &out)
+    {
+        out.kind = json_value::array_kind;
+        pos++;
+        skip_space();
+        if (pos != end && *pos == ']')
+        {
+            pos++;
+            return true;
+        }
+        for (;;)
+        {
+            skip_space();
+            out.items.emplace_back(arena);
+            if (!value(out.items.back()))
+                return false;
+            skip_space();
+            if (pos != end && *pos == ',')
+                pos++;
+            else if (pos != end && *pos == ']')
+            {
+                pos++;
+                return true;
+            }
+            else
+                return fail("expected ',' or ']'");
+        }
+    }
+
+    bool string(std::string_view &out)
+    {
+        // Strings without escapes, which is nearly all of them, are views into the text.
+        auto start = ++pos;
+        while (pos != end && *pos != '"' && *pos != '\\' && *pos != '\n')
+            pos++;
+        if (pos != end && *pos == '"')
+        {
+            out = std::string_view(start, pos - start);
+            pos++;
+            return true;
+        }
+
+        std::string decoded(start, pos);
+        while (pos != end && *pos != '"' && *pos != '\n')
+        {
+            if (*pos != '\\')
+            {
+                decoded += *pos++;
+                continue;
+            }
+            if (++pos == end)
+                break;
+            switch (*pos++)
+            {
+            case '"':
+                decoded += '"';
+                break;
+            case '\\':
+                decoded += '\\';
+                break;
+            case '/':
+                decoded += '/';
+                break;
+            case 'n':
+                decoded += '\n';
+                break;
+            case 't':
+                decoded += '\t';
+                break;
+            default:
+                return fail("unsupported escape in string");
+            }
+        }
+        if (pos == end || *pos != '"')
+            return fail("unterminated string");
+        pos++;
+
+        auto copy = static_cast<char *>(arena->allocate(decoded.size(), 1));
+        std::memcpy(copy, decoded.data(), decoded.size());
+        out = std::string_view(copy, decoded.size());
+        return true;
+    }
+};
+
+template <typename T> class arena_allocator
+{
+    // Allocates from a shared monotonic arena and never frees. Every object allocated with it
+    // holds a copy, so the arena lives exactly as long as the last of those objects.
+  public:
+    using value_type = T;
+
+    shared_ptr<std::pmr::monotonic_buffer_resource> arena;
+
+    arena_allocator(shared_ptr<std::pmr::monotonic_buffer_resource> _arena) : arena(_arena)
+    {
+    }
+
+    template <typename U> arena_allocator(const arena_allocator<U> &other) : arena(other.arena)
+    {
+    }
+
+    T *allocate(size_t n)
+    {
+        return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *, size_t)
+    {
+    }
+
+    template <typename U> bool operator==(const arena_allocator<U> &other) const
+    {
+        return arena == other.arena;
+    }
+
+    template <typename U> bool operator!=(const arena_allocator<U> &other) const
+    {
+        return arena != other.arena;
+    }
+};
+
+class scene_reader
+{
+    // Reads and parses scene files and gives checked access to their values, reporting errors as
+    // file:line. The base of scene_walker.
+  protected:
+    std::string name;
+
+    bool read(const std::string &path, std::string &text)
+    {
+        name = path;
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open())
+        {
+            std::cerr << "ERROR: Could not open scene '" << path << "'.\n";
+            return false;
+        }
+        text.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        return true;
+    }
+
+    bool parse(std::string_view text, json_value &root, std::pmr::memory_resource *arena) const
+    {
+        json_parser parser(text, arena);
+        if (!parser.parse(root))
+        {
+            std::cerr << "ERROR: " << name << ':' << parser.error_line << ": " << parser.error << ".\n";
+            return false;
+        }
+        if (root.kind != json_value::object_kind)
+            return fail(root, "expected an object with the scene");
+        return true;
+    }
+
+    bool fail(const json_value &at, const std::string &message) const
+    {
+        std::cerr << "ERROR: " << name << ':' << at.line << ": " << message << ".\n";
+        return false;
+    }
+
+    bool number(const json_value &object, const char *key, double &out, bool required = true) const
+    {
+        auto v = object.find(key);
+        if (!v)
+            return !required || fail(object, std::string("missing \"") + key + '"');
+        if (v->kind != json_value::number_kind)
+            return fail(*v, std::string("\"") + key + "\" should be a number");
+        out = v->number;
+        return true;
+    }
+
+    bool triple(const json_value &object, const char *key, vec3 &out, bool required = true) const
+    {
+        auto v = object.find(key);
+        if (!v)
+            return !required || fail(object, std::string("missing \"") + key + '"');
+        return to_vec3(*v, key, out);
+    }
+
+    bool to_vec3(const json_value &v, const char *key, vec3 &out) const
+    {
+        if (v.kind != json_value::array_kind || v.items.size() != 3)
+            return fail(v, std::string("\"") + key + "\" should be an array of 3 numbers");
+        for (int i = 0; i < 3; i++)
+        {
+            if (v.items[i].kind != json_value::number_kind)
+                return fail(v, std::string("\"") + key + "\" should be an array of 3 numbers");
+            out[i] = v.items[i].number;
+        }
+        return true;
+    }
+
+    static std::string_view type_of(const json_value &v)
+    {
+        auto type = v.find("type");
+        return type && type->kind == json_value::string_kind ? type->text : std::string_view();
+    }
+};
+
+enum scene_material_kind : uint32_t
+{
+    lambertian_material,
+    metal_material,
+    dielectric_material,
+    diffuse_light_material,
+    isotropic_material
+};
+
+struct camera_field
+{
+    const char *key;
+    bool is_vector;
+};
+
+const camera_field camera_fields[11] = {
+    {"lookfrom", true},      {"lookat", true},       {"vup", true},           {"vfov", false},
+    {"aspect_ratio", false}, {"image_width", false}, {"samples_per_pixel", false},
+    {"max_depth", false},    {"defocus_angle", false}, {"focus_dist", false}, {"background", true},
+};
+
+struct scene_camera_settings
+{
+    // The camera settings of a scene file. Plain data, so scene caches store it as it is.
+    uint32_t set = 0;        // Bit i is set if the scene file sets camera_fields[i]
+    uint32_t has_medium = 0; // The scene file has a camera medium
+    double values[11][3] = {};
+    double medium_density = 0, medium_albedo[3] = {}, medium_center[3] = {}, medium_radius = 0;
+};
+
+inline camera scene_camera(const scene_camera_settings &settings, shared_ptr<atmosphere> medium,
+                           const RenderParameters &params)
+{
+    // The camera of parameters.txt with the fields settings has replaced, looking through medium.
+    camera cam = initialize_camera(params.lookfrom, params.lookat, params.vup, params.vfov, params.aspect_ratio,
+                                   params.image_width, params.samples_per_pixel, params.max_depth,
+                                   params.defocus_angle, params.focus_dist, params.c);
+    auto has = [&settings](int i) { return (settings.set >> i) & 1; };
+    auto value = [&settings](int i) { return vec3(settings.values[i][0], settings.values[i][1], settings.values[i][2]); };
+    if (has(0))
+        cam.lookfrom = value(0);
+    if (has(1))
+        cam.lookat = value(1);
+    if (has(2))
+        cam.vup = value(2);
+    if (has(3))
+        cam.vfov = settings.values[3][0];
+    if (has(4))
+        cam.aspect_ratio = settings.values[4][0];
+    if (has(5))
+        cam.image_width = static_cast<int>(settings.values[5][0]);
+    if (has(6))
+        cam.samples_per_pixel = static_cast<int>(settings.values[6][0]);
+    if (has(7))
+        cam.max_depth = static_cast<int>(settings.values[7][0]);
+    if (has(8))
+        cam.defocus_angle = settings.values[8][0];
+    if (has(9))
+        cam.focus_dist = settings.values[9][0];
+    if (has(10))
+        cam.background = value(10);
+    cam.medium = medium;
+    apply_render_options(cam, params);
+    return cam;
+}
+
+const int scene_grid_max_resolution = 256; // Voxels per axis of a grid_medium
+
+inline std::function<double(const point3 &)> scene_grid_density(double density, double noise_scale)
+{
+    // The density a grid_medium samples on its voxels, in its own coordinates.
+    if (noise_scale <= 0)
+        return [density](const point3 &) { return density; };
+    perlin noise;
+    return [=](const point3 &p) { return density * fmax(0.0, noise.noise(noise_scale * p)); };
+}
+
+struct scene_placement
+{
+    // A rotation by theta around y, then a translation: what rotate_y and translate wrapped
+    // around an object do to it.
+    double cos_theta = 1, sin_theta = 0;
+    vec3 offset;
+
+    scene_placement()
+    {
+    }
+
+    scene_placement(double angle, const vec3 &_offset)
+        : cos_theta(cos(degrees_to_radians(angle))), sin_theta(sin(degrees_to_radians(angle))), offset(_offset)
+    {
+    }
+
+    vec3 turn(const vec3 &v) const
+    {
+        return vec3(cos_theta * v.x() + sin_theta * v.z(), v.y(), -sin_theta * v.x() + cos_theta * v.z());
+    }
+
+    point3 apply(const point3 &p) const
+    {
+        return turn(p) + offset;
+    }
+
+    scene_placement within(const scene_placement &outer) const
+    {
+        // This placement followed by outer.
+        scene_placement p;
+        p.cos_theta = outer.cos_theta * cos_theta - outer.sin_theta * sin_theta;
+        p.sin_theta = outer.sin_theta * cos_theta + outer.cos_theta * sin_theta;
+        p.offset = outer.apply(offset);
+        return p;
+    }
+};
+
+template <typename Sink> class scene_walker : public scene_reader
+{
+    // Walks the grammar above once for every kind of result. Sink makes what the values
+    // describe: scene_loader builds hittables, scene_compiler cache records (see scene_cache.h).
+    // Each object comes with its placement in the world, for sinks that bake it in, and its own
+    // rotate_y and translate afterwards, for sinks that wrap it.
+  public:
+    using texture_ref = typename Sink::texture_ref;
+    using material_ref = typename Sink::material_ref;
+    using object_list = typename Sink::object_list;
+
+    size_t objects = 0; // Objects walked, not counting box sides
+
+    scene_walker(Sink &_sink) : sink(_sink)
+    {
+    }
+
+    using scene_reader::read;
+
+    bool parse(const std::string &path, std::string_view text, json_value &root, std::pmr::memory_resource *arena)
+    {
+        name = path;
+        return scene_reader::parse(text, root, arena);
+    }
+
+    bool walk(const json_value &root)
+    {
+        objects = 0;
+        bool walked = walk_scene(root);
+        textures.clear();
+        materials.clear();
+        return walked;
+    }
+
+  private:
+    Sink &sink;
+    std::unordered_map<std::string_view, texture_ref> textures;   // Only valid during walk
+    std::unordered_map<std::string_view, material_ref> materials; // Only valid during walk
+
+    bool walk_scene(const json_value &root)
+    {
+        if (auto list = root.find("textures"))
+        {
+            if (list->kind != json_value::object_kind)
+                return fail(*list, "\"textures\" should be an object of named textures");
+            for (const auto &entry : list->members)
+            {
+                texture_ref tex{};
+                if (!make_texture(entry.value, tex))
+                    return false;
+                textures[entry.key] = tex;
+            }
+        }
+
+        if (auto list = root.find("materials"))
+        {
+            if (list->kind != json_value::object_kind)
+                return fail(*list, "\"materials\" should be an object of named materials");
+            for (const auto &entry : list->members)
+            {
+                material_ref mat{};
+                if (!make_material(entry.value, mat, false))
+                    return false;
+                materials[entry.key] = mat;
+            }
+        }
+
+        scene_camera_settings settings;
+        if (auto v = root.find("camera"))
+            if (!make_camera(*v, settings))
+                return false;
+        sink.set_camera(settings);
+
+        object_list world;
+        auto list = root.find("objects");
+        if (!list)
+            return fail(root, "missing \"objects\"");
+        if (!add_list(*list, scene_placement(), world, false))
+            return false;
+        sink.set_world(world);
+
+        if (auto sampled = root.find("lights"))
+        {
+            if (sampled->kind != json_value::array_kind)
+                return fail(*sampled, "expected an array of objects");
+            if (sampled->items.empty()) // Scattering always samples one
+                return fail(*sampled, "\"lights\" should have at least one object");
+            for (const auto &item : sampled->items)
+            {
+                object_list light;
+                if (!add_object(item, scene_placement(), light, true))
+                    return false;
+                sink.add_light(light);
+            }
+        }
+        else
+            sink.default_lights();
+        return true;
+    }
+
+    bool make_camera(const json_value &v, scene_camera_settings &settings)
+    {
+        for (int i = 0; i < 11; i++)
+        {
+            if (!v.find(camera_fields[i].key))
+                continue;
+            vec3 value;
+            if (camera_fields[i].is_vector ? !triple(v, camera_fields[i].key, value)
+                                           : !number(v, camera_fields[i].key, value[0]))
+                return false;
+            for (int a = 0; a < 3; a++)
+                settings.values[i][a] = value[a];
+            settings.set |= 1u << i;
+        }
+
+        if (auto medium = v.find("medium"))
+        {
+            color albedo(1, 1, 1);
+            point3 center(0, 0, 0);
+            if (!number(*medium, "density", settings.medium_density) || !triple(*medium, "albedo", albedo, false) ||
+                !triple(*medium, "center", center, false) || !number(*medium, "radius", settings.medium_radius))
+                return false;
+            if (!(settings.medium_radius > 0))
+                return fail(*medium, "\"radius\" should be a positive number");
+            for (int a = 0; a < 3; a++)
+            {
+                settings.medium_albedo[a] = albedo[a];
+                settings.medium_center[a] = center[a];
+            }
+            settings.has_medium = 1;
+        }
+        return true;
+    }
+
+    bool make_texture(const json_value &v, texture_ref &out)
+    {
+        if (v.kind == json_value::string_kind)
+        {
+            auto found = textures.find(v.text);
+            if (found == textures.end())
+                return fail(v, "unknown texture \"" + std::string(v.text) + '"');
+            out = found->second;
+            return true;
+        }
+
+        auto type = type_of(v);
+        if (v.kind == json_value::array_kind || type == "solid")
+        {
+            color c;
+            if (v.kind == json_value::array_kind ? !to_vec3(v, "color", c) : !triple(v, "color", c))
+                return false;
+            out = sink.make_solid(c);
+        }
+        else if (type == "checker")
+        {
+            double scale;
+            texture_ref even{}, odd{};
+            auto even_value = v.find("even"), odd_value = v.find("odd");
+            if (!number(v, "scale", scale))
+                return false;
+            if (!even_value || !odd_value)
+                return fail(v, "a checker texture needs \"even\" and \"odd\"");
+            if (!make_texture(*even_value, even) || !make_texture(*odd_value, odd))
+                return false;
+            out = sink.make_checker(scale, even, odd);
+        }
+        else if (type == "image")
+        {
+            auto file = v.find("file");
+            if (!file || file->kind != json_value::string_kind)
+                return fail(v, "an image texture needs a \"file\"");
+            out = sink.make_image(file->text);
+        }
+        else if (type == "noise")
+        {
+            double scale = 1;
+            if (!number(v, "scale", scale, false))
+                return false;
+            out = sink.make_noise(scale);
+        }
+        else
+            return fail(v, "unknown texture type \"" + std::string(type) + '"');
+        return true;
+    }
+
+    bool make_material(const json_value &v, material_ref &out, bool optional)
+    {
+        if (v.kind == json_value::null_kind && optional)
+        {
+            out = material_ref{};
+            return true;
+        }
+        if (v.kind == json_value::string_kind)
+        {
+            auto found = materials.find(v.text);
+            if (found == materials.end())
+                return fail(v, "unknown material \"" + std::string(v.text) + '"');
+            out = found->second;
+            return true;
+        }
+
+        scene_material_kind kind;
+        auto type = type_of(v);
+        if (type == "lambertian")
+            kind = lambertian_material;
+        else if (type == "metal")
+            kind = metal_material;
+        else if (type == "dielectric")
+            kind = dielectric_material;
+        else if (type == "diffuse_light")
+            kind = diffuse_light_material;
+        else if (type == "isotropic")
+            kind = isotropic_material;
+        else
+            return fail(v, "unknown material type \"" + std::string(type) + '"');
+
+        // The reflectance (or emission) is either a color or a texture. The value is the metal's
+        // fuzz or the dielectric's index of refraction.
+        auto color_key = kind == diffuse_light_material ? "emit" : "albedo";
+        texture_ref tex{};
+        color albedo(1, 1, 1);
+        double value = 0;
+        auto texture_value = v.find("texture");
+        if (texture_value)
+        {
+            if (!make_texture(*texture_value, tex))
+                return false;
+        }
+        else if (kind != dielectric_material && !triple(v, color_key, albedo))
+            return false;
+        if ((kind == metal_material && !number(v, "fuzz", value, false)) ||
+            (kind == dielectric_material && !number(v, "ir", value)))
+            return false;
+
+        out = sink.make_material(kind, texture_value ? &tex : nullptr, albedo, value);
+        return true;
+    }
+
+    bool add_list(const json_value &v, const scene_placement &outer, object_list &out, bool light)
+    {
+        if (v.kind != json_value::array_kind)
+            return fail(v, "expected an array of objects");
+        for (const auto &item : v.items)
+            if (!add_object(item, outer, out, light))
+                return false;
+        return true;
+    }
+
+    bool add_object(const json_value &v, const scene_placement &outer, object_list &out, bool light)
+    {
+        // Adds object v to out, placed in the world by its own rotate_y and translate and then
+        // by outer. Light objects only steer sampling, so they have no material.
+        double angle = 0;
+        vec3 offset;
+        bool turned = v.find("rotate_y"), moved = v.find("translate");
+        if ((turned && !number(v, "rotate_y", angle)) || (moved && !triple(v, "translate", offset)))
+            return false;
+        auto place = scene_placement(angle, offset).within(outer);
+
+        material_ref mat{};
+        auto type = type_of(v);
+        if (type != "bvh" && type != "constant_medium" && type != "grid_medium")
+        {
+            auto material_value = v.find("material");
+            if (material_value)
+            {
+                if (!make_material(*material_value, mat, light))
+                    return false;
+            }
+            else if (!light)
+                return fail(v, "missing \"material\"");
+        }
+
+        if (type == "sphere")
+        {
+            point3 center, center2;
+            double radius;
+            if (!triple(v, "center", center) || !number(v, "radius", radius))
+                return false;
+            bool moving = v.find("center2");
+            if (moving && !triple(v, "center2", center2))
+                return false;
+            sink.add_sphere(out, place, center, moving ? &center2 : nullptr, radius, mat);
+        }
+        else if (type == "quad")
+        {
+            point3 q;
+            vec3 u, w;
+            if (!triple(v, "q", q) || !triple(v, "u", u) || !triple(v, "v", w))
+                return false;
+            sink.add_quad(out, place, q, u, w, mat);
+        }
+        else if (type == "box")
+        {
+            point3 a, b;
+            if (!triple(v, "a", a) || !triple(v, "b", b))
+                return false;
+            sink.add_box(out, place, a, b, mat);
+        }
+        else if (type == "constant_medium")
+        {
+            if (light && !Sink::lights_hold_media)
+                return fail(v, "a cached light list can't hold media");
+            object_list boundary;
+            double density;
+            auto boundary_value = v.find("boundary");
+            if (!boundary_value)
+                return fail(v, "missing \"boundary\"");
+            if (!add_object(*boundary_value, place, boundary, light) || !number(v, "density", density))
+                return false;
+            texture_ref tex{};
+            color albedo;
+            auto texture_value = v.find("texture");
+            if (texture_value ? !make_texture(*texture_value, tex) : !triple(v, "albedo", albedo))
+                return false;
+            sink.add_medium(out, boundary, density, texture_value ? &tex : nullptr, albedo);
+        }
+        else if (type == "grid_medium")
+        {
+            if (light && !Sink::lights_hold_media)
+                return fail(v, "a cached light list can't hold media");
+            point3 lo, hi;
+            vec3 size;
+            double density, noise_scale = 0;
+            if (!triple(v, "min", lo) || !triple(v, "max", hi) || !triple(v, "resolution", size) ||
+                !number(v, "density", density) || !number(v, "noise_scale", noise_scale, false))
+                return false;
+            int resolution[3];
+            for (int a = 0; a < 3; a++)
+            {
+                if (!(lo[a] < hi[a]))
+                    return fail(v, "\"min\" should be below \"max\" on every axis");
+                if (!(size[a] >= 1 && size[a] <= scene_grid_max_resolution) || size[a] != floor(size[a]))
+                    return fail(v, "\"resolution\" should be whole numbers of voxels from 1 to " +
+                                       std::to_string(scene_grid_max_resolution));
+                resolution[a] = static_cast<int>(size[a]);
+            }
+            texture_ref tex{};
+            color albedo;
+            auto texture_value = v.find("texture");
+            if (texture_value ? !make_texture(*texture_value, tex) : !triple(v, "albedo", albedo))
+                return false;
+            sink.add_grid_medium(out, place, aabb(lo, hi), resolution, density, noise_scale,
+                                 texture_value ? &tex : nullptr, albedo);
+        }
+        else if (type == "bvh")
+        {
+            object_list children;
+            auto list = v.find("objects");
+            if (!list)
+                return fail(v, "missing \"objects\"");
+            if (!add_list(*list, place, children, light))
+                return false;
+            if (Sink::empty(children))
+                return fail(v, "a bvh needs at least one object");
+            sink.add_bvh(out, children);
+        }
+        else
+            return fail(v, "unknown object type \"" + std::string(type) + '"');
+        objects++;
+
+        if (turned || moved)
+            sink.wrap(out, turned ? &angle : nullptr, moved ? &offset : nullptr);
+        return true;
+    }
+};
+
+class scene_loader
+{
+  public:
+    double read_secs = 0;  // Time spent reading the file,
+    double parse_secs = 0; // parsing it,
+    double build_secs = 0; // and building the scene from the parsed values
+    size_t bytes = 0;      // Size of the file
+    size_t objects = 0;    // Primitives built, not counting box sides
+
+    bool load(const std::string &path, const RenderParameters &_params, scene &out)
+    {
+        // Builds the scene in path. Textures, materials and primitives are allocated in one
+        // arena that is freed with the last of them.
+        scene_walker<scene_loader> walker(*this);
+        auto start = std::chrono::steady_clock::now();
+        std::string text;
+        if (!walker.read(path, text))
+            return false;
+        bytes = text.size();
+        auto parse_start = std::chrono::steady_clock::now();
+
+        std::pmr::monotonic_buffer_resource parse_arena(text.size() * 2);
+        json_value root(&parse_arena);
+        if (!walker.parse(path, text, root, &parse_arena))
+            return false;
+        auto build_start = std::chrono::steady_clock::now();
+
+        storage = make_shared<std::pmr::monotonic_buffer_resource>(text.size());
+        params = &_params;
+        built = scene();
+        bool walked = walker.walk(root);
+        objects = walker.objects;
+        storage.reset();
+        if (walked)
+            out = built;
+        built = scene();
+
+        auto done = std::chrono::steady_clock::now();
+        read_secs = std::chrono::duration<double>(parse_start - start).count();
+        parse_secs = std::chrono::duration<double>(build_start - parse_start).count();
+        build_secs = std::chrono::duration<double>(done - build_start).count();
+        return walked;
+    }
+
+  private:
+    friend class scene_walker<scene_loader>;
+
+    using texture_ref = shared_ptr<texture>;
+    using material_ref = shared_ptr<material>;
+    using object_list = hittable_list;
+    static const bool lights_hold_media = true;
+
+    shared_ptr<std::pmr::monotonic_buffer_resource> storage;
+    const RenderParameters *params = nullptr;
+    scene built;
+
+    template <typename T, typename... Args> shared_ptr<T> make(Args &&...args)
+    {
+        return std::allocate_shared<T>(arena_allocator<T>(storage), std::forward<Args>(args)...);
+    }
+
+    static bool empty(const hittable_list &list)
+    {
+        return list.objects.empty();
+    }
+
+    void set_camera(const scene_camera_settings &settings)
+    {
+        shared_ptr<atmosphere> medium;
+        if (settings.has_medium)
+            medium = make<atmosphere>(settings.medium_density, vec3(settings.medium_albedo[0], settings.medium_albedo[1],
+                                                                    settings.medium_albedo[2]),
+                                      vec3(settings.medium_center[0], settings.medium_center[1], settings.medium_center[2]),
+                                      settings.medium_radius);
+        built.cam = scene_camera(settings, medium, *params);
+    }
+
+    void set_world(const hittable_list &world)
+    {
+        built.world = world;
+    }
+
+    void add_light(const hittable_list &light)
+    {
+        built.lights.add(light.objects[0]);
+    }
+
+    void default_lights()
+    {
+        built.lights = get_ligths();
+    }
+
+    shared_ptr<texture> make_solid(const color &c)
+    {
+        return make<solid_color>(c);
+    }
+
+    shared_ptr<texture> make_checker(double scale, const shared_ptr<texture> &even, const shared_ptr<texture> &odd)
+    {
+        return make<checker_texture>(scale, even, odd);
+    }
+
+    shared_ptr<texture> make_image(std::string_view file)
+    {
+        if (is_tiled_texture_file(file))
+            return make<tiled_image_texture>(std::string(file).c_str());
+        return make<image_texture>(std::string(file).c_str());
+    }
+
+    shared_ptr<texture> make_noise(double scale)
+    {
+        return make<noise_texture>(scale);
+    }
+
+    shared_ptr<material> make_material(scene_material_kind kind, const shared_ptr<texture> *tex, const color &albedo,
+                                       double value)
+    {
+        switch (kind)
+        {
+        case lambertian_material:
+            return tex ? make<lambertian>(*tex) : make<lambertian>(albedo);
+        case metal_material:
+            return make<metal>(albedo, value);
+        case dielectric_material:
+            return make<dielectric>(value);
+        case diffuse_light_material:
+            return tex ? make<diffuse_light>(*tex) : make<diffuse_light>(albedo);
+        default:
+            return tex ? make<isotropic>(*tex) : make<isotropic>(albedo);
+        }
+    }
+
+    void add_sphere(hittable_list &out, const scene_placement &, const point3 &center, const point3 *center2,
+                    double radius, const shared_ptr<material> &mat)
+    {
+        if (center2)
+            out.add(make<sphere>(center, *center2, radius, mat));
+        else
+            out.add(make<sphere>(center, radius, mat));
+    }
+
+    void add_quad(hittable_list &out, const scene_placement &, const point3 &q, const vec3 &u, const vec3 &v,
+                  const shared_ptr<material> &mat)
+    {
+        out.add(make<quad>(q, u, v, mat));
+    }
+
+    void add_box(hittable_list &out, const scene_placement &, const point3 &a, const point3 &b,
+                 const shared_ptr<material> &mat)
+    {
+        out.add(box(a, b, mat, arena_allocator<quad>(storage)));
+    }
+
+    void add_medium(hittable_list &out, const hittable_list &boundary, double density, const shared_ptr<texture> *tex,
+                    const color &albedo)
+    {
+        if (tex)
+            out.add(make<constant_medium>(boundary.objects[0], density, *tex));
+        else
+            out.add(make<constant_medium>(boundary.objects[0], density, albedo));
+    }
+
+    void add_grid_medium(hittable_list &out, const scene_placement &, const aabb &bounds, const int *resolution,
+                         double density, double noise_scale, const shared_ptr<texture> *tex, const color &albedo)
+    {
+        auto grid = make<density_grid>(bounds, resolution[0], resolution[1], resolution[2],
+                                       scene_grid_density(density, noise_scale));
+        if (tex)
+            out.add(make<grid_medium>(grid, *tex));
+        else
+            out.add(make<grid_medium>(grid, albedo));
+    }
+
+    void add_bvh(hittable_list &out, hittable_list &children)
+    {
+        out.add(make<bvh_node>(children));
+    }
+
+    void wrap(hittable_list &out, const double *angle, const vec3 *offset)
+    {
+        // The placement stays a pair of wrappers around the object just added.
+        auto &object = out.objects.back();
+        if (angle)
+            object = make<rotate_y>(object, *angle);
+        if (offset)
+            object = make<translate>(object, *offset);
+    }
+};
+
+inline bool load_scene_file(const std::string &path, const RenderParameters &params, scene &out)
+{
+    scene_loader loader;
+    if (!loader.load(path, params, out))
+        return false;
+    LOG(INFO) << "SCENE " << path << ": " << loader.objects << " OBJECTS, " << loader.bytes << " BYTES, READ IN "
+              << loader.read_secs << "s, PARSED IN " << loader.parse_secs << "s, BUILT IN " << loader.build_secs << "s";
+    return true;
+}
+
+#endif
@@ -5,6 +5,7 @@
 
 #include "hittable.h"
 #include "onb.h"
+#include "stats.h"
 
 class sphere : public hittable
 {
@@ -31,7 +32,25 @@ public:
 
     bool hit(const ray &r, interval ray_t, hit_record &rec) const override
     {
+        RTW_COUNT(sphere_tests);
         point3 center = is_moving ? sphere_center(r.time()) : center1;
+        vec3 outward_normal;
+        if (!intersect(center, radius, r, ray_t, rec, outward_normal))
+            return false;
+
+        get_sphere_uv(outward_normal, rec.u, rec.v);
+        rec.uv_scale = 1 / (2 * pi * radius);
+        rec.mat = mat.get();
+        rec.prim_id = id;
+
+        return true;
+    }
+
+    static bool intersect(const point3 &center, double radius, const ray &r, interval ray_t, hit_record &rec,
+                          vec3 &outward_normal)
+    {
+        // The ray-sphere test, also used by scene caches: sets the hit's t, p and normal, and
+        // returns the outward normal for the texture coordinates.
         vec3 oc = r.origin() - center;
         auto a = r.direction().length_squared();
         auto half_b = dot(oc, r.direction());
@@ -53,14 +72,27 @@ public:
 
         rec.t = root;
         rec.p = r.at(rec.t);
-        vec3 outward_normal = (rec.p - center) / radius;
+        outward_normal = (rec.p - center) / radius;
         rec.set_face_normal(r, outward_normal);
-        get_sphere_uv(outward_normal, rec.u, rec.v);
-        rec.mat = mat;
-
         return true;
     }
 
+    static void get_sphere_uv(const point3 &p, double &u, double &v)
+    {
+        // p: a given point on the sphere of radius one, centered at the origin.
+        // u: returned value [0,1] of angle around the Y axis from X=-1.
+        // v: returned value [0,1] of angle from Y=-1 to Y=+1.
+        //     <1 0 0> yields <0.50 0.50>       <-1  0  0> yields <0.00 0.50>
+        //     <0 1 0> yields <0.50 1.00>       < 0 -1  0> yields <0.50 0.00>
+        //     <0 0 1> yields <0.25 0.50>       < 0  0 -1> yields <0.75 0.50>
+
+        auto theta = acos(-p.y());
+        auto phi = atan2(-p.z(), p.x()) + pi;
+
+        u = phi / (2 * pi);
+        v = theta / pi;
+    }
+
     aabb bounding_box() const override { return bbox; }
 
     double pdf_value(const point3 &o, const vec3 &v) const override
@@ -71,7 +103,12 @@ public:
         if (!this->hit(ray(o, v), interval(0.001, infinity), rec))
             return 0;
 
-        auto cos_theta_max = sqrt(1 - radius * radius / (center1 - o).length_squared());
+        // Seen from inside, the sphere fills every direction.
+        auto distance_squared = (center1 - o).length_squared();
+        if (distance_squared <= radius * radius)
+            return 1 / (4 * pi);
+
+        auto cos_theta_max = sqrt(1 - radius * radius / distance_squared);
         auto solid_angle = 2 * pi * (1 - cos_theta_max);
 
         return 1 / solid_angle;
@@ -81,6 +118,9 @@ public:
     {
         vec3 direction = center1 - o;
         auto distance_squared = direction.length_squared();
+        if (distance_squared <= radius * radius)
+            return random_unit_vector();
+
         onb uvw;
         uvw.build_from_w(direction);
         return uvw.local(random_to_sphere(radius, distance_squared));
@@ -101,22 +141,6 @@ private:
         return center1 + time * center_vec;
     }
 
-    static void get_sphere_uv(const point3 &p, double &u, double &v)
-    {
-        // p: a given point on the sphere of radius one, centered at the origin.
-        // u: returned value [0,1] of angle around the Y axis from X=-1.
-        // v: returned value [0,1] of angle from Y=-1 to Y=+1.
-        //     <1 0 0> yields <0.50 0.50>       <-1  0  0> yields <0.00 0.50>
-        //     <0 1 0> yields <0.50 1.00>       < 0 -1  0> yields <0.50 0.00>
-        //     <0 0 1> yields <0.25 0.50>       < 0  0 -1> yields <0.75 0.50>
-
-        auto theta = acos(-p.y());
-        auto phi = atan2(-p.z(), p.x()) + pi;
-
-        u = phi / (2 * pi);
-        v = theta / pi;
-    }
-
     static vec3 random_to_sphere(double radius, double distance_squared)
     {
         auto r1 = random_double();
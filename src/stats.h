@@ -0,0 +1,134 @@
+#ifndef STATS_H
+#define STATS_H
+
+// Render statistics: what the renderer spends its work on, counted per thread in the hot paths.
+// Builds with RTW_STATS defined (cmake -DRTW_STATS=ON) count; in other builds RTW_COUNT() is
+// nothing and costs nothing. Only traced_rays, one per ray intersected with the world, is counted
+// in every build (RTW_COUNT_TRACED), so throughput can be reported without RTW_STATS. Each thread counts into its own thread_local block, with no atomics
+// or sharing (see thread_registry.h); a block is folded into the process totals when its thread
+// exits, and render_stats_total() adds up the retired and the live blocks.
+
+#include "thread_registry.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+struct render_counters
+{
+    static const int path_buckets = 16; // Path lengths counted separately; longer ones share the last
+
+    uint64_t traced_rays = 0;   // Rays intersected with the world; counted in every build
+    uint64_t camera_rays = 0;   // Rays from the camera, one per pixel sample
+    uint64_t scatter_rays = 0;  // Bounces sampled from the light and material pdf mixture
+    uint64_t specular_rays = 0; // Bounces that skip the pdf (metal, glass, isotropic)
+    uint64_t hits = 0;          // Rays that hit a surface or scattered in a medium
+    uint64_t bvh_nodes = 0;     // BVH nodes visited, i.e. node bounding boxes tested
+    uint64_t sphere_tests = 0;  // Primitive intersection tests, by primitive type
+    uint64_t quad_tests = 0;
+    uint64_t medium_tests = 0;
+    uint64_t pdf_values = 0;    // pdf value() evaluations
+    uint64_t pdf_samples = 0;   // pdf generate() calls
+    uint64_t texture_lookups = 0;
+    uint64_t path_lengths[path_buckets] = {}; // Paths that ended after that many bounces
+
+    void add(const render_counters &other)
+    {
+        traced_rays += other.traced_rays;
+        camera_rays += other.camera_rays;
+        scatter_rays += other.scatter_rays;
+        specular_rays += other.specular_rays;
+        hits += other.hits;
+        bvh_nodes += other.bvh_nodes;
+        sphere_tests += other.sphere_tests;
+        quad_tests += other.quad_tests;
+        medium_tests += other.medium_tests;
+        pdf_values += other.pdf_values;
+        pdf_samples += other.pdf_samples;
+        texture_lookups += other.texture_lookups;
+        for (int b = 0; b < path_buckets; b++)
+            path_lengths[b] += other.path_lengths[b];
+    }
+
+    void path_end(int bounces)
+    {
+        path_lengths[std::min(std::max(bounces, 0), path_buckets - 1)]++;
+    }
+};
+
+inline void retire_render_counters(render_counters &sum, render_counters &counters)
+{
+    sum.add(counters);
+}
+
+using render_stats_registry = thread_registry<render_counters, render_counters, retire_render_counters>;
+
+inline render_counters &local_render_counters()
+{
+    // This thread's block, registered the first time the thread counts something.
+    thread_local thread_block<render_stats_registry> block;
+    return block.block;
+}
+
+inline render_counters render_stats_total()
+{
+    render_counters sum;
+    auto add = [&](const render_counters &retired, const std::vector<render_counters *> &live) {
+        sum = retired;
+        for (auto counters : live)
+            sum.add(*counters);
+    };
+    render_stats_registry::global().read(add);
+    return sum;
+}
+
+#define RTW_COUNT_TRACED() (local_render_counters().traced_rays++)
+
+#ifdef RTW_STATS
+const bool render_stats_enabled = true;
+#define RTW_COUNT(counter) (local_render_counters().counter++)
+#define RTW_PATH_END(bounces) (local_render_counters().path_end(bounces))
+#else
+const bool render_stats_enabled = false;
+#define RTW_COUNT(counter) ((void)0)
+#define RTW_PATH_END(bounces) ((void)0)
+#endif
+
+inline void print_render_stats(std::ostream &out, const render_counters &c)
+{
+    // A summary of c, with the ratios that tell BVH quality, shading cost and path length apart.
+    auto rays = c.camera_rays + c.scatter_rays + c.specular_rays;
+    auto per = [](uint64_t a, uint64_t b) { return b > 0 ? static_cast<double>(a) / b : 0.0; };
+    auto flags = out.flags();
+    auto precision = out.precision(3);
+    out << std::fixed << "Render statistics:\n"
+        << "  rays          " << rays << " (" << c.camera_rays << " camera, " << c.scatter_rays << " scatter, "
+        << c.specular_rays << " specular), " << 100 * per(c.hits, rays) << "% hit\n"
+        << "  BVH nodes     " << c.bvh_nodes << ", " << per(c.bvh_nodes, rays) << " per ray\n"
+        << "  primitives    " << c.sphere_tests + c.quad_tests + c.medium_tests << " tests (" << c.sphere_tests
+        << " sphere, " << c.quad_tests << " quad, " << c.medium_tests << " medium), "
+        << per(c.sphere_tests + c.quad_tests + c.medium_tests, rays) << " per ray\n"
+        << "  pdfs          " << c.pdf_values << " values, " << c.pdf_samples << " samples\n"
+        << "  textures      " << c.texture_lookups << " lookups, " << per(c.texture_lookups, c.hits) << " per hit\n"
+        << "  path length   " << per(c.scatter_rays + c.specular_rays, c.camera_rays) << " bounces per path:";
+    for (int b = 0; b < render_counters::path_buckets; b++)
+        if (c.path_lengths[b] > 0)
+            out << ' ' << b << (b == render_counters::path_buckets - 1 ? "+" : "") << ':' << c.path_lengths[b];
+    out << '\n';
+    out.flags(flags);
+    out.precision(precision);
+}
+
+struct render_stats_report
+{
+    // Prints the process totals to std::clog when it goes out of scope, in RTW_STATS builds.
+    ~render_stats_report()
+    {
+        if (render_stats_enabled)
+            print_render_stats(std::clog, render_stats_total());
+    }
+};
+
+#endif
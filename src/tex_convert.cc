@@ -0,0 +1,37 @@
+#include "rtweekend.h"
+
+#include "color.h"
+#include "texture_cache.h"
+
+#include <cstdlib>
+#include <iostream>
+
+// Converts a JPEG/PNG image into the tiled, mipmapped .rtt format read by tiled_image_texture.
+// Usage: tex_convert input.jpg output.rtt [tile_size]
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " input.jpg output.rtt [tile_size]\n";
+        return 1;
+    }
+
+    int tile_size = argc > 3 ? std::atoi(argv[3]) : 64;
+    if (tile_size <= 0)
+    {
+        std::cerr << "Invalid tile size " << argv[3] << '\n';
+        return 1;
+    }
+
+    if (!convert_to_tiled(argv[1], argv[2], tile_size))
+    {
+        std::cerr << "Could not convert '" << argv[1] << "' to '" << argv[2] << "'\n";
+        return 1;
+    }
+
+    tiled_image image(argv[2], tile_cache::global());
+    std::cout << argv[2] << ": " << image.width() << 'x' << image.height() << ", " << image.level_count()
+              << " levels, " << tile_size << "px tiles\n";
+    return 0;
+}
@@ -1,9 +1,15 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 
+#include "image_registry.h"
 #include "perlin.h"
 #include "rtw_stb_image.h"
 #include "rtweekend.h"
+#include "stats.h"
+
+#include <vector>
+
+class texture_program;
 
 class texture
 {
@@ -11,6 +17,17 @@ class texture
     virtual ~texture() = default;
 
     virtual color value(double u, double v, const point3 &p) const = 0;
+
+    // Filtered lookup, where footprint is the width of the ray footprint in texture space.
+    // Textures without a prefiltered representation simply ignore it.
+    virtual color filtered_value(double u, double v, const point3 &p, double footprint) const
+    {
+        return value(u, v, p);
+    }
+
+    // Appends this texture (and its inputs) to a flattened program and returns its node index.
+    // Textures that don't know how to flatten themselves are called through the vtable.
+    virtual int flatten(texture_program &program) const;
 };
 
 class solid_color : public texture
@@ -29,6 +46,8 @@ class solid_color : public texture
         return color_value;
     }
 
+    int flatten(texture_program &program) const override;
+
   private:
     color color_value;
 };
@@ -57,39 +76,81 @@ class checker_texture : public texture
         return isEven ? even->value(u, v, p) : odd->value(u, v, p);
     }
 
+    int flatten(texture_program &program) const override;
+
   private:
     double inv_scale;
     shared_ptr<texture> even;
     shared_ptr<texture> odd;
 };
 
+template <typename Image> color filtered_lookup(const Image &image, double u, double v, double footprint)
+{
+    // Trilinear lookup shared by the image-backed textures. Image provides width(level),
+    // height(level), level_count() and texel(level, x, y) returning linear RGBA. u,v are clamped.
+    u = interval(0, 1).clamp(u);
+    v = 1.0 - interval(0, 1).clamp(v);
+
+    // Pick the mip level whose texels match the footprint, and blend the two nearest levels.
+    auto max_level = image.level_count() - 1;
+    auto lod = footprint > 0 ? log2(footprint * image.width()) : 0.0;
+    lod = interval(0, max_level).clamp(lod);
+
+    auto bilinear = [&](int level) {
+        auto x = u * image.width(level) - 0.5;
+        auto y = v * image.height(level) - 0.5;
+        auto i = static_cast<int>(floor(x));
+        auto j = static_cast<int>(floor(y));
+        auto fx = x - i;
+        auto fy = y - j;
+
+        auto t00 = image.texel(level, i, j);
+        auto t10 = image.texel(level, i + 1, j);
+        auto t01 = image.texel(level, i, j + 1);
+        auto t11 = image.texel(level, i + 1, j + 1);
+
+        double rgb[3];
+        for (int c = 0; c < 3; c++)
+            rgb[c] = (1 - fy) * ((1 - fx) * t00[c] + fx * t10[c]) + fy * ((1 - fx) * t01[c] + fx * t11[c]);
+        return color(rgb[0], rgb[1], rgb[2]);
+    };
+
+    auto level = static_cast<int>(lod);
+    auto blend = lod - level;
+    auto c = bilinear(level);
+    if (blend > 0 && level < max_level)
+        c = (1 - blend) * c + blend * bilinear(level + 1);
+    return c;
+}
+
 class image_texture : public texture
 {
   public:
-    image_texture(const char *filename) : image(filename)
+    image_texture(const char *filename) : image(image_registry::global().acquire(filename))
     {
+        // The image decodes in the background; the first lookup waits for it if needed.
     }
 
     color value(double u, double v, const point3 &p) const override
     {
-        // If we have no texture data, then return solid cyan as a debugging aid
-        if (image.height() <= 0)
-            return color(0, 1, 1);
+        return filtered_value(u, v, p, 0.0);
+    }
 
-        // Clamp input texture coordinates to [0,1] x [1,0]
-        u = interval(0, 1).clamp(u);
-        v = 1.0 - interval(0, 1).clamp(v);
+    color filtered_value(double u, double v, const point3 &p, double footprint) const override
+    {
+        const auto &data = *image.get();
 
-        auto i = static_cast<int>(u * image.width());
-        auto j = static_cast<int>(v * image.height());
-        auto pixel = image.pixel_data(i, j);
+        // If we have no texture data, then return solid cyan as a debugging aid
+        if (data.height() <= 0)
+            return color(0, 1, 1);
 
-        auto color_scale = 1.0 / 255.0;
-        return color(color_scale * pixel[0], color_scale * pixel[1], color_scale * pixel[2]);
+        return filtered_lookup(data, u, v, footprint);
     }
 
+    int flatten(texture_program &program) const override;
+
   private:
-    rtw_image image;
+    image_registry::image_future image;
 };
 
 class noise_texture : public texture
@@ -109,9 +170,142 @@ class noise_texture : public texture
         return color(1, 1, 1) * 0.5 * (1 + sin(s.z() + 10 * noise.turb(s)));
     }
 
+    int flatten(texture_program &program) const override;
+
   private:
     perlin noise;
     double scale;
 };
 
+struct texture_node
+{
+    // One step of a flattened texture graph. Leaves evaluate the concrete texture classes with
+    // qualified (non-virtual) calls; a checker node picks which child node to continue with.
+    enum node_kind
+    {
+        constant,
+        checker,
+        noise,
+        image,
+        opaque
+    };
+
+    node_kind kind;
+    color value;        // constant: the color
+    double inv_scale;   // checker: inverse cell size
+    int even, odd;      // checker: child node indices
+    const texture *tex; // noise, image, opaque: the texture to evaluate
+};
+
+class texture_program
+{
+  public:
+    texture_program() : texture_program(color(0, 0, 0))
+    {
+    }
+
+    texture_program(const color &c) : root(0), is_const(true), const_value(c)
+    {
+    }
+
+    texture_program(shared_ptr<texture> t) : source(t)
+    {
+        // Flatten the graph once at scene build time, then fold it to a single color if it
+        // cannot vary (e.g. a solid_color, or a checker of two equal colors).
+        root = t->flatten(*this);
+        is_const = nodes[root].kind == texture_node::constant;
+        const_value = nodes[root].value;
+    }
+
+    color value(double u, double v, const point3 &p, double footprint) const
+    {
+        RTW_COUNT(texture_lookups);
+        if (is_const)
+            return const_value;
+
+        int n = root;
+        while (true)
+        {
+            const auto &node = nodes[n];
+            switch (node.kind)
+            {
+            case texture_node::constant:
+                return node.value;
+            case texture_node::checker: {
+                auto xInteger = static_cast<int>(std::floor(node.inv_scale * p.x()));
+                auto yInteger = static_cast<int>(std::floor(node.inv_scale * p.y()));
+                auto zInteger = static_cast<int>(std::floor(node.inv_scale * p.z()));
+                bool isEven = (xInteger + yInteger + zInteger) % 2 == 0;
+                n = isEven ? node.even : node.odd;
+                break;
+            }
+            case texture_node::noise:
+                return static_cast<const noise_texture *>(node.tex)->noise_texture::value(u, v, p);
+            case texture_node::image:
+                return static_cast<const image_texture *>(node.tex)->image_texture::filtered_value(u, v, p, footprint);
+            default:
+                return node.tex->filtered_value(u, v, p, footprint);
+            }
+        }
+    }
+
+    bool is_constant() const
+    {
+        return is_const;
+    }
+
+    int add(const texture_node &node)
+    {
+        nodes.push_back(node);
+        return static_cast<int>(nodes.size()) - 1;
+    }
+
+    const texture_node &node(int index) const
+    {
+        return nodes[index];
+    }
+
+  private:
+    shared_ptr<texture> source; // Keeps every texture referenced by the nodes alive
+    std::vector<texture_node> nodes;
+    int root;
+    bool is_const;
+    color const_value;
+};
+
+inline int texture::flatten(texture_program &program) const
+{
+    return program.add({texture_node::opaque, color(), 0, 0, 0, this});
+}
+
+inline int solid_color::flatten(texture_program &program) const
+{
+    return program.add({texture_node::constant, color_value, 0, 0, 0, nullptr});
+}
+
+inline int checker_texture::flatten(texture_program &program) const
+{
+    auto e = even->flatten(program);
+    auto o = odd->flatten(program);
+
+    // A checker of two identical colors is just that color.
+    const auto &ne = program.node(e);
+    const auto &no = program.node(o);
+    if (ne.kind == texture_node::constant && no.kind == texture_node::constant && ne.value.x() == no.value.x() &&
+        ne.value.y() == no.value.y() && ne.value.z() == no.value.z())
+        return e;
+
+    return program.add({texture_node::checker, color(), inv_scale, e, o, nullptr});
+}
+
+inline int image_texture::flatten(texture_program &program) const
+{
+    return program.add({texture_node::image, color(), 0, 0, 0, this});
+}
+
+inline int noise_texture::flatten(texture_program &program) const
+{
+    return program.add({texture_node::noise, color(), 0, 0, 0, this});
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,452 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include "rtweekend.h"
+
+#include "rtw_stb_image.h"
+#include "texture.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Tiled texture file (.rtt) layout, all fields little-endian:
+//
+//   rtt_header                             magic "RTT1", size and tile edge of level 0
+//   rtt_level[level_count]                 size, tile grid and byte offset of each mip level
+//   tiles                                  per level, row-major tiles of tile_size^2 RGBA8
+//                                          texels (sRGB encoded), each tile row-major
+//
+// Tiles at the right and bottom borders are padded to the full tile size.
+
+struct rtt_header
+{
+    char magic[4];
+    uint32_t width;
+    uint32_t height;
+    uint32_t level_count;
+    uint32_t tile_size;
+};
+
+struct rtt_level
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t tiles_x;
+    uint32_t tiles_y;
+    uint64_t offset;
+};
+
+inline bool convert_to_tiled(const char *src_filename, const char *dst_filename, int tile_size = 64)
+{
+    // Converts a JPEG/PNG (anything stb_image reads) into a tiled, mipmapped .rtt file.
+    // Returns false if the source could not be decoded or the destination not written.
+    rtw_image image;
+    if (!image.load(src_filename))
+        return false;
+
+    unsigned char encode[4096];
+    for (int i = 0; i < 4096; i++)
+    {
+        auto c = (i + 0.5) / 4096;
+        c = c <= 0.0031308 ? 12.92 * c : 1.055 * pow(c, 1 / 2.4) - 0.055;
+        encode[i] = static_cast<unsigned char>(interval(0, 255).clamp(c * 255 + 0.5));
+    }
+
+    rtt_header header = {{'R', 'T', 'T', '1'},
+                         static_cast<uint32_t>(image.width()),
+                         static_cast<uint32_t>(image.height()),
+                         static_cast<uint32_t>(image.level_count()),
+                         static_cast<uint32_t>(tile_size)};
+
+    std::vector<rtt_level> levels(header.level_count);
+    uint64_t offset = sizeof(rtt_header) + levels.size() * sizeof(rtt_level);
+    auto tile_bytes = static_cast<uint64_t>(tile_size) * tile_size * 4;
+    for (int l = 0; l < image.level_count(); l++)
+    {
+        levels[l].width = image.width(l);
+        levels[l].height = image.height(l);
+        levels[l].tiles_x = (levels[l].width + tile_size - 1) / tile_size;
+        levels[l].tiles_y = (levels[l].height + tile_size - 1) / tile_size;
+        levels[l].offset = offset;
+        offset += tile_bytes * levels[l].tiles_x * levels[l].tiles_y;
+    }
+
+    std::ofstream out(dst_filename, std::ios::binary | std::ios::trunc);
+    if (!out)
+        return false;
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(levels.data()), levels.size() * sizeof(rtt_level));
+
+    std::vector<unsigned char> tile(tile_bytes);
+    for (int l = 0; l < image.level_count(); l++)
+        for (uint32_t ty = 0; ty < levels[l].tiles_y; ty++)
+            for (uint32_t tx = 0; tx < levels[l].tiles_x; tx++)
+            {
+                for (int y = 0; y < tile_size; y++)
+                    for (int x = 0; x < tile_size; x++)
+                    {
+                        auto t = image.texel(l, tx * tile_size + x, ty * tile_size + y);
+                        auto dst = &tile[(static_cast<size_t>(y) * tile_size + x) * 4];
+                        for (int c = 0; c < 3; c++)
+                            dst[c] = encode[static_cast<int>(interval(0, 4095).clamp(t[c] * 4096))];
+                        dst[3] = 255;
+                    }
+                out.write(reinterpret_cast<const char *>(tile.data()), tile.size());
+            }
+
+    return static_cast<bool>(out);
+}
+
+class mapped_file
+{
+  public:
+    mapped_file(const std::string &filename)
+    {
+        // Maps the whole file read-only. Pages are only brought in when a tile is first read.
+#ifdef _WIN32
+        file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return;
+        LARGE_INTEGER file_size;
+        GetFileSizeEx(file, &file_size);
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping == nullptr)
+            return;
+        data = static_cast<const unsigned char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        size = data ? static_cast<size_t>(file_size.QuadPart) : 0;
+#else
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                data = static_cast<const unsigned char *>(p);
+                size = st.st_size;
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    ~mapped_file()
+    {
+#ifdef _WIN32
+        if (data)
+            UnmapViewOfFile(data);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+#else
+        if (data)
+            munmap(const_cast<unsigned char *>(data), size);
+#endif
+    }
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    const unsigned char *bytes() const
+    {
+        return data;
+    }
+    size_t length() const
+    {
+        return size;
+    }
+
+  private:
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+};
+
+class tile_cache
+{
+  public:
+    // A decoded tile: tile_size^2 texels of linear float RGBA.
+    using tile = std::vector<float>;
+
+    struct statistics
+    {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        size_t bytes_resident;
+        size_t tiles_resident;
+    };
+
+    tile_cache(size_t budget_bytes = size_t(256) << 20) : budget(budget_bytes)
+    {
+    }
+
+    static tile_cache &global()
+    {
+        // The cache shared by every tiled texture unless one is given explicitly.
+        static tile_cache cache;
+        return cache;
+    }
+
+    void set_budget(size_t budget_bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        budget = budget_bytes;
+        evict();
+    }
+
+    template <typename Load> shared_ptr<const tile> get(uint64_t key, Load &&load)
+    {
+        // Returns the tile for key, decoding it with load() on a miss. Tiles are handed out as
+        // shared pointers so a tile evicted while another thread reads it stays valid.
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = index.find(key);
+            if (it != index.end())
+            {
+                lru.splice(lru.begin(), lru, it->second);
+                hits++;
+                return it->second->second;
+            }
+            misses++;
+        }
+
+        // Decode outside the lock; if two threads race on the same tile the first insert wins.
+        auto fresh = make_shared<const tile>(load());
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if (it != index.end())
+            return it->second->second;
+
+        lru.emplace_front(key, fresh);
+        index[key] = lru.begin();
+        bytes_resident += fresh->size() * sizeof(float);
+        evict();
+        return fresh;
+    }
+
+    statistics stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return statistics{hits, misses, evictions, bytes_resident, lru.size()};
+    }
+
+  private:
+    using entry = std::pair<uint64_t, shared_ptr<const tile>>;
+
+    mutable std::mutex mutex;
+    size_t budget;
+    size_t bytes_resident = 0;
+    uint64_t hits = 0, misses = 0, evictions = 0;
+    std::list<entry> lru; // Most recently used first
+    std::unordered_map<uint64_t, std::list<entry>::iterator> index;
+
+    void evict()
+    {
+        // Drop least recently used tiles until the budget holds (always keeping the newest).
+        while (bytes_resident > budget && lru.size() > 1)
+        {
+            bytes_resident -= lru.back().second->size() * sizeof(float);
+            index.erase(lru.back().first);
+            lru.pop_back();
+            evictions++;
+        }
+    }
+};
+
+class tiled_image
+{
+  public:
+    tiled_image(const char *filename, tile_cache &_cache) : file(filename), cache(_cache), id(next_id()++)
+    {
+        // Validate the header and levels; on any mismatch the image reports zero size.
+        const auto *bytes = file.bytes();
+        if (bytes == nullptr || file.length() < sizeof(rtt_header))
+            return;
+
+        std::memcpy(&header, bytes, sizeof(header));
+        if (std::memcmp(header.magic, "RTT1", 4) != 0 || header.level_count > 255 ||
+            file.length() < sizeof(rtt_header) + header.level_count * sizeof(rtt_level))
+        {
+            header.level_count = 0;
+            return;
+        }
+
+        levels.resize(header.level_count);
+        std::memcpy(levels.data(), bytes + sizeof(rtt_header), levels.size() * sizeof(rtt_level));
+        if (!levels_fit())
+        {
+            header.level_count = 0;
+            levels.clear();
+        }
+    }
+
+    int width(int level = 0) const
+    {
+        return levels.empty() ? 0 : levels[level].width;
+    }
+    int height(int level = 0) const
+    {
+        return levels.empty() ? 0 : levels[level].height;
+    }
+    int level_count() const
+    {
+        return static_cast<int>(levels.size());
+    }
+
+    std::array<float, 4> texel(int level, int x, int y) const
+    {
+        const auto &l = levels[level];
+        x = x < 0 ? 0 : (x >= static_cast<int>(l.width) ? l.width - 1 : x);
+        y = y < 0 ? 0 : (y >= static_cast<int>(l.height) ? l.height - 1 : y);
+
+        int ts = header.tile_size;
+        uint32_t tx = x / ts, ty = y / ts;
+        uint64_t key = (uint64_t(id) << 48) | (uint64_t(level) << 40) | (uint64_t(ty) << 20) | tx;
+
+        // Neighbouring lookups nearly always hit the same tile, so each thread remembers the
+        // last tile it used and skips the shared cache (and its lock) for repeats.
+        struct last_tile
+        {
+            uint64_t key = ~uint64_t(0);
+            shared_ptr<const tile_cache::tile> data;
+        };
+        static thread_local last_tile last;
+
+        if (last.key != key)
+        {
+            last.data = cache.get(key, [&] { return decode_tile(l, tx, ty); });
+            last.key = key;
+        }
+
+        const float *t = last.data->data() + ((y % ts) * ts + (x % ts)) * 4;
+        return {t[0], t[1], t[2], t[3]};
+    }
+
+  private:
+    mapped_file file;
+    tile_cache &cache;
+    uint32_t id;
+    rtt_header header = {};
+    std::vector<rtt_level> levels;
+
+    static std::atomic<uint32_t> &next_id()
+    {
+        // Textures may be opened by several scene loads at once.
+        static std::atomic<uint32_t> id(0);
+        return id;
+    }
+
+    bool levels_fit() const
+    {
+        // Every level's tile grid covers its size, fits the tile key in texel() and lies inside
+        // the file, so decode_tile() never reads past the mapping.
+        uint64_t ts = header.tile_size;
+        if (ts == 0 || ts > (1u << 15))
+            return false;
+        uint64_t tile_bytes = ts * ts * 4;
+        for (const auto &l : levels)
+        {
+            if (l.width == 0 || l.height == 0 || l.width > 0x7fffffff || l.height > 0x7fffffff ||
+                l.tiles_x != (l.width + ts - 1) / ts || l.tiles_y != (l.height + ts - 1) / ts ||
+                l.tiles_x >= (1u << 20) || l.tiles_y >= (1u << 20))
+                return false;
+            if (l.offset > file.length() || uint64_t(l.tiles_x) * l.tiles_y > (file.length() - l.offset) / tile_bytes)
+                return false;
+        }
+        return true;
+    }
+
+    tile_cache::tile decode_tile(const rtt_level &l, uint32_t tx, uint32_t ty) const
+    {
+        static const auto decode = [] {
+            std::array<float, 256> table;
+            for (int i = 0; i < 256; i++)
+            {
+                auto c = i / 255.0;
+                table[i] = static_cast<float>(c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4));
+            }
+            return table;
+        }();
+
+        size_t count = size_t(header.tile_size) * header.tile_size;
+        const auto *src = file.bytes() + l.offset + (uint64_t(ty) * l.tiles_x + tx) * count * 4;
+
+        tile_cache::tile t(count * 4);
+        for (size_t i = 0; i < count; i++)
+        {
+            t[4 * i + 0] = decode[src[4 * i + 0]];
+            t[4 * i + 1] = decode[src[4 * i + 1]];
+            t[4 * i + 2] = decode[src[4 * i + 2]];
+            t[4 * i + 3] = src[4 * i + 3] / 255.0f;
+        }
+        return t;
+    }
+};
+
+inline bool is_tiled_texture_file(std::string_view path)
+{
+    // Scene image textures named *.rtt are tiled files (see tex_convert), read a tile at a time.
+    return path.size() > 4 && path.substr(path.size() - 4) == ".rtt";
+}
+
+class tiled_image_texture : public texture
+{
+  public:
+    tiled_image_texture(const char *filename, tile_cache &cache = tile_cache::global()) : image(filename, cache)
+    {
+        if (image.level_count() == 0)
+            std::cerr << "ERROR: Could not open tiled texture '" << filename << "'.\n";
+    }
+
+    color value(double u, double v, const point3 &p) const override
+    {
+        return filtered_value(u, v, p, 0.0);
+    }
+
+    color filtered_value(double u, double v, const point3 &p, double footprint) const override
+    {
+        // If we have no texture data, then return solid cyan as a debugging aid
+        if (image.level_count() == 0)
+            return color(0, 1, 1);
+
+        return filtered_lookup(image, u, v, footprint);
+    }
+
+  private:
+    tiled_image image;
+};
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef THREAD_REGISTRY_H
+#define THREAD_REGISTRY_H
+
+// Per-thread blocks that their threads write without locks or atomics, and a registry that can
+// still read them all: a thread registers its block the first time it uses it, and the block is
+// retired into the registry (retire(retired, block)) when the thread exits. The render counters
+// of stats.h and the trace buffers of trace.h are kept this way.
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+template <typename Block, typename Retired, void (*retire)(Retired &, Block &)>
+class thread_registry
+{
+    // The live per-thread blocks, and what is kept of the ones whose threads have exited.
+  public:
+    using block_type = Block;
+
+    static thread_registry &global()
+    {
+        // Never destroyed, so threads that outlive main() can still retire their blocks.
+        static auto registry = new thread_registry;
+        return *registry;
+    }
+
+    void enter(Block *block)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        live.push_back(block);
+    }
+
+    void leave(Block *block)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        retire(retired, *block);
+        live.erase(std::find(live.begin(), live.end(), block));
+    }
+
+    template <typename Visit> void read(Visit visit) const
+    {
+        // Calls visit(retired, live). Live blocks are read as they are, so call this while no
+        // other thread is writing to its block.
+        std::lock_guard<std::mutex> lock(mutex);
+        visit(retired, live);
+    }
+
+  private:
+    mutable std::mutex mutex;
+    std::vector<Block *> live;
+    Retired retired{};
+};
+
+template <typename Registry> struct thread_block
+{
+    // The calling thread's block of Registry, as a thread_local.
+    typename Registry::block_type block;
+
+    thread_block()
+    {
+        Registry::global().enter(&block);
+    }
+
+    ~thread_block()
+    {
+        Registry::global().leave(&block);
+    }
+};
+
+#endif
@@ -0,0 +1,188 @@
+#ifndef THROUGHPUT_H
+#define THROUGHPUT_H
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "example.h"
+#include "external/log.h"
+#include "external/params.h"
+#include "parallel.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// End-to-end throughput of the example scenes: every scene is built from the default
+// RenderParameters, whatever parameters.txt says, and traced at a fixed small resolution, sample
+// count and seed on each of a list of thread counts. Nothing is written but the results. Every
+// sample is one primary (camera) ray; the rays traced in all, bounces included, are the render
+// counters' traced_rays, which every build counts.
+
+struct throughput_options
+{
+    int image_width = 160;
+    int samples_per_pixel = 16;
+    int runs = 3;                // Frames traced per scene and thread count; the median is reported
+    std::vector<int> threads;    // Thread counts, by default 1, 2, 4, ... up to worker_count()
+    std::vector<int> scenes;     // Scene numbers, by default all ten
+    std::string json_path = "bench.json";
+};
+
+struct throughput_run
+{
+    int threads;
+    double wall_secs;    // Median over the runs
+    long long samples;   // Pixel samples per frame, one primary ray each
+    long long rays;      // Rays intersected with the world per frame, primary rays included
+};
+
+static const char *throughput_scene_names[10] = {
+    "random_spheres", "two_spheres", "earth",         "two_perlin_spheres", "quads",
+    "simple_lights",  "cornell_box", "cornell_smoke", "final_scene",        "another_last_scene",
+};
+
+inline throughput_run trace_frame(const scene &s, int threads)
+{
+    // Traces every sample of the frame on threads threads and throws the sums away. Rows are
+    // handed out from a shared counter, and each thread traces with a camera of its own.
+    auto width = s.cam.image_width;
+    auto height = s.cam.output_height();
+    std::atomic<int> next_row(0);
+    std::vector<camera> cams(threads, s.cam);
+    auto before = render_stats_total();
+
+    auto work = [&](camera &cam) {
+        std::vector<color> sums;
+        for (int j; (j = next_row++) < height;)
+        {
+            image_tile tile;
+            tile.x0 = 0;
+            tile.y0 = j;
+            tile.x1 = width;
+            tile.y1 = j + 1;
+            tile.sample_begin = cam.first_sample;
+            tile.sample_end = cam.first_sample + cam.samples_per_pixel;
+            cam.render_tile(s.world, s.lights, tile, sums);
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; t++)
+        pool.emplace_back(work, std::ref(cams[t]));
+    work(cams[0]);
+    for (auto &thread : pool)
+        thread.join();
+
+    throughput_run run = {threads, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(),
+                          static_cast<long long>(width) * height * s.cam.samples_per_pixel, 0};
+    auto after = render_stats_total(); // The pool's blocks have retired, so no thread is counting
+    run.rays = static_cast<long long>(after.traced_rays - before.traced_rays);
+    return run;
+}
+
+inline bool run_throughput_benchmark(throughput_options options)
+{
+    if (options.threads.empty())
+    {
+        for (int t = 1; t < worker_count(); t *= 2)
+            options.threads.push_back(t);
+        options.threads.push_back(worker_count());
+    }
+    if (options.scenes.empty())
+        for (int i = 1; i <= 10; i++)
+            options.scenes.push_back(i);
+
+    RenderParameters params;
+    params.image_width = options.image_width;
+    params.samples_per_pixel = options.samples_per_pixel;
+    params.show_progress = false;
+    auto log_level = LOGCFG.level;
+    LOGCFG.level = WARNING; // Scene builds log every camera parameter
+
+    std::printf("%-20s %7s %9s %10s %10s %10s %8s\n", "scene", "threads", "wall s", "Msamples/s", "Mprimary/s",
+                "Mrays/s", "speedup");
+    std::vector<std::pair<int, std::vector<throughput_run>>> results;
+    for (int i : options.scenes)
+    {
+        scene s;
+        random_generator().seed(std::mt19937::default_seed);
+        if (i < 1 || i > 10 || !build_scene(i, params, s))
+        {
+            std::cerr << "ERROR: There is no scene " << i << ".\n";
+            LOGCFG.level = log_level;
+            return false;
+        }
+
+        // Scenes may pick their own sample count (cornell_smoke does); the benchmark's wins.
+        s.cam.samples_per_pixel = options.samples_per_pixel;
+
+        // One sample per pixel first, so images are decoded and caches warm before the clock runs.
+        auto warm = s;
+        warm.cam.samples_per_pixel = 1;
+        trace_frame(warm, 1);
+
+        std::vector<throughput_run> runs;
+        for (int threads : options.threads)
+        {
+            std::vector<throughput_run> frames;
+            for (int r = 0; r < std::max(1, options.runs); r++)
+                frames.push_back(trace_frame(s, threads));
+            std::sort(frames.begin(), frames.end(),
+                      [](const throughput_run &a, const throughput_run &b) { return a.wall_secs < b.wall_secs; });
+            runs.push_back(frames[frames.size() / 2]);
+
+            const auto &run = runs.back();
+            std::printf("%-20s %7d %9.3f %10.3f %10.3f %10.3f %7.2fx\n", throughput_scene_names[i - 1], threads,
+                        run.wall_secs, run.samples / run.wall_secs / 1e6, run.samples / run.wall_secs / 1e6,
+                        run.rays / run.wall_secs / 1e6, runs.front().wall_secs / run.wall_secs);
+            std::fflush(stdout);
+        }
+        results.push_back({i, runs});
+    }
+    LOGCFG.level = log_level;
+
+    std::ofstream json(options.json_path);
+    json << "{\n"
+         << "  \"image_width\": " << options.image_width << ",\n"
+         << "  \"samples_per_pixel\": " << options.samples_per_pixel << ",\n"
+         << "  \"seed\": " << params.seed << ",\n"
+         << "  \"runs\": " << options.runs << ",\n"
+         << "  \"scenes\": [\n";
+    for (size_t k = 0; k < results.size(); k++)
+    {
+        const auto &runs = results[k].second;
+        json << "    {\"scene\": " << results[k].first << ", \"name\": \"" << throughput_scene_names[results[k].first - 1]
+             << "\", \"samples\": " << runs.front().samples << ", \"threads\": [\n";
+        for (size_t t = 0; t < runs.size(); t++)
+        {
+            const auto &run = runs[t];
+            json << "      {\"threads\": " << run.threads << ", \"wall_secs\": " << run.wall_secs
+                 << ", \"samples_per_sec\": " << run.samples / run.wall_secs
+                 << ", \"primary_rays_per_sec\": " << run.samples / run.wall_secs
+                 << ", \"rays_per_sec\": " << run.rays / run.wall_secs << ", \"rays\": " << run.rays
+                 << ", \"speedup\": " << runs.front().wall_secs / run.wall_secs << '}'
+                 << (t + 1 < runs.size() ? ",\n" : "\n");
+        }
+        json << "    ]}" << (k + 1 < results.size() ? ",\n" : "\n");
+    }
+    json << "  ]\n}\n";
+    json.close();
+    if (!json)
+    {
+        std::cerr << "ERROR: Could not write '" << options.json_path << "'.\n";
+        return false;
+    }
+    std::cout << "Results written to " << options.json_path << std::endl;
+    return true;
+}
+
+#endif
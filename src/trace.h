@@ -0,0 +1,147 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Timeline tracing: where wall time goes, per thread, as Chrome trace-event JSON that opens in
+// Perfetto (ui.perfetto.dev) or chrome://tracing. Builds with RTW_TRACE defined (cmake
+// -DRTW_TRACE=ON) record every RTW_TRACE_ZONE("name") scope as a span on its thread's track; in
+// other builds the macros are nothing. Each thread appends to its own buffer, so recording takes
+// no lock (see thread_registry.h); a buffer is handed to the registry when its thread exits, and
+// write_trace() collects the retired and the live ones.
+
+#include "thread_registry.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct trace_event
+{
+    const char *name; // A string literal, so recording never copies or allocates for it
+    int64_t begin;    // Nanoseconds since the first traced event of the process
+    int64_t end;
+};
+
+struct trace_buffer
+{
+    int thread; // Numbered from 1 in the order threads first trace
+    std::vector<trace_event> events;
+
+    trace_buffer()
+    {
+        static std::atomic<int> threads(0);
+        thread = ++threads;
+        events.reserve(4096);
+    }
+};
+
+inline int64_t trace_clock()
+{
+    static const auto epoch = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+inline void retire_trace_buffer(std::vector<trace_buffer> &retired, trace_buffer &buffer)
+{
+    retired.push_back(std::move(buffer));
+}
+
+using trace_registry = thread_registry<trace_buffer, std::vector<trace_buffer>, retire_trace_buffer>;
+
+inline trace_buffer &local_trace_buffer()
+{
+    // This thread's buffer, registered the first time the thread records something.
+    thread_local thread_block<trace_registry> block;
+    return block.block;
+}
+
+inline bool write_trace(const std::string &path)
+{
+    // Writes every event recorded so far as one complete ("X") event each, with a name for each
+    // thread's track. Call this while no other thread is tracing.
+    std::ofstream out(path);
+    out << std::fixed << std::setprecision(3); // Microseconds, to the nanosecond
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    bool first = true;
+    auto write_buffer = [&](const trace_buffer &buffer) {
+        out << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+            << buffer.thread << ", \"args\": {\"name\": \"thread " << buffer.thread << "\"}}";
+        first = false;
+        for (const auto &e : buffer.events)
+            out << ",\n{\"name\": \"" << e.name << "\", \"cat\": \"rtw\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+                << buffer.thread << ", \"ts\": " << e.begin / 1e3 << ", \"dur\": " << (e.end - e.begin) / 1e3 << '}';
+    };
+    auto write_all = [&](const std::vector<trace_buffer> &retired, const std::vector<trace_buffer *> &live) {
+        for (const auto &buffer : retired)
+            write_buffer(buffer);
+        for (auto buffer : live)
+            write_buffer(*buffer);
+    };
+    trace_registry::global().read(write_all);
+    out << "\n]}\n";
+    out.close();
+    if (!out)
+    {
+        std::cerr << "ERROR: Could not write the trace '" << path << "'.\n";
+        return false;
+    }
+    return true;
+}
+
+class trace_zone
+{
+    // Records the span from its construction to its destruction on this thread's track.
+  public:
+    trace_zone(const char *_name, bool _record = true) : name(_name), record(_record), begin(record ? trace_clock() : 0)
+    {
+    }
+
+    ~trace_zone()
+    {
+        if (record)
+            local_trace_buffer().events.push_back({name, begin, trace_clock()});
+    }
+
+    trace_zone(const trace_zone &) = delete;
+    trace_zone &operator=(const trace_zone &) = delete;
+
+  private:
+    const char *name;
+    bool record;
+    int64_t begin;
+};
+
+#define RTW_TRACE_JOIN2(a, b) a##b
+#define RTW_TRACE_JOIN(a, b) RTW_TRACE_JOIN2(a, b)
+
+#ifdef RTW_TRACE
+const bool render_trace_enabled = true;
+#define RTW_TRACE_ZONE(name) trace_zone RTW_TRACE_JOIN(trace_zone_, __LINE__)(name)
+#define RTW_TRACE_ZONE_IF(condition, name) trace_zone RTW_TRACE_JOIN(trace_zone_, __LINE__)(name, condition)
+#else
+const bool render_trace_enabled = false;
+#define RTW_TRACE_ZONE(name) ((void)0)
+#define RTW_TRACE_ZONE_IF(condition, name) ((void)0)
+#endif
+
+struct render_trace_report
+{
+    // Writes the trace to path when it goes out of scope, in RTW_TRACE builds.
+    std::string path;
+
+    render_trace_report(const std::string &_path) : path(_path)
+    {
+    }
+
+    ~render_trace_report()
+    {
+        if (render_trace_enabled && write_trace(path))
+            std::clog << "Trace written to " << path << " (open it in ui.perfetto.dev)\n";
+    }
+};
+
+#endif
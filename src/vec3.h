@@ -151,27 +151,25 @@ inline vec3 unit_vector(vec3 v)
 
 inline vec3 random_in_unit_disk()
 {
-    while (true)
-    {
-        auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-        if (p.length_squared() < 1)
-            return p;
-    }
+    // Polar mapping of two uniform numbers rather than rejection sampling, so that stratified
+    // inputs give stratified points and every call uses exactly two sampling dimensions.
+    auto r = sqrt(random_double());
+    auto phi = 2 * pi * random_double();
+    return vec3(r * cos(phi), r * sin(phi), 0);
 }
 
-inline vec3 random_in_unit_sphere()
+inline vec3 random_unit_vector()
 {
-    while (true)
-    {
-        auto p = vec3::random(-1, 1);
-        if (p.length_squared() < 1)
-            return p;
-    }
+    // Uniform direction from two uniform numbers (Archimedes' projection).
+    auto z = 1 - 2 * random_double();
+    auto phi = 2 * pi * random_double();
+    auto r = sqrt(fmax(0.0, 1 - z * z));
+    return vec3(r * cos(phi), r * sin(phi), z);
 }
 
-inline vec3 random_unit_vector()
+inline vec3 random_in_unit_sphere()
 {
-    return unit_vector(random_in_unit_sphere());
+    return random_unit_vector() * std::cbrt(random_double());
 }
 
 inline vec3 random_on_hemisphere(const vec3 &normal)
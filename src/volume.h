@@ -0,0 +1,407 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "material.h"
+#include "texture.h"
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+class density_grid
+{
+  public:
+    density_grid(const aabb &_bounds, int _nx, int _ny, int _nz, const std::function<double(const point3 &)> &f)
+        : bounds(_bounds), nx(_nx), ny(_ny), nz(_nz), values(static_cast<size_t>(_nx) * _ny * _nz)
+    {
+        // Sample the density function once at every voxel center.
+        min_density = infinity;
+        max_density = 0;
+        for (int k = 0; k < nz; k++)
+            for (int j = 0; j < ny; j++)
+                for (int i = 0; i < nx; i++)
+                {
+                    auto p = point3(bounds.x.min + (i + 0.5) * bounds.x.size() / nx,
+                                    bounds.y.min + (j + 0.5) * bounds.y.size() / ny,
+                                    bounds.z.min + (k + 0.5) * bounds.z.size() / nz);
+                    auto d = fmax(0.0, f(p));
+                    values[index(i, j, k)] = static_cast<float>(d);
+                    min_density = fmin(min_density, d);
+                    max_density = fmax(max_density, d);
+                }
+    }
+
+    double density(const point3 &p) const
+    {
+        // Trilinearly interpolate the voxel values around p.
+        auto gx = (p.x() - bounds.x.min) / bounds.x.size() * nx - 0.5;
+        auto gy = (p.y() - bounds.y.min) / bounds.y.size() * ny - 0.5;
+        auto gz = (p.z() - bounds.z.min) / bounds.z.size() * nz - 0.5;
+
+        auto i = static_cast<int>(floor(gx));
+        auto j = static_cast<int>(floor(gy));
+        auto k = static_cast<int>(floor(gz));
+        auto u = gx - i;
+        auto v = gy - j;
+        auto w = gz - k;
+
+        auto accum = 0.0;
+        for (int di = 0; di < 2; di++)
+            for (int dj = 0; dj < 2; dj++)
+                for (int dk = 0; dk < 2; dk++)
+                    accum += (di ? u : 1 - u) * (dj ? v : 1 - v) * (dk ? w : 1 - w) * voxel(i + di, j + dj, k + dk);
+        return accum;
+    }
+
+    double voxel(int i, int j, int k) const
+    {
+        // Voxel lookups outside the grid are clamped to the nearest border voxel.
+        i = std::min(std::max(i, 0), nx - 1);
+        j = std::min(std::max(j, 0), ny - 1);
+        k = std::min(std::max(k, 0), nz - 1);
+        return values[index(i, j, k)];
+    }
+
+    int resolution(int axis) const
+    {
+        return axis == 0 ? nx : axis == 1 ? ny : nz;
+    }
+
+    double min_value() const
+    {
+        return min_density;
+    }
+    double max_value() const
+    {
+        return max_density;
+    }
+
+    const aabb &bounding_box() const
+    {
+        return bounds;
+    }
+
+  private:
+    aabb bounds;
+    int nx, ny, nz;
+    std::vector<float> values;
+    double min_density, max_density;
+
+    size_t index(int i, int j, int k) const
+    {
+        return (static_cast<size_t>(k) * ny + j) * nx + i;
+    }
+};
+
+class majorant_grid
+{
+  public:
+    majorant_grid(const density_grid &grid, int cell_voxels = 8)
+    {
+        // Every coarse cell stores the maximum density reachable inside it. Trilinear lookups
+        // also read the voxels just outside a cell, so the search range is padded by one.
+        for (int a = 0; a < 3; a++)
+            res[a] = std::max(1, (grid.resolution(a) + cell_voxels - 1) / cell_voxels);
+
+        const auto &b = grid.bounding_box();
+        for (int a = 0; a < 3; a++)
+            cell_size[a] = b.axis(a).size() / res[a];
+        origin = point3(b.x.min, b.y.min, b.z.min);
+
+        cells.resize(static_cast<size_t>(res[0]) * res[1] * res[2]);
+        for (int k = 0; k < res[2]; k++)
+            for (int j = 0; j < res[1]; j++)
+                for (int i = 0; i < res[0]; i++)
+                {
+                    int lo[3], hi[3], c[3] = {i, j, k};
+                    for (int a = 0; a < 3; a++)
+                    {
+                        lo[a] = c[a] * grid.resolution(a) / res[a] - 1;
+                        hi[a] = ((c[a] + 1) * grid.resolution(a) + res[a] - 1) / res[a];
+                    }
+
+                    auto m = 0.0;
+                    for (int z = lo[2]; z <= hi[2]; z++)
+                        for (int y = lo[1]; y <= hi[1]; y++)
+                            for (int x = lo[0]; x <= hi[0]; x++)
+                                m = fmax(m, grid.voxel(x, y, z));
+                    cells[index(i, j, k)] = static_cast<float>(m);
+                }
+    }
+
+    double majorant(int i, int j, int k) const
+    {
+        return cells[index(i, j, k)];
+    }
+
+    int resolution(int axis) const
+    {
+        return res[axis];
+    }
+
+    double cell_extent(int axis) const
+    {
+        return cell_size[axis];
+    }
+
+    const point3 &grid_origin() const
+    {
+        return origin;
+    }
+
+  private:
+    int res[3];
+    double cell_size[3];
+    point3 origin;
+    std::vector<float> cells;
+
+    size_t index(int i, int j, int k) const
+    {
+        return (static_cast<size_t>(k) * res[1] + j) * res[0] + i;
+    }
+};
+
+class grid_medium : public hittable
+{
+  public:
+    grid_medium(shared_ptr<density_grid> g, shared_ptr<texture> a, double scale = 1.0)
+        : grid(g), majorants(*g), density_scale(scale), phase_function(make_shared<isotropic>(a))
+    {
+    }
+
+    grid_medium(shared_ptr<density_grid> g, color c, double scale = 1.0)
+        : grid(g), majorants(*g), density_scale(scale), phase_function(make_shared<isotropic>(c))
+    {
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        if (!clip(r, ray_t))
+            return false;
+
+        auto ray_length = r.direction().length();
+        double t_hit = -1;
+
+        if (is_homogeneous())
+        {
+            // Closed-form free-flight sample, exactly as in constant_medium.
+            auto sigma = density_scale * grid->max_value();
+            auto hit_distance = -log(1 - random_double()) / sigma;
+            if (hit_distance > ray_t.size() * ray_length)
+                return false;
+            t_hit = ray_t.min + hit_distance / ray_length;
+        }
+        else
+        {
+            // Delta tracking against the per-cell majorant; empty cells are skipped entirely.
+            traverse(r, ray_t, [&](double t0, double t1, double majorant) {
+                if (majorant <= 0)
+                    return true;
+                auto t = t0;
+                while (true)
+                {
+                    t -= log(1 - random_double()) / (majorant * ray_length);
+                    if (t >= t1)
+                        return true;
+                    if (random_double() * majorant < density_scale * grid->density(r.at(t)))
+                    {
+                        t_hit = t;
+                        return false;
+                    }
+                }
+            });
+            if (t_hit < 0)
+                return false;
+        }
+
+        rec.t = t_hit;
+        rec.p = r.at(rec.t);
+        rec.normal = vec3(1, 0, 0); // arbitrary
+        rec.front_face = true;      // also arbitrary
+        rec.mat = phase_function.get();
+        rec.prim_id = id;
+
+        return true;
+    }
+
+    double transmittance(const ray &r, interval ray_t) const
+    {
+        // Ratio-tracking estimate of the transmittance along the ray segment.
+        if (!clip(r, ray_t))
+            return 1.0;
+
+        auto ray_length = r.direction().length();
+        if (is_homogeneous())
+            return exp(-density_scale * grid->max_value() * ray_t.size() * ray_length);
+
+        auto tr = 1.0;
+        traverse(r, ray_t, [&](double t0, double t1, double majorant) {
+            if (majorant <= 0)
+                return true;
+            auto t = t0;
+            while (true)
+            {
+                t -= log(1 - random_double()) / (majorant * ray_length);
+                if (t >= t1)
+                    return true;
+                tr *= 1 - density_scale * grid->density(r.at(t)) / majorant;
+            }
+        });
+        return tr;
+    }
+
+    aabb bounding_box() const override
+    {
+        return grid->bounding_box();
+    }
+
+  private:
+    shared_ptr<density_grid> grid;
+    majorant_grid majorants;
+    double density_scale;
+    shared_ptr<material> phase_function;
+
+    bool is_homogeneous() const
+    {
+        return grid->min_value() == grid->max_value();
+    }
+
+    bool clip(const ray &r, interval &ray_t) const
+    {
+        // Narrow ray_t to the part of the ray inside the grid bounds.
+        const auto &b = grid->bounding_box();
+        for (int a = 0; a < 3; a++)
+        {
+            auto invD = 1 / r.direction()[a];
+            auto t0 = (b.axis(a).min - r.origin()[a]) * invD;
+            auto t1 = (b.axis(a).max - r.origin()[a]) * invD;
+            if (invD < 0)
+                std::swap(t0, t1);
+            ray_t.min = fmax(t0, ray_t.min);
+            ray_t.max = fmin(t1, ray_t.max);
+            if (ray_t.max <= ray_t.min)
+                return false;
+        }
+        return true;
+    }
+
+    template <typename F> void traverse(const ray &r, const interval &ray_t, F &&visit) const
+    {
+        // Walk the majorant cells pierced by the clipped segment (3D DDA), calling
+        // visit(t_enter, t_exit, majorant) for each one until it returns false.
+        auto start = r.at(ray_t.min);
+        int cell[3], step[3], res[3];
+        double t_next[3], t_delta[3];
+
+        for (int a = 0; a < 3; a++)
+        {
+            res[a] = majorants.resolution(a);
+            auto extent = majorants.cell_extent(a);
+            auto local = (start[a] - majorants.grid_origin()[a]) / extent;
+            cell[a] = std::min(std::max(static_cast<int>(floor(local)), 0), res[a] - 1);
+
+            auto d = r.direction()[a];
+            if (d > 0)
+            {
+                step[a] = 1;
+                t_next[a] = ray_t.min + ((cell[a] + 1) - local) * extent / d;
+                t_delta[a] = extent / d;
+            }
+            else if (d < 0)
+            {
+                step[a] = -1;
+                t_next[a] = ray_t.min + (cell[a] - local) * extent / d;
+                t_delta[a] = -extent / d;
+            }
+            else
+            {
+                step[a] = 0;
+                t_next[a] = infinity;
+                t_delta[a] = infinity;
+            }
+        }
+
+        auto t = ray_t.min;
+        while (t < ray_t.max)
+        {
+            int axis = (t_next[0] < t_next[1]) ? ((t_next[0] < t_next[2]) ? 0 : 2) : ((t_next[1] < t_next[2]) ? 1 : 2);
+            auto t_exit = fmin(t_next[axis], ray_t.max);
+
+            if (!visit(t, t_exit, density_scale * majorants.majorant(cell[0], cell[1], cell[2])))
+                return;
+
+            t = t_exit;
+            cell[axis] += step[axis];
+            if (cell[axis] < 0 || cell[axis] >= res[axis])
+                return;
+            t_next[axis] += t_delta[axis];
+        }
+    }
+};
+
+class atmosphere
+{
+  public:
+    // A homogeneous medium filling a ball of the given radius around center, e.g. a haze over
+    // the whole scene. It is never put in the world list; the camera samples it analytically
+    // along every ray segment between surface hits. The radius has to be finite: in an unbounded
+    // medium every ray that escapes the scene would scatter, and none would reach the background.
+    atmosphere(double d, color c, const point3 &_center, double _radius)
+        : density(d), center(_center), radius(_radius), phase_function(make_shared<isotropic>(c))
+    {
+    }
+
+    atmosphere(double d, shared_ptr<texture> a, const point3 &_center, double _radius)
+        : density(d), center(_center), radius(_radius), phase_function(make_shared<isotropic>(a))
+    {
+    }
+
+    bool sample(const ray &r, interval ray_t, hit_record &rec) const
+    {
+        // Sample a scattering event on the part of the segment ray_t inside the ball. Returns
+        // false (leaving rec untouched) when the ray travels through it without scattering.
+        if (!clip(r, ray_t))
+            return false;
+
+        auto ray_length = r.direction().length();
+        auto hit_distance = -log(1 - random_double()) / density;
+        if (hit_distance >= ray_t.size() * ray_length)
+            return false;
+
+        rec.t = ray_t.min + hit_distance / ray_length;
+        rec.p = r.at(rec.t);
+        rec.normal = vec3(1, 0, 0); // arbitrary
+        rec.front_face = true;      // also arbitrary
+        rec.mat = phase_function.get();
+
+        return true;
+    }
+
+  private:
+    double density;
+    point3 center;
+    double radius;
+    shared_ptr<material> phase_function;
+
+    bool clip(const ray &r, interval &ray_t) const
+    {
+        // Narrows ray_t to where the ray is inside the ball; false if that part is empty.
+        vec3 oc = r.origin() - center;
+        auto a = r.direction().length_squared();
+        auto half_b = dot(oc, r.direction());
+        auto c = oc.length_squared() - radius * radius;
+        auto discriminant = half_b * half_b - a * c;
+        if (discriminant < 0)
+            return false;
+
+        auto sqrtd = sqrt(discriminant);
+        ray_t.min = fmax(ray_t.min, (-half_b - sqrtd) / a);
+        ray_t.max = fmin(ray_t.max, (-half_b + sqrtd) / a);
+        return ray_t.min < ray_t.max;
+    }
+};
+
+#endif
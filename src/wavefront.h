@@ -0,0 +1,211 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "aov.h"
+#include "hittable.h"
+#include "material.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+class path_queue
+{
+    // In-flight path state for the wavefront renderer, one entry per path. The fields are kept
+    // as separate arrays so that each stage only streams through the data it uses.
+  public:
+    std::vector<point3> origin;
+    std::vector<vec3> direction;
+    std::vector<double> time;
+    std::vector<double> cone_width;    // Ray footprint width at the origin
+    std::vector<color> throughput;     // Product of the path weights so far
+    std::vector<color> radiance;       // Light gathered so far, added to the pixel when the path ends
+    std::vector<int> pixel;            // Index of the pixel the path contributes to
+    std::vector<int> depth;            // Bounces left before the path is terminated
+    std::vector<sample_stream> stream; // Random stream of the pixel sample the path belongs to
+    std::vector<first_hit> first;      // What the camera ray hit, for the auxiliary outputs
+    std::vector<hit_record> hit;       // Written by the extend stage, read by the shade stage
+    std::vector<char> alive;           // Cleared by any stage that terminates the path
+
+    int size() const
+    {
+        return static_cast<int>(pixel.size());
+    }
+
+    void reserve(int n)
+    {
+        origin.reserve(n);
+        direction.reserve(n);
+        time.reserve(n);
+        cone_width.reserve(n);
+        throughput.reserve(n);
+        radiance.reserve(n);
+        pixel.reserve(n);
+        depth.reserve(n);
+        stream.reserve(n);
+        first.reserve(n);
+        hit.reserve(n);
+        alive.reserve(n);
+    }
+
+    void push(const ray &r, int pixel_index, int max_depth, const sample_stream &sample)
+    {
+        origin.push_back(r.origin());
+        direction.push_back(r.direction());
+        time.push_back(r.time());
+        cone_width.push_back(0);
+        throughput.push_back(color(1, 1, 1));
+        radiance.push_back(color(0, 0, 0));
+        pixel.push_back(pixel_index);
+        depth.push_back(max_depth);
+        stream.push_back(sample);
+        first.emplace_back();
+        hit.emplace_back();
+        alive.push_back(1);
+    }
+
+    ray path_ray(int i) const
+    {
+        return ray(origin[i], direction[i], time[i]);
+    }
+
+    void set_ray(int i, const ray &r)
+    {
+        origin[i] = r.origin();
+        direction[i] = r.direction();
+        time[i] = r.time();
+    }
+
+    void compact()
+    {
+        // Drop terminated paths, keeping the survivors in their original order so neighbouring
+        // paths stay neighbours.
+        int n = 0;
+        for (int i = 0; i < size(); i++)
+        {
+            if (!alive[i])
+                continue;
+            if (n != i)
+            {
+                origin[n] = origin[i];
+                direction[n] = direction[i];
+                time[n] = time[i];
+                cone_width[n] = cone_width[i];
+                throughput[n] = throughput[i];
+                radiance[n] = radiance[i];
+                pixel[n] = pixel[i];
+                depth[n] = depth[i];
+                stream[n] = stream[i];
+                first[n] = first[i];
+                alive[n] = 1;
+            }
+            n++;
+        }
+        resize(n);
+    }
+
+    void reorder(const std::vector<int> &order)
+    {
+        // Permute the paths so that entry i becomes the former entry order[i]. Hit records are
+        // not carried along; the next extend stage overwrites them.
+        auto gather = [&](auto &field) {
+            auto old = field;
+            for (size_t i = 0; i < order.size(); i++)
+                field[i] = old[order[i]];
+        };
+        gather(origin);
+        gather(direction);
+        gather(time);
+        gather(cone_width);
+        gather(throughput);
+        gather(radiance);
+        gather(pixel);
+        gather(depth);
+        gather(stream);
+        gather(first);
+    }
+
+  private:
+    void resize(int n)
+    {
+        origin.resize(n);
+        direction.resize(n);
+        time.resize(n);
+        cone_width.resize(n);
+        throughput.resize(n);
+        radiance.resize(n);
+        pixel.resize(n);
+        depth.resize(n);
+        stream.resize(n);
+        first.resize(n);
+        hit.resize(n);
+        alive.resize(n);
+    }
+};
+
+inline void sort_by_material(const path_queue &paths, std::vector<int> &order)
+{
+    // Counting sort of the live paths by the kind of material they hit, so the shade stage runs
+    // each material's code over a contiguous run of paths.
+    const int kinds = material::isotropic_kind + 1;
+    int start[kinds + 1] = {0};
+    for (int i = 0; i < paths.size(); i++)
+        if (paths.alive[i])
+            start[paths.hit[i].mat->kind + 1]++;
+    for (int k = 0; k < kinds; k++)
+        start[k + 1] += start[k];
+
+    order.resize(start[kinds]);
+    for (int i = 0; i < paths.size(); i++)
+        if (paths.alive[i])
+            order[start[paths.hit[i].mat->kind]++] = i;
+}
+
+inline uint64_t spread_bits(uint64_t v)
+{
+    // Spread the low 10 bits of v so they occupy every third bit.
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x30000ff;
+    v = (v | (v << 8)) & 0x300f00f;
+    v = (v | (v << 4)) & 0x30c30c3;
+    v = (v | (v << 2)) & 0x9249249;
+    return v;
+}
+
+inline uint64_t ray_sort_key(const point3 &origin, const vec3 &direction, const aabb &bounds)
+{
+    // Direction octant in the top bits, then a 30-bit Morton code of the origin within the scene
+    // bounds. Rays with equal keys start close together and head the same way, so they tend to
+    // visit the same BVH nodes.
+    uint64_t octant = (direction.x() < 0 ? 1 : 0) | (direction.y() < 0 ? 2 : 0) | (direction.z() < 0 ? 4 : 0);
+
+    auto cell = [](double x, const interval &extent) {
+        auto f = extent.size() > 0 ? (x - extent.min) / extent.size() : 0.0;
+        return static_cast<uint64_t>(interval(0, 1023).clamp(f * 1024));
+    };
+    auto morton = spread_bits(cell(origin.x(), bounds.x)) | (spread_bits(cell(origin.y(), bounds.y)) << 1) |
+                  (spread_bits(cell(origin.z(), bounds.z)) << 2);
+
+    return (octant << 30) | morton;
+}
+
+inline void sort_by_ray_key(path_queue &paths, const aabb &bounds, std::vector<std::pair<uint64_t, int>> &keys,
+                            std::vector<int> &order)
+{
+    // Reorder the queued paths by ray_sort_key() before they are traced.
+    keys.resize(paths.size());
+    for (int i = 0; i < paths.size(); i++)
+        keys[i] = {ray_sort_key(paths.origin[i], paths.direction[i], bounds), i};
+    std::sort(keys.begin(), keys.end());
+
+    order.resize(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+        order[i] = keys[i].second;
+    paths.reorder(order);
+}
+
+#endif